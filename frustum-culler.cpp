@@ -0,0 +1,113 @@
+#include "frustum-culler.h"
+
+//  x86 targets, others cull every sphere with the scalar loop
+#if defined( __SSE2__ ) || defined( _M_X64 ) || defined( _M_IX86 )
+#define FRUSTUM_CULLER_SSE
+#include <immintrin.h>
+#endif
+
+Frustum Frustum::from_matrix( const glm::mat4& view_projection )
+{
+	//  rows of the matrix, glm is column major
+	glm::vec4 rows[4];
+	for ( int i = 0; i < 4; i++ )
+	{
+		rows[i] = glm::vec4( view_projection[0][i], view_projection[1][i], view_projection[2][i], view_projection[3][i] );
+	}
+
+	Frustum frustum;
+	frustum.Planes[0] = rows[3] + rows[0];  //  left
+	frustum.Planes[1] = rows[3] - rows[0];  //  right
+	frustum.Planes[2] = rows[3] + rows[1];  //  bottom
+	frustum.Planes[3] = rows[3] - rows[1];  //  top
+	//  near for a -1 to 1 depth range, conservative with a 0 to 1 range
+	frustum.Planes[4] = rows[3] + rows[2];
+	frustum.Planes[5] = rows[3] - rows[2];  //  far
+
+	for ( auto& plane : frustum.Planes )
+	{
+		plane /= glm::length( glm::vec3( plane ) );
+	}
+	return frustum;
+}
+
+static bool is_sphere_visible( const Frustum& frustum, float x, float y, float z, float radius )
+{
+	for ( const auto& plane : frustum.Planes )
+	{
+		if ( plane.x * x + plane.y * y + plane.z * z + plane.w < -radius ) return false;
+	}
+	return true;
+}
+
+void cull_spheres(
+	const Frustum& frustum,
+	const float* xs,
+	const float* ys,
+	const float* zs,
+	const float* radii,
+	uint32_t count,
+	uint8_t* visible
+)
+{
+	uint32_t i = 0;
+
+#if defined( FRUSTUM_CULLER_SSE )
+#if defined( __AVX__ )
+	for ( ; i + 8 <= count; i += 8 )
+	{
+		__m256 x = _mm256_loadu_ps( xs + i );
+		__m256 y = _mm256_loadu_ps( ys + i );
+		__m256 z = _mm256_loadu_ps( zs + i );
+		__m256 negative_radius = _mm256_sub_ps( _mm256_setzero_ps(), _mm256_loadu_ps( radii + i ) );
+
+		//  inside or intersecting every plane
+		__m256 inside = _mm256_castsi256_ps( _mm256_set1_epi32( -1 ) );
+		for ( const auto& plane : frustum.Planes )
+		{
+			__m256 distance = _mm256_add_ps(
+				_mm256_add_ps( _mm256_mul_ps( x, _mm256_set1_ps( plane.x ) ), _mm256_mul_ps( y, _mm256_set1_ps( plane.y ) ) ),
+				_mm256_add_ps( _mm256_mul_ps( z, _mm256_set1_ps( plane.z ) ), _mm256_set1_ps( plane.w ) )
+			);
+			inside = _mm256_and_ps( inside, _mm256_cmp_ps( distance, negative_radius, _CMP_GE_OQ ) );
+		}
+
+		int mask = _mm256_movemask_ps( inside );
+		for ( int k = 0; k < 8; k++ )
+		{
+			visible[i + k] = ( mask >> k ) & 1;
+		}
+	}
+#endif
+
+	for ( ; i + 4 <= count; i += 4 )
+	{
+		__m128 x = _mm_loadu_ps( xs + i );
+		__m128 y = _mm_loadu_ps( ys + i );
+		__m128 z = _mm_loadu_ps( zs + i );
+		__m128 negative_radius = _mm_sub_ps( _mm_setzero_ps(), _mm_loadu_ps( radii + i ) );
+
+		//  inside or intersecting every plane
+		__m128 inside = _mm_castsi128_ps( _mm_set1_epi32( -1 ) );
+		for ( const auto& plane : frustum.Planes )
+		{
+			__m128 distance = _mm_add_ps(
+				_mm_add_ps( _mm_mul_ps( x, _mm_set1_ps( plane.x ) ), _mm_mul_ps( y, _mm_set1_ps( plane.y ) ) ),
+				_mm_add_ps( _mm_mul_ps( z, _mm_set1_ps( plane.z ) ), _mm_set1_ps( plane.w ) )
+			);
+			inside = _mm_and_ps( inside, _mm_cmpge_ps( distance, negative_radius ) );
+		}
+
+		int mask = _mm_movemask_ps( inside );
+		for ( int k = 0; k < 4; k++ )
+		{
+			visible[i + k] = ( mask >> k ) & 1;
+		}
+	}
+#endif
+
+	for ( ; i < count; i++ )
+	{
+		visible[i] = is_sphere_visible( frustum, xs[i], ys[i], zs[i], radii[i] ) ? 1 : 0;
+	}
+}
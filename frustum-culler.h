@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+//  Planes of a view frustum, normals pointing inside, normalized so that
+//  plane distances are in world units.
+struct Frustum
+{
+	glm::vec4 Planes[6];
+
+	static Frustum from_matrix( const glm::mat4& view_projection );
+};
+
+//  Test world-space bounding spheres against a frustum, several at once with
+//  SSE (or AVX when compiled for it) on x86, one at a time elsewhere. Spheres
+//  are given as separate arrays of coordinates & radii; visible[i] is set to 1
+//  if sphere i may be visible.
+void cull_spheres(
+	const Frustum& frustum,
+	const float* xs,
+	const float* ys,
+	const float* zs,
+	const float* radii,
+	uint32_t count,
+	uint8_t* visible
+);
@@ -0,0 +1,162 @@
+#include "job-system.h"
+
+#include <algorithm>
+
+void JobSystem::init( uint32_t worker_count )
+{
+	if ( worker_count == 0 )
+	{
+		//  hardware_concurrency may be unknown and return 0
+		uint32_t hardware_threads = std::thread::hardware_concurrency();
+		worker_count = hardware_threads > 1 ? hardware_threads - 1 : 1;
+	}
+
+	IsStopping = false;
+	Workers.reserve( worker_count );
+	for ( uint32_t i = 0; i < worker_count; i++ )
+	{
+		Workers.emplace_back( &JobSystem::work, this, i + 1 );
+	}
+}
+
+void JobSystem::release()
+{
+	{
+		std::lock_guard<std::mutex> lock( Mutex );
+		IsStopping = true;
+	}
+	JobAvailable.notify_all();
+
+	for ( auto& worker : Workers )
+	{
+		worker.join();
+	}
+	Workers.clear();
+	Queue.clear();
+}
+
+void JobSystem::submit( Job job, JobCounter* counter )
+{
+	counter->Pending++;
+
+	//  without workers, run in place
+	if ( Workers.empty() )
+	{
+		QueuedJob queued_job { std::move( job ), counter };
+		run( queued_job, 0 );
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock( Mutex );
+		Queue.push_back( QueuedJob { std::move( job ), counter } );
+	}
+	JobAvailable.notify_one();
+}
+
+void JobSystem::wait( JobCounter* counter )
+{
+	while ( !counter->is_done() )
+	{
+		std::unique_lock<std::mutex> lock( Mutex );
+
+		//  help instead of sleeping
+		if ( !Queue.empty() )
+		{
+			QueuedJob job = std::move( Queue.front() );
+			Queue.pop_front();
+			lock.unlock();
+
+			run( job, 0 );
+			continue;
+		}
+
+		JobFinished.wait( lock, [&] { return counter->is_done() || !Queue.empty(); } );
+	}
+
+	std::exception_ptr exception;
+	{
+		std::lock_guard<std::mutex> lock( Mutex );
+		std::swap( exception, counter->FirstException );
+	}
+	if ( exception ) std::rethrow_exception( exception );
+}
+
+void JobSystem::parallel_for( uint32_t count, uint32_t min_batch_size, const RangeJob& job )
+{
+	if ( count == 0 ) return;
+
+	uint32_t batch_count = get_batch_count( count, min_batch_size );
+	uint32_t batch_size = ( count + batch_count - 1 ) / batch_count;
+
+	//  the job outlives none of these, capture by reference
+	JobCounter counter;
+	for ( uint32_t begin = batch_size; begin < count; begin += batch_size )
+	{
+		uint32_t end = std::min( begin + batch_size, count );
+		submit( [&job, begin, end]( uint32_t thread_index ) { job( begin, end, thread_index ); }, &counter );
+	}
+
+	//  first batch on the calling thread; batches left point into this frame,
+	//  they must be done before it unwinds
+	try
+	{
+		job( 0, std::min( batch_size, count ), 0 );
+	}
+	catch ( ... )
+	{
+		try
+		{
+			wait( &counter );
+		}
+		catch ( ... )
+		{
+		}
+		throw;
+	}
+	wait( &counter );
+}
+
+uint32_t JobSystem::get_batch_count( uint32_t count, uint32_t min_batch_size ) const
+{
+	if ( count == 0 ) return 0;
+	return std::max( std::min( count / std::max( min_batch_size, 1u ), get_thread_count() ), 1u );
+}
+
+void JobSystem::work( uint32_t thread_index )
+{
+	while ( true )
+	{
+		QueuedJob job;
+		{
+			std::unique_lock<std::mutex> lock( Mutex );
+			JobAvailable.wait( lock, [&] { return IsStopping || !Queue.empty(); } );
+			if ( IsStopping ) return;
+
+			job = std::move( Queue.front() );
+			Queue.pop_front();
+		}
+
+		run( job, thread_index );
+	}
+}
+
+void JobSystem::run( QueuedJob& job, uint32_t thread_index )
+{
+	try
+	{
+		job.Function( thread_index );
+	}
+	catch ( ... )
+	{
+		std::lock_guard<std::mutex> lock( Mutex );
+		if ( !job.Counter->FirstException ) job.Counter->FirstException = std::current_exception();
+	}
+
+	//  decrement under the lock, so that a waiter can't miss the notification
+	{
+		std::lock_guard<std::mutex> lock( Mutex );
+		job.Counter->Pending--;
+	}
+	JobFinished.notify_all();
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//  counts the unfinished jobs of a group, to wait on them
+struct JobCounter
+{
+	std::atomic<uint32_t> Pending { 0 };
+	std::exception_ptr FirstException;  //  of the group's jobs, guarded by the job system's mutex
+
+	bool is_done() const { return Pending.load() == 0; }
+};
+
+//  Pool of worker threads running jobs from a shared queue. Jobs receive the
+//  index of the thread running them, from 1 to the worker count; the thread
+//  waiting on a counter is index 0 and helps by running queued jobs.
+//  Only one thread (e.g. the main thread) may submit & wait.
+class JobSystem
+{
+public:
+	using Job = std::function<void( uint32_t thread_index )>;
+	using RangeJob = std::function<void( uint32_t begin, uint32_t end, uint32_t thread_index )>;
+
+	//  0 uses every hardware thread but the calling one
+	void init( uint32_t worker_count = 0 );
+	void release();
+
+	void submit( Job job, JobCounter* counter );
+	//  run queued jobs until the counter reaches zero, rethrows the first
+	//  exception thrown by one of its jobs
+	void wait( JobCounter* counter );
+
+	//  split [0, count) in batches of at least min_batch_size items, one per
+	//  thread at most, and wait for all of them, even when one throws
+	void parallel_for( uint32_t count, uint32_t min_batch_size, const RangeJob& job );
+
+	//  how many batches parallel_for splits count items in
+	uint32_t get_batch_count( uint32_t count, uint32_t min_batch_size ) const;
+
+	//  workers & the waiting thread
+	uint32_t get_thread_count() const { return (uint32_t)Workers.size() + 1; }
+
+private:
+	struct QueuedJob
+	{
+		Job Function;
+		JobCounter* Counter = nullptr;
+	};
+
+	std::vector<std::thread> Workers;
+	std::deque<QueuedJob> Queue;
+	std::mutex Mutex;
+	std::condition_variable JobAvailable;
+	std::condition_variable JobFinished;
+	bool IsStopping = false;
+
+	void work( uint32_t thread_index );
+	void run( QueuedJob& job, uint32_t thread_index );
+};
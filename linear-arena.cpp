@@ -0,0 +1,99 @@
+#include "linear-arena.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+#include <utility>
+
+LinearArena::LinearArena( LinearArena&& other )
+{
+	*this = std::move( other );
+}
+
+LinearArena& LinearArena::operator=( LinearArena&& other )
+{
+	if ( this == &other ) return *this;
+
+	release();
+	BlockSize = other.BlockSize;
+	Blocks = std::move( other.Blocks );
+	CurrentBlock = other.CurrentBlock;
+	Head = other.Head;
+	UsedSize = other.UsedSize;
+
+	other.Blocks.clear();
+	other.CurrentBlock = 0;
+	other.Head = 0;
+	other.UsedSize = 0;
+	return *this;
+}
+
+LinearArena::~LinearArena()
+{
+	release();
+}
+
+void LinearArena::init( size_t block_size )
+{
+	BlockSize = block_size;
+	reset();
+}
+
+void LinearArena::release()
+{
+	for ( auto& block : Blocks )
+	{
+		std::free( block.Data );
+	}
+	Blocks.clear();
+	reset();
+}
+
+void LinearArena::reset()
+{
+	CurrentBlock = 0;
+	Head = 0;
+	UsedSize = 0;
+}
+
+void* LinearArena::allocate( size_t size, size_t alignment )
+{
+	//  malloc only guarantees max_align_t, align the address rather than the offset
+	while ( CurrentBlock < Blocks.size() )
+	{
+		Block& block = Blocks[CurrentBlock];
+		uintptr_t address = (uintptr_t)block.Data + Head;
+		uintptr_t aligned_address = ( address + alignment - 1 ) & ~(uintptr_t)( alignment - 1 );
+		size_t offset = Head + (size_t)( aligned_address - address );
+
+		if ( offset + size <= block.Size )
+		{
+			UsedSize += offset + size - Head;
+			Head = offset + size;
+			return block.Data + offset;
+		}
+
+		//  continue in the next block, the end of this one is wasted until reset
+		CurrentBlock++;
+		Head = 0;
+	}
+
+	//  out of blocks, allocations bigger than a block get their own
+	Block block {};
+	block.Size = std::max( BlockSize, size + alignment );
+	block.Data = (unsigned char*)std::malloc( block.Size );
+	if ( block.Data == nullptr ) throw std::runtime_error( "Failed to allocate a linear arena block!" );
+	Blocks.push_back( block );
+
+	return allocate( size, alignment );
+}
+
+size_t LinearArena::get_capacity() const
+{
+	size_t capacity = 0;
+	for ( const auto& block : Blocks )
+	{
+		capacity += block.Size;
+	}
+	return capacity;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+//  Bump allocator for transient CPU data: allocations are aligned pointer
+//  increments inside large blocks, never freed one by one but all at once
+//  with reset(), in O(1). When a block is full the arena chains another one,
+//  blocks are kept across resets so a steady frame never touches the heap.
+class LinearArena
+{
+public:
+	LinearArena() = default;
+	LinearArena( const LinearArena& ) = delete;
+	LinearArena& operator=( const LinearArena& ) = delete;
+	LinearArena( LinearArena&& other );
+	LinearArena& operator=( LinearArena&& other );
+	~LinearArena();
+
+	void init( size_t block_size );
+	void release();
+
+	//  forget every allocation, their memory is reused by the next ones
+	void reset();
+
+	//  alignment must be a power of two, size 0 returns a valid pointer
+	void* allocate( size_t size, size_t alignment = alignof( std::max_align_t ) );
+
+	//  uninitialized storage for count elements, only meant for trivial types
+	//  since destructors are never called
+	template <typename T>
+	T* allocate_array( size_t count )
+	{
+		return (T*)allocate( sizeof( T ) * count, alignof( T ) );
+	}
+	template <typename T>
+	T* push( const T& value )
+	{
+		return new ( allocate( sizeof( T ), alignof( T ) ) ) T( value );
+	}
+
+	size_t get_used_size() const { return UsedSize; }
+	size_t get_capacity() const;
+
+private:
+	struct Block
+	{
+		unsigned char* Data = nullptr;
+		size_t Size = 0;
+	};
+
+	size_t BlockSize = 0;
+	std::vector<Block> Blocks;
+	size_t CurrentBlock = 0;
+	size_t Head = 0;  //  offset inside the current block
+	size_t UsedSize = 0;
+};
@@ -5,6 +5,7 @@
 #include <glm/glm.hpp>
 #include <glm/mat4x4.hpp>
 
+#include <cstdio>
 #include <iostream>
 
 #include "vulkan-renderer.h"
@@ -49,8 +50,10 @@ int main()
 	float angle = 0.0f;
 	float dt = 0.0f;
 	float last_time = 0.0f;
+	float stats_time = 0.0f;
 
 	auto model = renderer.create_mesh_model( "models/IntergalacticSpaceship.obj" );
+	renderer.print_memory_report();
 
 	while ( !glfwWindowShouldClose( window ) ) 
 	{
@@ -82,6 +85,20 @@ int main()
 
 		//  draw
 		renderer.draw();
+
+		//  show frame statistics, twice per second
+		if ( current_time - stats_time >= 0.5f )
+		{
+			const VulkanFrameStats& stats = renderer.get_frame_stats();
+
+			char title[256];
+			snprintf( title, sizeof( title ), "Vulkan-o | %.1f ms | %u draws, %u/%u instances, %u triangles | %u draw calls, %u binds%s",
+				dt * 1000.0f, stats.DrawCount, stats.VisibleInstanceCount, stats.InstanceCount, stats.TriangleCount, 
+				stats.DrawCalls, stats.get_bind_count(),
+				stats.IsRecordingCached ? " (cached)" : "" );
+			glfwSetWindowTitle( window, title );
+			stats_time = current_time;
+		}
 	}
 
 	release( window, renderer );
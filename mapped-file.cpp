@@ -0,0 +1,103 @@
+#include "mapped-file.h"
+
+#if defined(WIN32) || defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+#if defined(WIN32) || defined(_WIN32)
+
+bool MappedFile::open( const std::string& path )
+{
+	close();
+
+	HANDLE file = CreateFileA( path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr );
+	if ( file == INVALID_HANDLE_VALUE ) return false;
+
+	LARGE_INTEGER size;
+	if ( !GetFileSizeEx( file, &size ) || size.QuadPart == 0 )
+	{
+		CloseHandle( file );
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA( file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+	if ( mapping == nullptr )
+	{
+		CloseHandle( file );
+		return false;
+	}
+
+	const void* data = MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+	if ( data == nullptr )
+	{
+		CloseHandle( mapping );
+		CloseHandle( file );
+		return false;
+	}
+
+	FileHandle = file;
+	MappingHandle = mapping;
+	Data = data;
+	Size = (size_t)size.QuadPart;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if ( Data != nullptr ) UnmapViewOfFile( Data );
+	if ( MappingHandle != nullptr ) CloseHandle( (HANDLE)MappingHandle );
+	if ( FileHandle != nullptr ) CloseHandle( (HANDLE)FileHandle );
+
+	Data = nullptr;
+	Size = 0;
+	FileHandle = nullptr;
+	MappingHandle = nullptr;
+}
+
+#else
+
+bool MappedFile::open( const std::string& path )
+{
+	close();
+
+	int file = ::open( path.c_str(), O_RDONLY );
+	if ( file < 0 ) return false;
+
+	struct stat info;
+	if ( fstat( file, &info ) != 0 || info.st_size == 0 )
+	{
+		::close( file );
+		return false;
+	}
+
+	//  the mapping keeps its own reference to the file
+	void* data = mmap( nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0 );
+	::close( file );
+	if ( data == MAP_FAILED ) return false;
+
+	Data = data;
+	Size = (size_t)info.st_size;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if ( Data != nullptr ) munmap( (void*)Data, Size );
+
+	Data = nullptr;
+	Size = 0;
+}
+
+#endif
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+//  Read-only memory mapping of a whole file: pages are loaded by the OS on
+//  first access, data is read in place without copying it into a buffer.
+class MappedFile
+{
+public:
+	MappedFile() = default;
+	MappedFile( const MappedFile& ) = delete;
+	MappedFile& operator=( const MappedFile& ) = delete;
+	~MappedFile();
+
+	//  returns false if the file can't be opened or is empty
+	bool open( const std::string& path );
+	void close();
+
+	bool is_open() const { return Data != nullptr; }
+	const void* get_data() const { return Data; }
+	size_t get_size() const { return Size; }
+
+private:
+	const void* Data = nullptr;
+	size_t Size = 0;
+
+	//  OS handles of the file & its mapping
+	void* FileHandle = nullptr;
+	void* MappingHandle = nullptr;
+};
@@ -0,0 +1,257 @@
+#include "mesh-cache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <sys/stat.h>
+
+static const uint32_t MESH_CACHE_MAGIC = 0x434D4B56;  //  "VKMC"
+static const uint32_t MESH_CACHE_VERSION = 4;  //  4: levels of detail
+static const uint64_t MESH_CACHE_ALIGNMENT = 16;  //  of vertex blobs, for in-place reads
+
+struct MeshCacheHeader
+{
+	uint32_t Magic = MESH_CACHE_MAGIC;
+	uint32_t Version = MESH_CACHE_VERSION;
+	MeshCacheKey Key;
+	uint32_t MeshCount = 0;
+	uint32_t MaterialCount = 0;
+};
+
+//  offsets are counted in bytes from the start of the file
+struct MeshCacheEntry
+{
+	uint32_t MaterialIndex = 0;
+	uint32_t VertexCount = 0;
+	uint32_t IndexCount = 0;
+	uint32_t IndexSize = 0;
+	uint64_t VertexOffset = 0;
+	uint64_t IndexOffset = 0;
+	float BoundsMin[3] {};
+	float BoundsMax[3] {};
+	float SphereCenter[3] {};
+	float SphereRadius = 0.0f;
+	uint32_t LODCount = 0;
+	MeshCacheLOD LODs[MESH_CACHE_MAX_LODS];
+	uint32_t Padding = 0;
+};
+
+struct MeshCacheMaterial
+{
+	uint64_t NameOffset = 0;
+	uint32_t NameLength = 0;
+	uint32_t Padding = 0;
+};
+
+static uint64_t align_up( uint64_t value, uint64_t alignment )
+{
+	return ( value + alignment - 1 ) / alignment * alignment;
+}
+
+static bool is_in_file( uint64_t offset, uint64_t size, uint64_t file_size )
+{
+	return offset <= file_size && size <= file_size - offset;
+}
+
+bool MeshCacheKey::make( 
+	const std::string& source_file, 
+	uint32_t import_flags, 
+	uint32_t vertex_layout, 
+	uint32_t vertex_stride, 
+	MeshCacheKey* key 
+)
+{
+#if defined(WIN32) || defined(_WIN32)
+	struct _stat64 info;
+	if ( _stat64( source_file.c_str(), &info ) != 0 ) return false;
+#else
+	struct stat info;
+	if ( stat( source_file.c_str(), &info ) != 0 ) return false;
+#endif
+
+	*key = MeshCacheKey {};
+	key->SourceSize = (uint64_t)info.st_size;
+	key->SourceTime = (int64_t)info.st_mtime;
+	key->ImportFlags = import_flags;
+	key->VertexLayout = vertex_layout;
+	key->VertexStride = vertex_stride;
+	return true;
+}
+
+bool MeshCache::open( const std::string& path, const MeshCacheKey& key )
+{
+	MeshCount = 0;
+	MaterialCount = 0;
+	VertexStride = key.VertexStride;
+	if ( !File.open( path ) ) return false;
+
+	//  anything unexpected makes the cache stale, it is then cooked again
+	const char* data = (const char*)File.get_data();
+	uint64_t file_size = File.get_size();
+
+	MeshCacheHeader header;
+	if ( file_size < sizeof( header ) ) return close(), false;
+	memcpy( &header, data, sizeof( header ) );
+	if ( header.Magic != MESH_CACHE_MAGIC
+	  || header.Version != MESH_CACHE_VERSION
+	  || header.Key.SourceSize != key.SourceSize
+	  || header.Key.SourceTime != key.SourceTime
+	  || header.Key.ImportFlags != key.ImportFlags
+	  || header.Key.VertexLayout != key.VertexLayout
+	  || header.Key.VertexStride != key.VertexStride )
+	{
+		return close(), false;
+	}
+
+	uint64_t tables_size = (uint64_t)header.MeshCount * sizeof( MeshCacheEntry )
+		+ (uint64_t)header.MaterialCount * sizeof( MeshCacheMaterial );
+	if ( !is_in_file( sizeof( header ), tables_size, file_size ) ) return close(), false;
+
+	const MeshCacheEntry* entries = (const MeshCacheEntry*)( data + sizeof( header ) );
+	for ( uint32_t i = 0; i < header.MeshCount; i++ )
+	{
+		const MeshCacheEntry& entry = entries[i];
+		if ( ( entry.IndexSize != 2 && entry.IndexSize != 4 )
+		  || entry.VertexOffset % MESH_CACHE_ALIGNMENT != 0 || entry.IndexOffset % entry.IndexSize != 0
+		  || !is_in_file( entry.VertexOffset, (uint64_t)entry.VertexCount * VertexStride, file_size )
+		  || !is_in_file( entry.IndexOffset, (uint64_t)entry.IndexCount * entry.IndexSize, file_size )
+		  || entry.MaterialIndex >= header.MaterialCount
+		  || entry.LODCount > MESH_CACHE_MAX_LODS )
+		{
+			return close(), false;
+		}
+
+		for ( uint32_t k = 0; k < entry.LODCount; k++ )
+		{
+			if ( (uint64_t)entry.LODs[k].FirstIndex + entry.LODs[k].IndexCount > entry.IndexCount ) return close(), false;
+		}
+	}
+
+	const MeshCacheMaterial* materials = (const MeshCacheMaterial*)( entries + header.MeshCount );
+	for ( uint32_t i = 0; i < header.MaterialCount; i++ )
+	{
+		if ( !is_in_file( materials[i].NameOffset, materials[i].NameLength, file_size ) ) return close(), false;
+	}
+
+	MeshCount = header.MeshCount;
+	MaterialCount = header.MaterialCount;
+	return true;
+}
+
+MeshCacheMesh MeshCache::get_mesh( size_t id ) const
+{
+	const char* data = (const char*)File.get_data();
+	const MeshCacheEntry& entry = ( (const MeshCacheEntry*)( data + sizeof( MeshCacheHeader ) ) )[id];
+
+	MeshCacheMesh mesh;
+	mesh.MaterialIndex = entry.MaterialIndex;
+	mesh.VertexCount = entry.VertexCount;
+	mesh.IndexCount = entry.IndexCount;
+	mesh.IndexSize = entry.IndexSize;
+	mesh.Vertices = data + entry.VertexOffset;
+	mesh.Indices = data + entry.IndexOffset;
+	memcpy( mesh.BoundsMin, entry.BoundsMin, sizeof( mesh.BoundsMin ) );
+	memcpy( mesh.BoundsMax, entry.BoundsMax, sizeof( mesh.BoundsMax ) );
+	memcpy( mesh.SphereCenter, entry.SphereCenter, sizeof( mesh.SphereCenter ) );
+	mesh.SphereRadius = entry.SphereRadius;
+	mesh.LODCount = entry.LODCount;
+	memcpy( mesh.LODs, entry.LODs, sizeof( mesh.LODs ) );
+	return mesh;
+}
+
+std::vector<std::string> MeshCache::get_materials() const
+{
+	const char* data = (const char*)File.get_data();
+	const MeshCacheMaterial* materials = (const MeshCacheMaterial*)( data + sizeof( MeshCacheHeader )
+		+ (size_t)MeshCount * sizeof( MeshCacheEntry ) );
+
+	std::vector<std::string> names( MaterialCount );
+	for ( uint32_t i = 0; i < MaterialCount; i++ )
+	{
+		names[i].assign( data + materials[i].NameOffset, materials[i].NameLength );
+	}
+	return names;
+}
+
+bool MeshCache::write(
+	const std::string& path,
+	const MeshCacheKey& key,
+	const std::vector<std::string>& materials,
+	const std::vector<MeshCacheMesh>& meshes
+)
+{
+	MeshCacheHeader header;
+	header.Key = key;
+	header.MeshCount = (uint32_t)meshes.size();
+	header.MaterialCount = (uint32_t)materials.size();
+
+	//  lay everything out before writing it in order
+	uint64_t offset = sizeof( header ) + meshes.size() * sizeof( MeshCacheEntry ) + materials.size() * sizeof( MeshCacheMaterial );
+
+	std::vector<MeshCacheMaterial> material_table( materials.size() );
+	for ( size_t i = 0; i < materials.size(); i++ )
+	{
+		material_table[i].NameOffset = offset;
+		material_table[i].NameLength = (uint32_t)materials[i].size();
+		offset += materials[i].size();
+	}
+
+	std::vector<MeshCacheEntry> mesh_table( meshes.size() );
+	for ( size_t i = 0; i < meshes.size(); i++ )
+	{
+		offset = align_up( offset, MESH_CACHE_ALIGNMENT );
+		mesh_table[i].MaterialIndex = meshes[i].MaterialIndex;
+		mesh_table[i].VertexCount = meshes[i].VertexCount;
+		mesh_table[i].VertexOffset = offset;
+		memcpy( mesh_table[i].BoundsMin, meshes[i].BoundsMin, sizeof( mesh_table[i].BoundsMin ) );
+		memcpy( mesh_table[i].BoundsMax, meshes[i].BoundsMax, sizeof( mesh_table[i].BoundsMax ) );
+		memcpy( mesh_table[i].SphereCenter, meshes[i].SphereCenter, sizeof( mesh_table[i].SphereCenter ) );
+		mesh_table[i].SphereRadius = meshes[i].SphereRadius;
+		mesh_table[i].LODCount = std::min( meshes[i].LODCount, MESH_CACHE_MAX_LODS );
+		memcpy( mesh_table[i].LODs, meshes[i].LODs, sizeof( mesh_table[i].LODs ) );
+		offset += (uint64_t)meshes[i].VertexCount * key.VertexStride;
+	}
+	for ( size_t i = 0; i < meshes.size(); i++ )
+	{
+		offset = align_up( offset, sizeof( uint32_t ) );
+		mesh_table[i].IndexCount = meshes[i].IndexCount;
+		mesh_table[i].IndexSize = meshes[i].IndexSize;
+		mesh_table[i].IndexOffset = offset;
+		offset += (uint64_t)meshes[i].IndexCount * meshes[i].IndexSize;
+	}
+
+	//  written aside then renamed, a reader never maps a partial file
+	std::string temporary_path = path + ".tmp";
+	{
+		std::ofstream file { temporary_path, std::ios::binary | std::ios::trunc };
+		if ( !file.is_open() ) return false;
+
+		const char padding[MESH_CACHE_ALIGNMENT] {};
+		file.write( (const char*)&header, sizeof( header ) );
+		file.write( (const char*)mesh_table.data(), mesh_table.size() * sizeof( MeshCacheEntry ) );
+		file.write( (const char*)material_table.data(), material_table.size() * sizeof( MeshCacheMaterial ) );
+		for ( const auto& material : materials )
+		{
+			file.write( material.data(), material.size() );
+		}
+		for ( size_t i = 0; i < meshes.size(); i++ )
+		{
+			uint64_t position = (uint64_t)file.tellp();
+			file.write( padding, mesh_table[i].VertexOffset - position );
+			file.write( (const char*)meshes[i].Vertices, (uint64_t)meshes[i].VertexCount * key.VertexStride );
+		}
+		for ( size_t i = 0; i < meshes.size(); i++ )
+		{
+			uint64_t position = (uint64_t)file.tellp();
+			file.write( padding, mesh_table[i].IndexOffset - position );
+			file.write( (const char*)meshes[i].Indices, (uint64_t)meshes[i].IndexCount * meshes[i].IndexSize );
+		}
+
+		if ( !file.good() ) return false;
+	}
+
+	std::remove( path.c_str() );
+	return std::rename( temporary_path.c_str(), path.c_str() ) == 0;
+}
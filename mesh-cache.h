@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "mapped-file.h"
+
+//  what a cache was cooked from: it is stale as soon as any of it differs
+struct MeshCacheKey
+{
+	uint64_t SourceSize = 0;
+	int64_t SourceTime = 0;  //  last modification of the source file
+	uint32_t ImportFlags = 0;  //  post-processing applied by the importer
+	uint32_t VertexLayout = 0;  //  format of every vertex, as laid out for the GPU
+	uint32_t VertexStride = 0;
+	uint32_t Padding = 0;
+
+	//  false if the source file does not exist
+	static bool make( 
+		const std::string& source_file, 
+		uint32_t import_flags, 
+		uint32_t vertex_layout, 
+		uint32_t vertex_stride, 
+		MeshCacheKey* key 
+	);
+};
+
+//  most levels of detail stored per mesh
+static const uint32_t MESH_CACHE_MAX_LODS = 8;
+
+//  level of detail of a mesh, a range of its indices
+struct MeshCacheLOD
+{
+	uint32_t FirstIndex = 0;
+	uint32_t IndexCount = 0;
+	float Error = 0.0f;  //  in mesh space
+};
+
+//  a mesh of a model, its vertices & indices laid out as they are uploaded
+struct MeshCacheMesh
+{
+	uint32_t MaterialIndex = 0;
+	uint32_t VertexCount = 0;
+	uint32_t IndexCount = 0;
+	uint32_t IndexSize = 4;  //  2 or 4 bytes
+	const void* Vertices = nullptr;  //  VertexCount * VertexStride bytes
+	const void* Indices = nullptr;
+
+	//  bounds of the mesh, compact vertices are quantized to the box
+	float BoundsMin[3] {};
+	float BoundsMax[3] {};
+	float SphereCenter[3] {};
+	float SphereRadius = 0.0f;
+
+	//  finest first, each one drawing the same vertices
+	uint32_t LODCount = 0;
+	MeshCacheLOD LODs[MESH_CACHE_MAX_LODS];
+};
+
+//  Cooked binary form of an imported model, so that later loads skip parsing &
+//  post-processing. The file is a header, a table of meshes, a table of material
+//  textures and their names, then the vertices & indices of every mesh packed
+//  together. It is memory mapped when opened: meshes point right into the
+//  mapping, and are copied from there into staging memory.
+class MeshCache
+{
+public:
+	//  map a cache file, returns false if missing, stale or malformed
+	bool open( const std::string& path, const MeshCacheKey& key );
+	void close() { File.close(); }
+
+	size_t get_mesh_count() const { return MeshCount; }
+	MeshCacheMesh get_mesh( size_t id ) const;
+	//  texture file of every material, empty for materials without one
+	std::vector<std::string> get_materials() const;
+
+	//  write the meshes of a model in the order they are loaded, returns false on failure
+	static bool write(
+		const std::string& path,
+		const MeshCacheKey& key,
+		const std::vector<std::string>& materials,
+		const std::vector<MeshCacheMesh>& meshes
+	);
+
+private:
+	MappedFile File;
+	uint32_t MeshCount = 0;
+	uint32_t MaterialCount = 0;
+	uint32_t VertexStride = 0;
+};
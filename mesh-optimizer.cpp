@@ -0,0 +1,315 @@
+#include "mesh-optimizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+//  FIFO cache simulated with timestamps: a vertex is cached while fewer than
+//  cache_size vertices were transformed after it
+struct VertexCacheSimulation
+{
+	std::vector<uint32_t> Stamps;
+	uint32_t Time = 0;
+	uint32_t CacheSize = 0;
+
+	VertexCacheSimulation( size_t vertex_count, uint32_t cache_size )
+		: Stamps( vertex_count, 0 ), Time( cache_size + 1 ), CacheSize( cache_size )
+	{}
+
+	bool is_cached( uint32_t vertex ) const { return Time - Stamps[vertex] <= CacheSize; }
+
+	//  returns the number of vertices transformed by a triangle
+	uint32_t add_triangle( const uint32_t* triangle )
+	{
+		uint32_t misses = 0;
+		for ( int i = 0; i < 3; i++ )
+		{
+			if ( is_cached( triangle[i] ) ) continue;
+			Stamps[triangle[i]] = Time++;
+			misses++;
+		}
+		return misses;
+	}
+
+	void flush() { Time += CacheSize + 1; }
+};
+
+float compute_acmr( const uint32_t* indices, size_t index_count, size_t vertex_count, uint32_t cache_size )
+{
+	size_t triangle_count = index_count / 3;
+	if ( triangle_count == 0 ) return 0.0f;
+
+	VertexCacheSimulation cache( vertex_count, cache_size );
+	size_t misses = 0;
+	for ( size_t i = 0; i < triangle_count; i++ )
+	{
+		misses += cache.add_triangle( &indices[i * 3] );
+	}
+
+	return (float)misses / (float)triangle_count;
+}
+
+std::vector<uint32_t> optimize_vertex_cache( uint32_t* indices, size_t index_count, size_t vertex_count, uint32_t cache_size )
+{
+	std::vector<uint32_t> clusters;
+	size_t triangle_count = index_count / 3;
+	if ( triangle_count == 0 ) return clusters;
+
+	//  triangles using each vertex, and how many of them are left to emit
+	std::vector<uint32_t> live_counts( vertex_count, 0 );
+	for ( size_t i = 0; i < triangle_count * 3; i++ )
+	{
+		live_counts[indices[i]]++;
+	}
+
+	std::vector<uint32_t> adjacency_offsets( vertex_count + 1, 0 );
+	for ( size_t i = 0; i < vertex_count; i++ )
+	{
+		adjacency_offsets[i + 1] = adjacency_offsets[i] + live_counts[i];
+	}
+
+	std::vector<uint32_t> adjacency( triangle_count * 3 );
+	std::vector<uint32_t> adjacency_cursors( adjacency_offsets.begin(), adjacency_offsets.end() - 1 );
+	for ( size_t i = 0; i < triangle_count * 3; i++ )
+	{
+		adjacency[adjacency_cursors[indices[i]]++] = (uint32_t)( i / 3 );
+	}
+
+	VertexCacheSimulation cache( vertex_count, cache_size );
+	std::vector<bool> is_emitted( triangle_count, false );
+	std::vector<uint32_t> dead_ends;  //  emitted vertices, most recent on top
+	std::vector<uint32_t> candidates;
+	std::vector<uint32_t> result;
+	dead_ends.reserve( triangle_count * 3 );
+	result.reserve( triangle_count * 3 );
+	uint32_t vertex_cursor = 0;
+
+	int64_t fan_vertex = indices[0];
+	clusters.push_back( 0 );
+	while ( fan_vertex >= 0 )
+	{
+		//  emit every triangle around the fanning vertex
+		candidates.clear();
+		for ( uint32_t i = adjacency_offsets[fan_vertex]; i < adjacency_offsets[fan_vertex + 1]; i++ )
+		{
+			uint32_t triangle = adjacency[i];
+			if ( is_emitted[triangle] ) continue;
+
+			const uint32_t* vertices = &indices[triangle * 3];
+			for ( int j = 0; j < 3; j++ )
+			{
+				result.push_back( vertices[j] );
+				dead_ends.push_back( vertices[j] );
+				candidates.push_back( vertices[j] );
+				live_counts[vertices[j]]--;
+			}
+			cache.add_triangle( vertices );
+			is_emitted[triangle] = true;
+		}
+
+		//  next fan around the oldest candidate that stays cached while
+		//  its triangles are emitted, or any candidate with triangles left
+		fan_vertex = -1;
+		int64_t best_priority = -1;
+		for ( uint32_t vertex : candidates )
+		{
+			if ( live_counts[vertex] == 0 ) continue;
+
+			int64_t age = cache.Time - cache.Stamps[vertex];
+			int64_t priority = age + 2 * live_counts[vertex] <= cache_size ? age : 0;
+			if ( priority > best_priority )
+			{
+				best_priority = priority;
+				fan_vertex = vertex;
+			}
+		}
+		if ( fan_vertex >= 0 ) continue;
+
+		//  dead end: back to a recent vertex, or to the next one in input order
+		while ( !dead_ends.empty() && fan_vertex < 0 )
+		{
+			uint32_t vertex = dead_ends.back();
+			dead_ends.pop_back();
+			if ( live_counts[vertex] > 0 ) fan_vertex = vertex;
+		}
+		while ( vertex_cursor < vertex_count && fan_vertex < 0 )
+		{
+			if ( live_counts[vertex_cursor] > 0 ) fan_vertex = vertex_cursor;
+			vertex_cursor++;
+		}
+
+		if ( fan_vertex >= 0 ) clusters.push_back( (uint32_t)( result.size() / 3 ) );
+	}
+
+	memcpy( indices, result.data(), result.size() * sizeof( uint32_t ) );
+	return clusters;
+}
+
+void optimize_overdraw(
+	uint32_t* indices,
+	size_t index_count,
+	const void* positions,
+	size_t vertex_count,
+	size_t position_stride,
+	const std::vector<uint32_t>& clusters,
+	uint32_t cache_size,
+	float threshold
+)
+{
+	size_t triangle_count = index_count / 3;
+	if ( triangle_count == 0 || clusters.empty() ) return;
+
+	//  split clusters where their vertex cache efficiency is already reached,
+	//  smaller clusters sort better; the cache is flushed at each split since
+	//  the clusters around it won't be drawn next to each other anymore
+	VertexCacheSimulation cache( vertex_count, cache_size );
+	std::vector<uint32_t> splits;
+	for ( size_t i = 0; i < clusters.size(); i++ )
+	{
+		uint32_t begin = clusters[i];
+		uint32_t end = i + 1 < clusters.size() ? clusters[i + 1] : (uint32_t)triangle_count;
+
+		cache.flush();
+		uint32_t cluster_misses = 0;
+		for ( uint32_t triangle = begin; triangle < end; triangle++ )
+		{
+			cluster_misses += cache.add_triangle( &indices[triangle * 3] );
+		}
+		float split_acmr = threshold * (float)cluster_misses / (float)( end - begin );
+
+		cache.flush();
+		uint32_t split_begin = begin;
+		uint32_t split_misses = 0;
+		for ( uint32_t triangle = begin; triangle < end; triangle++ )
+		{
+			split_misses += cache.add_triangle( &indices[triangle * 3] );
+			if ( triangle + 1 < end && (float)split_misses <= split_acmr * (float)( triangle + 1 - split_begin ) )
+			{
+				splits.push_back( split_begin );
+				split_begin = triangle + 1;
+				split_misses = 0;
+				cache.flush();
+			}
+		}
+		splits.push_back( split_begin );
+	}
+
+	auto get_position = [&]( uint32_t vertex ) -> const float*
+	{
+		return (const float*)( (const char*)positions + vertex * position_stride );
+	};
+
+	//  area weighted centroid & normal of every cluster, and of the mesh
+	std::vector<float> cluster_data( splits.size() * 6, 0.0f );
+	float mesh_centroid[3] { 0.0f, 0.0f, 0.0f };
+	float mesh_area = 0.0f;
+	for ( size_t i = 0; i < splits.size(); i++ )
+	{
+		uint32_t begin = splits[i];
+		uint32_t end = i + 1 < splits.size() ? splits[i + 1] : (uint32_t)triangle_count;
+
+		float* centroid = &cluster_data[i * 6];
+		float* normal = &cluster_data[i * 6 + 3];
+		float cluster_area = 0.0f;
+		for ( uint32_t triangle = begin; triangle < end; triangle++ )
+		{
+			const float* a = get_position( indices[triangle * 3 + 0] );
+			const float* b = get_position( indices[triangle * 3 + 1] );
+			const float* c = get_position( indices[triangle * 3 + 2] );
+
+			float ab[3] { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+			float ac[3] { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+			float cross[3] {
+				ab[1] * ac[2] - ab[2] * ac[1],
+				ab[2] * ac[0] - ab[0] * ac[2],
+				ab[0] * ac[1] - ab[1] * ac[0],
+			};
+			float area = sqrtf( cross[0] * cross[0] + cross[1] * cross[1] + cross[2] * cross[2] );
+
+			for ( int j = 0; j < 3; j++ )
+			{
+				centroid[j] += ( a[j] + b[j] + c[j] ) / 3.0f * area;
+				normal[j] += cross[j];
+			}
+			cluster_area += area;
+		}
+
+		for ( int j = 0; j < 3; j++ )
+		{
+			mesh_centroid[j] += centroid[j];
+			if ( cluster_area > 0.0f ) centroid[j] /= cluster_area;
+		}
+		mesh_area += cluster_area;
+	}
+	if ( mesh_area > 0.0f )
+	{
+		for ( int j = 0; j < 3; j++ ) mesh_centroid[j] /= mesh_area;
+	}
+
+	//  clusters facing outward the most are drawn first
+	std::vector<float> sort_keys( splits.size() );
+	for ( size_t i = 0; i < splits.size(); i++ )
+	{
+		const float* centroid = &cluster_data[i * 6];
+		const float* normal = &cluster_data[i * 6 + 3];
+		float length = sqrtf( normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2] );
+		if ( length == 0.0f )
+		{
+			sort_keys[i] = 0.0f;
+			continue;
+		}
+
+		float dot = 0.0f;
+		for ( int j = 0; j < 3; j++ )
+		{
+			dot += ( centroid[j] - mesh_centroid[j] ) * normal[j];
+		}
+		sort_keys[i] = dot / length;
+	}
+
+	std::vector<uint32_t> order( splits.size() );
+	for ( size_t i = 0; i < order.size(); i++ )
+	{
+		order[i] = (uint32_t)i;
+	}
+	std::stable_sort( order.begin(), order.end(), [&]( uint32_t a, uint32_t b )
+	{
+		return sort_keys[a] > sort_keys[b];
+	} );
+
+	std::vector<uint32_t> result;
+	result.reserve( triangle_count * 3 );
+	for ( uint32_t cluster : order )
+	{
+		uint32_t begin = splits[cluster];
+		uint32_t end = cluster + 1 < splits.size() ? splits[cluster + 1] : (uint32_t)triangle_count;
+		result.insert( result.end(), indices + begin * 3, indices + end * 3 );
+	}
+	memcpy( indices, result.data(), result.size() * sizeof( uint32_t ) );
+}
+
+size_t optimize_vertex_fetch( void* vertices, size_t vertex_count, size_t vertex_stride, uint32_t* indices, size_t index_count )
+{
+	const uint32_t UNUSED = UINT32_MAX;
+	std::vector<uint32_t> remap( vertex_count, UNUSED );
+	std::vector<char> sorted_vertices( vertex_count * vertex_stride );
+
+	uint32_t used_count = 0;
+	for ( size_t i = 0; i < index_count; i++ )
+	{
+		uint32_t& new_index = remap[indices[i]];
+		if ( new_index == UNUSED )
+		{
+			new_index = used_count++;
+			memcpy(
+				&sorted_vertices[new_index * vertex_stride],
+				(const char*)vertices + indices[i] * vertex_stride,
+				vertex_stride
+			);
+		}
+		indices[i] = new_index;
+	}
+
+	memcpy( vertices, sorted_vertices.data(), used_count * vertex_stride );
+	return used_count;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+//  Import-time reordering of triangle lists for the GPU: triangles for the
+//  post-transform vertex cache, clusters of them against overdraw, then
+//  vertices in the order they are fetched. Meant to run in this order.
+
+//  average cache miss ratio: vertices transformed per triangle, simulating a
+//  FIFO post-transform cache; from 0.5 (best) to 3 (no reuse at all)
+float compute_acmr( const uint32_t* indices, size_t index_count, size_t vertex_count, uint32_t cache_size );
+
+//  reorder triangles for vertex cache locality (Tipsify: fan around the cached
+//  vertex that has the most triangles left, jumping only at dead ends). Returns
+//  the first triangle of every cluster, which starts at each jump.
+std::vector<uint32_t> optimize_vertex_cache( uint32_t* indices, size_t index_count, size_t vertex_count, uint32_t cache_size );
+
+//  reorder the clusters of optimize_vertex_cache so that those facing away from
+//  the mesh center are drawn first, and occlude the others. Clusters are split
+//  further while it costs less than threshold times their ACMR (e.g. 1.05).
+//  positions are 3 floats every position_stride bytes.
+void optimize_overdraw(
+	uint32_t* indices,
+	size_t index_count,
+	const void* positions,
+	size_t vertex_count,
+	size_t position_stride,
+	const std::vector<uint32_t>& clusters,
+	uint32_t cache_size,
+	float threshold
+);
+
+//  reorder vertices by first use in the index buffer, so they are fetched in
+//  order, and remap indices; unused vertices are dropped, returns the new count
+size_t optimize_vertex_fetch( void* vertices, size_t vertex_count, size_t vertex_stride, uint32_t* indices, size_t index_count );
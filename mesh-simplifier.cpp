@@ -0,0 +1,258 @@
+#include "mesh-simplifier.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+//  sum of squared distances to planes, weighted by the area of their triangles:
+//  the symmetric 4x4 matrix of the planes (a, b, c, d), its upper half stored
+struct Quadric
+{
+	double A00 = 0.0, A01 = 0.0, A02 = 0.0, A03 = 0.0;
+	double A11 = 0.0, A12 = 0.0, A13 = 0.0;
+	double A22 = 0.0, A23 = 0.0;
+	double A33 = 0.0;
+	double Weight = 0.0;
+
+	void add_plane( const double* normal, double distance, double weight )
+	{
+		double a = normal[0], b = normal[1], c = normal[2], d = distance;
+		A00 += a * a * weight; A01 += a * b * weight; A02 += a * c * weight; A03 += a * d * weight;
+		A11 += b * b * weight; A12 += b * c * weight; A13 += b * d * weight;
+		A22 += c * c * weight; A23 += c * d * weight;
+		A33 += d * d * weight;
+		Weight += weight;
+	}
+
+	void add( const Quadric& other )
+	{
+		A00 += other.A00; A01 += other.A01; A02 += other.A02; A03 += other.A03;
+		A11 += other.A11; A12 += other.A12; A13 += other.A13;
+		A22 += other.A22; A23 += other.A23;
+		A33 += other.A33;
+		Weight += other.Weight;
+	}
+
+	//  average squared distance of a point to the planes
+	double evaluate( const float* point ) const
+	{
+		if ( Weight <= 0.0 ) return 0.0;
+
+		double x = point[0], y = point[1], z = point[2];
+		double result = A00 * x * x + A11 * y * y + A22 * z * z
+			+ 2.0 * ( A01 * x * y + A02 * x * z + A12 * y * z )
+			+ 2.0 * ( A03 * x + A13 * y + A23 * z )
+			+ A33;
+		return std::abs( result ) / Weight;
+	}
+};
+
+//  vertex moved onto one of its neighbours, and the squared error it costs
+struct Collapse
+{
+	uint32_t From;
+	uint32_t To;
+	float Cost;
+};
+
+static void compute_normal( const float* a, const float* b, const float* c, double* normal )
+{
+	double ab[3] { (double)b[0] - a[0], (double)b[1] - a[1], (double)b[2] - a[2] };
+	double ac[3] { (double)c[0] - a[0], (double)c[1] - a[1], (double)c[2] - a[2] };
+	normal[0] = ab[1] * ac[2] - ab[2] * ac[1];
+	normal[1] = ab[2] * ac[0] - ab[0] * ac[2];
+	normal[2] = ab[0] * ac[1] - ab[1] * ac[0];
+}
+
+size_t simplify_mesh(
+	uint32_t* indices,
+	size_t index_count,
+	const void* positions,
+	size_t vertex_count,
+	size_t position_stride,
+	size_t target_index_count,
+	float target_error,
+	float* error
+)
+{
+	*error = 0.0f;
+	size_t triangle_count = index_count / 3;
+	if ( triangle_count == 0 || index_count <= target_index_count ) return index_count;
+
+	auto get_position = [&]( uint32_t vertex ) -> const float*
+	{
+		return (const float*)( (const char*)positions + vertex * position_stride );
+	};
+
+	//  open edges are those without the opposite edge of a neighbouring triangle
+	std::vector<uint64_t> edges( triangle_count * 3 );
+	for ( size_t i = 0; i < triangle_count * 3; i++ )
+	{
+		uint32_t a = indices[i];
+		uint32_t b = indices[i - i % 3 + ( i + 1 ) % 3];
+		edges[i] = (uint64_t)a << 32 | b;
+	}
+	std::sort( edges.begin(), edges.end() );
+
+	std::vector<bool> is_locked( vertex_count, false );
+	for ( uint64_t edge : edges )
+	{
+		uint32_t a = (uint32_t)( edge >> 32 );
+		uint32_t b = (uint32_t)edge;
+		if ( !std::binary_search( edges.begin(), edges.end(), (uint64_t)b << 32 | a ) )
+		{
+			is_locked[a] = true;
+			is_locked[b] = true;
+		}
+	}
+
+	//  planes of the triangles around every vertex
+	std::vector<Quadric> quadrics( vertex_count );
+	for ( size_t i = 0; i < triangle_count; i++ )
+	{
+		const float* a = get_position( indices[i * 3 + 0] );
+		double normal[3];
+		compute_normal( a, get_position( indices[i * 3 + 1] ), get_position( indices[i * 3 + 2] ), normal );
+
+		double length = sqrt( normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2] );
+		if ( length == 0.0 ) continue;
+		for ( int j = 0; j < 3; j++ ) normal[j] /= length;
+
+		double distance = -( normal[0] * a[0] + normal[1] * a[1] + normal[2] * a[2] );
+		double area = length * 0.5;
+		for ( int j = 0; j < 3; j++ )
+		{
+			quadrics[indices[i * 3 + j]].add_plane( normal, distance, area );
+		}
+	}
+
+	float max_cost = target_error * target_error;
+	float reached_cost = 0.0f;
+	std::vector<uint32_t> adjacency_offsets( vertex_count + 1 );
+	std::vector<uint32_t> adjacency;
+	std::vector<Collapse> collapses;
+	std::vector<uint32_t> remap( vertex_count );
+	std::vector<bool> is_collapsed( vertex_count );
+
+	//  Every pass collapses the cheapest edges whose vertices were not touched yet
+	//  in the pass, so that their costs are still exact, then removes triangles
+	//  left degenerate. Costs are computed again by the next pass.
+	while ( index_count > target_index_count )
+	{
+		triangle_count = index_count / 3;
+
+		std::fill( adjacency_offsets.begin(), adjacency_offsets.end(), 0 );
+		for ( size_t i = 0; i < index_count; i++ )
+		{
+			adjacency_offsets[indices[i] + 1]++;
+		}
+		for ( size_t i = 0; i < vertex_count; i++ )
+		{
+			adjacency_offsets[i + 1] += adjacency_offsets[i];
+		}
+		adjacency.resize( index_count );
+		std::vector<uint32_t> adjacency_cursors( adjacency_offsets.begin(), adjacency_offsets.end() - 1 );
+		for ( size_t i = 0; i < index_count; i++ )
+		{
+			adjacency[adjacency_cursors[indices[i]]++] = (uint32_t)( i / 3 );
+		}
+
+		//  both directions of every edge, each moving its own vertex
+		collapses.clear();
+		for ( size_t i = 0; i < index_count; i++ )
+		{
+			uint32_t from = indices[i];
+			if ( is_locked[from] ) continue;
+
+			for ( int j = 1; j < 3; j++ )
+			{
+				uint32_t to = indices[i - i % 3 + ( i + j ) % 3];
+				Quadric merged = quadrics[from];
+				merged.add( quadrics[to] );
+				collapses.push_back( Collapse { from, to, (float)merged.evaluate( get_position( to ) ) } );
+			}
+		}
+		std::sort( collapses.begin(), collapses.end(), []( const Collapse& a, const Collapse& b )
+		{
+			return a.Cost < b.Cost;
+		} );
+
+		for ( size_t i = 0; i < vertex_count; i++ )
+		{
+			remap[i] = (uint32_t)i;
+		}
+		std::fill( is_collapsed.begin(), is_collapsed.end(), false );
+
+		//  an interior collapse removes the two triangles sharing its edge
+		size_t removed_goal = ( index_count - target_index_count + 2 ) / 3;
+		size_t removed_count = 0;
+		size_t collapse_count = 0;
+		for ( const Collapse& collapse : collapses )
+		{
+			if ( collapse.Cost > max_cost || removed_count >= removed_goal ) break;
+			if ( is_collapsed[collapse.From] || is_collapsed[collapse.To] ) continue;
+
+			//  triangles around the vertex must not flip once it moved
+			bool is_flipping = false;
+			size_t removed_triangles = 0;
+			for ( uint32_t k = adjacency_offsets[collapse.From]; k < adjacency_offsets[collapse.From + 1] && !is_flipping; k++ )
+			{
+				uint32_t triangle[3];
+				for ( int j = 0; j < 3; j++ )
+				{
+					triangle[j] = remap[indices[adjacency[k] * 3 + j]];
+				}
+				if ( triangle[0] == triangle[1] || triangle[1] == triangle[2] || triangle[2] == triangle[0] ) continue;
+				if ( triangle[0] == collapse.To || triangle[1] == collapse.To || triangle[2] == collapse.To )
+				{
+					removed_triangles++;
+					continue;
+				}
+
+				double before[3];
+				compute_normal( get_position( triangle[0] ), get_position( triangle[1] ), get_position( triangle[2] ), before );
+				for ( int j = 0; j < 3; j++ )
+				{
+					if ( triangle[j] == collapse.From ) triangle[j] = collapse.To;
+				}
+				double after[3];
+				compute_normal( get_position( triangle[0] ), get_position( triangle[1] ), get_position( triangle[2] ), after );
+
+				//  turning by up to 90 degrees at once would let a series of
+				//  collapses flip it, limited to about 75 degrees instead
+				double dot = before[0] * after[0] + before[1] * after[1] + before[2] * after[2];
+				double lengths = sqrt( ( before[0] * before[0] + before[1] * before[1] + before[2] * before[2] )
+					* ( after[0] * after[0] + after[1] * after[1] + after[2] * after[2] ) );
+				is_flipping = dot <= 0.25 * lengths;
+			}
+			if ( is_flipping ) continue;
+
+			remap[collapse.From] = collapse.To;
+			is_collapsed[collapse.From] = true;
+			is_collapsed[collapse.To] = true;
+			quadrics[collapse.To].add( quadrics[collapse.From] );
+			reached_cost = std::max( reached_cost, collapse.Cost );
+			removed_count += removed_triangles;
+			collapse_count++;
+		}
+		if ( collapse_count == 0 ) break;
+
+		//  move collapsed vertices, and drop the triangles they flattened
+		size_t write = 0;
+		for ( size_t i = 0; i < triangle_count; i++ )
+		{
+			uint32_t a = remap[indices[i * 3 + 0]];
+			uint32_t b = remap[indices[i * 3 + 1]];
+			uint32_t c = remap[indices[i * 3 + 2]];
+			if ( a == b || b == c || c == a ) continue;
+
+			indices[write++] = a;
+			indices[write++] = b;
+			indices[write++] = c;
+		}
+		index_count = write;
+	}
+
+	*error = sqrtf( reached_cost );
+	return index_count;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+//  Import-time simplification of triangle lists into coarser levels of detail,
+//  by edge collapses ordered by quadric error (Garland & Heckbert). A vertex is
+//  only ever collapsed onto one of its neighbours, so simplified indices keep
+//  using the vertices of the full mesh and levels can share its vertex buffer.
+//
+//  Vertices on open edges are never moved: those are the borders of the mesh,
+//  and the seams where vertices were split for their UVs or normals.
+
+//  collapse edges, cheapest first, until at most target_index_count indices are
+//  left or the next collapse would move the surface farther than target_error.
+//  positions are 3 floats every position_stride bytes. Returns the new index
+//  count, and writes the farthest the surface moved (in position units) to error.
+size_t simplify_mesh(
+	uint32_t* indices,
+	size_t index_count,
+	const void* positions,
+	size_t vertex_count,
+	size_t position_stride,
+	size_t target_index_count,
+	float target_error,
+	float* error
+);
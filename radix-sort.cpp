@@ -0,0 +1,49 @@
+#include "radix-sort.h"
+
+#include <cstring>
+
+RadixSortItem* radix_sort( RadixSortItem* items, RadixSortItem* scratch, size_t count )
+{
+	//  histograms of every byte in a single read of the keys
+	size_t histograms[8][256];
+	memset( histograms, 0, sizeof( histograms ) );
+	for ( size_t i = 0; i < count; i++ )
+	{
+		uint64_t key = items[i].Key;
+		for ( int pass = 0; pass < 8; pass++ )
+		{
+			histograms[pass][( key >> ( pass * 8 ) ) & 0xFF]++;
+		}
+	}
+
+	RadixSortItem* src = items;
+	RadixSortItem* dst = scratch;
+	for ( int pass = 0; pass < 8; pass++ )
+	{
+		size_t* histogram = histograms[pass];
+
+		//  every item has the same byte, order is unchanged
+		if ( count == 0 || histogram[( src[0].Key >> ( pass * 8 ) ) & 0xFF] == count ) continue;
+
+		//  offsets of each byte value
+		size_t offset = 0;
+		for ( int value = 0; value < 256; value++ )
+		{
+			size_t value_count = histogram[value];
+			histogram[value] = offset;
+			offset += value_count;
+		}
+
+		for ( size_t i = 0; i < count; i++ )
+		{
+			const RadixSortItem& item = src[i];
+			dst[histogram[( item.Key >> ( pass * 8 ) ) & 0xFF]++] = item;
+		}
+
+		RadixSortItem* swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	return src;
+}
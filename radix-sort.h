@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+struct RadixSortItem
+{
+	uint64_t Key = 0;
+	uint32_t Value = 0;
+};
+
+//  Stable LSD radix sort of items by key, one byte per pass. Passes whose byte
+//  is the same for every item are skipped, so keys with few distinct fields
+//  sort in a couple of passes. Items are sorted back and forth between both
+//  arrays, returns the one holding the result.
+RadixSortItem* radix_sort( RadixSortItem* items, RadixSortItem* scratch, size_t count );
@@ -1,3 +1,8 @@
 C:\VulkanSDK\1.3.261.1\Bin\glslangValidator.exe -V shader.vert
+C:\VulkanSDK\1.3.261.1\Bin\glslangValidator.exe -V -DCOMPACT_VERTEX shader.vert -o vert_compact.spv
 C:\VulkanSDK\1.3.261.1\Bin\glslangValidator.exe -V shader.frag
+C:\VulkanSDK\1.3.261.1\Bin\glslangValidator.exe -V cull.comp -o cull.spv
+C:\VulkanSDK\1.3.261.1\Bin\glslangValidator.exe -V hiz_depth.comp -o hiz_depth.spv
+C:\VulkanSDK\1.3.261.1\Bin\glslangValidator.exe -V -DMULTISAMPLED hiz_depth.comp -o hiz_depth_ms.spv
+C:\VulkanSDK\1.3.261.1\Bin\glslangValidator.exe -V hiz_reduce.comp -o hiz_reduce.spv
 pause
\ No newline at end of file
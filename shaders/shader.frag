@@ -1,14 +1,27 @@
 #version 450
+#extension GL_EXT_nonuniform_qualifier : require
 
 // Input colors from vertex shader
 layout(location = 0) in vec3 fragColor;
 layout(location = 1) in vec2 fragUV;
+layout(location = 2) flat in uint fragFlags;
+layout(location = 3) flat in uint fragMaterialIndex;
 
-layout(set = 1, binding = 0) uniform sampler2D textureSampler;
+//  MeshFlags
+const uint MESH_FLAG_VERTEX_COLOR = 1;
+
+//  every texture, a multi-draw mixes materials so the index is not uniform
+layout(set = 1, binding = 0) uniform sampler2D textureSamplers[];
 
 // Final output color, must have location
 layout(location = 0) out vec4 outColor;
 
 void main() {
-    outColor = texture(textureSampler, fragUV);
+    if ( ( fragFlags & MESH_FLAG_VERTEX_COLOR ) != 0 )
+    {
+        outColor = vec4( fragColor, 1.0 );
+        return;
+    }
+
+    outColor = texture(textureSamplers[nonuniformEXT(fragMaterialIndex)], fragUV);
 }
\ No newline at end of file
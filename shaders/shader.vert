@@ -1,9 +1,15 @@
 #version 450
 
 // From vertex input stage
+#ifdef COMPACT_VERTEX
+//  VulkanCompactVertex: position quantized to the mesh bounds, no color
+layout(location = 0) in vec4 pos;
+layout(location = 2) in vec2 uv;
+#else
 layout(location = 0) in vec3 pos;
 layout(location = 1) in vec3 col;
 layout(location = 2) in vec2 uv;
+#endif
 
 // UBO
 layout(binding = 0) uniform ViewProjection 
@@ -12,20 +18,42 @@ layout(binding = 0) uniform ViewProjection
     mat4 Projection;
 } view_proj;
 
-//  push constant
-layout(push_constant) uniform Model
+//  instances data, indexed by the first instance of each indirect command
+struct Instance
 {
     mat4 Model;
-} model;
+    mat4 Normal;
+    vec3 PositionOffset;  //  compact positions are offset + position * scale
+    uint MaterialIndex;
+    vec3 PositionScale;
+    uint Flags;
+    uint DrawIndex;
+    uint Padding[3];
+};
+layout(set = 0, binding = 1) readonly buffer Instances
+{
+    Instance instances[];
+};
 
 // To fragment shader
 layout(location = 0) out vec3 fragColor;
 layout(location = 1) out vec2 fragUV;
+layout(location = 2) flat out uint fragFlags;
+layout(location = 3) flat out uint fragMaterialIndex;
 
 void main() 
 {
-    gl_Position = view_proj.Projection * view_proj.View * model.Model * vec4( pos, 1.0 );
-    
+    Instance instance = instances[gl_InstanceIndex];
+#ifdef COMPACT_VERTEX
+    vec3 position = instance.PositionOffset + pos.xyz * instance.PositionScale;
+    fragColor = vec3( 1.0 );
+#else
+    vec3 position = pos;
     fragColor = col;
+#endif
+    gl_Position = view_proj.Projection * view_proj.View * instance.Model * vec4( position, 1.0 );
+    
     fragUV = uv;
+    fragFlags = instance.Flags;
+    fragMaterialIndex = instance.MaterialIndex;
 }
\ No newline at end of file
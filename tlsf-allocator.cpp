@@ -0,0 +1,287 @@
+#include "tlsf-allocator.h"
+
+#if defined( _MSC_VER )
+#include <intrin.h>
+#endif
+
+//  index of the highest set bit, value must not be 0
+static uint32_t find_last_set( uint64_t value )
+{
+#if defined( _MSC_VER ) && ( defined( _M_X64 ) || defined( _M_ARM64 ) )
+	unsigned long index;
+	_BitScanReverse64( &index, value );
+	return (uint32_t)index;
+#elif defined( __GNUC__ ) || defined( __clang__ )
+	return 63 - (uint32_t)__builtin_clzll( value );
+#else
+	uint32_t index = 0;
+	while ( value >>= 1 ) index++;
+	return index;
+#endif
+}
+
+//  index of the lowest set bit, value must not be 0
+static uint32_t find_first_set( uint64_t value )
+{
+#if defined( _MSC_VER ) && ( defined( _M_X64 ) || defined( _M_ARM64 ) )
+	unsigned long index;
+	_BitScanForward64( &index, value );
+	return (uint32_t)index;
+#elif defined( __GNUC__ ) || defined( __clang__ )
+	return (uint32_t)__builtin_ctzll( value );
+#else
+	uint32_t index = 0;
+	while ( !( value & 1 ) )
+	{
+		value >>= 1;
+		index++;
+	}
+	return index;
+#endif
+}
+
+TLSFAllocator::TLSFAllocator( uint64_t size )
+{
+	init( size );
+}
+
+void TLSFAllocator::init( uint64_t size )
+{
+	Nodes.clear();
+	UnusedNodes.clear();
+
+	FirstLevelBitmap = 0;
+	for ( uint32_t fl = 0; fl < FL_COUNT; fl++ )
+	{
+		SecondLevelBitmaps[fl] = 0;
+		for ( uint32_t sl = 0; sl < SL_COUNT; sl++ )
+		{
+			FreeHeads[fl][sl] = INVALID_HANDLE;
+		}
+	}
+
+	TotalSize = size;
+	UsedSize = 0;
+	AllocationCount = 0;
+	if ( size == 0 ) return;
+
+	//  whole space starts as one free block
+	uint32_t handle = create_node();
+	Nodes[handle].Offset = 0;
+	Nodes[handle].Size = size;
+	insert_free( handle );
+}
+
+uint32_t TLSFAllocator::allocate( uint64_t size, uint64_t alignment, uint64_t* offset )
+{
+	if ( size == 0 ) size = 1;
+	if ( alignment == 0 ) alignment = 1;
+
+	//  over-request so that whichever block is found can be aligned
+	uint32_t handle = find_free( size + alignment - 1 );
+	if ( handle == INVALID_HANDLE ) return INVALID_HANDLE;
+	remove_free( handle );
+
+	//  give the front padding back to the free lists
+	uint64_t aligned_offset = ( Nodes[handle].Offset + alignment - 1 ) / alignment * alignment;
+	uint64_t padding = aligned_offset - Nodes[handle].Offset;
+	if ( padding > 0 )
+	{
+		uint32_t rest = split( handle, padding );
+		insert_free( handle );
+		handle = rest;
+	}
+
+	//  give the unused tail back too
+	if ( Nodes[handle].Size > size )
+	{
+		uint32_t tail = split( handle, size );
+		insert_free( tail );
+	}
+
+	Nodes[handle].IsFree = false;
+	UsedSize += Nodes[handle].Size;
+	AllocationCount++;
+
+	*offset = Nodes[handle].Offset;
+	return handle;
+}
+
+void TLSFAllocator::free( uint32_t handle )
+{
+	if ( handle == INVALID_HANDLE || handle >= Nodes.size() || Nodes[handle].IsFree ) return;
+
+	Nodes[handle].IsFree = true;
+	UsedSize -= Nodes[handle].Size;
+	AllocationCount--;
+
+	//  coalesce with free neighbours
+	uint32_t next = Nodes[handle].NextPhysical;
+	if ( next != INVALID_HANDLE && Nodes[next].IsFree )
+	{
+		remove_free( next );
+		merge_next( handle );
+	}
+
+	uint32_t prev = Nodes[handle].PrevPhysical;
+	if ( prev != INVALID_HANDLE && Nodes[prev].IsFree )
+	{
+		remove_free( prev );
+		merge_next( prev );
+		handle = prev;
+	}
+
+	insert_free( handle );
+}
+
+uint32_t TLSFAllocator::create_node()
+{
+	if ( !UnusedNodes.empty() )
+	{
+		uint32_t handle = UnusedNodes.back();
+		UnusedNodes.pop_back();
+
+		Nodes[handle] = Node {};
+		return handle;
+	}
+
+	Nodes.push_back( Node {} );
+	return (uint32_t)Nodes.size() - 1;
+}
+
+void TLSFAllocator::destroy_node( uint32_t handle )
+{
+	Nodes[handle].IsFree = false;
+	Nodes[handle].Size = 0;
+	UnusedNodes.push_back( handle );
+}
+
+void TLSFAllocator::insert_free( uint32_t handle )
+{
+	uint32_t fl, sl;
+	mapping( Nodes[handle].Size, &fl, &sl );
+
+	Node& node = Nodes[handle];
+	node.IsFree = true;
+	node.PrevFree = INVALID_HANDLE;
+	node.NextFree = FreeHeads[fl][sl];
+	if ( node.NextFree != INVALID_HANDLE )
+	{
+		Nodes[node.NextFree].PrevFree = handle;
+	}
+
+	FreeHeads[fl][sl] = handle;
+	FirstLevelBitmap |= 1ull << fl;
+	SecondLevelBitmaps[fl] |= 1u << sl;
+}
+
+void TLSFAllocator::remove_free( uint32_t handle )
+{
+	uint32_t fl, sl;
+	mapping( Nodes[handle].Size, &fl, &sl );
+
+	Node& node = Nodes[handle];
+	if ( node.PrevFree != INVALID_HANDLE ) Nodes[node.PrevFree].NextFree = node.NextFree;
+	if ( node.NextFree != INVALID_HANDLE ) Nodes[node.NextFree].PrevFree = node.PrevFree;
+
+	if ( FreeHeads[fl][sl] == handle )
+	{
+		FreeHeads[fl][sl] = node.NextFree;
+
+		//  list is now empty, clear its bits
+		if ( FreeHeads[fl][sl] == INVALID_HANDLE )
+		{
+			SecondLevelBitmaps[fl] &= ~( 1u << sl );
+			if ( SecondLevelBitmaps[fl] == 0 )
+			{
+				FirstLevelBitmap &= ~( 1ull << fl );
+			}
+		}
+	}
+
+	node.PrevFree = INVALID_HANDLE;
+	node.NextFree = INVALID_HANDLE;
+	node.IsFree = false;
+}
+
+uint32_t TLSFAllocator::find_free( uint64_t size )
+{
+	if ( size > TotalSize ) return INVALID_HANDLE;
+
+	//  round up to the next size class so that any block of the found class fits
+	if ( size >= SL_COUNT )
+	{
+		size += ( 1ull << ( find_last_set( size ) - SL_LOG2 ) ) - 1;
+	}
+
+	uint32_t fl, sl;
+	mapping( size, &fl, &sl );
+
+	//  search in the same first level, then in the larger ones
+	uint32_t sl_map = SecondLevelBitmaps[fl] & ( ~0u << sl );
+	if ( sl_map == 0 )
+	{
+		if ( fl + 1 >= FL_COUNT ) return INVALID_HANDLE;
+
+		uint64_t fl_map = FirstLevelBitmap & ( ~0ull << ( fl + 1 ) );
+		if ( fl_map == 0 ) return INVALID_HANDLE;
+
+		fl = find_first_set( fl_map );
+		sl_map = SecondLevelBitmaps[fl];
+	}
+	sl = find_first_set( sl_map );
+
+	return FreeHeads[fl][sl];
+}
+
+uint32_t TLSFAllocator::split( uint32_t handle, uint64_t size )
+{
+	uint32_t tail = create_node();
+
+	//  create_node may have grown the pool, fetch references afterwards
+	Node& node = Nodes[handle];
+	Node& tail_node = Nodes[tail];
+	tail_node.Offset = node.Offset + size;
+	tail_node.Size = node.Size - size;
+	tail_node.PrevPhysical = handle;
+	tail_node.NextPhysical = node.NextPhysical;
+	if ( node.NextPhysical != INVALID_HANDLE )
+	{
+		Nodes[node.NextPhysical].PrevPhysical = tail;
+	}
+
+	node.Size = size;
+	node.NextPhysical = tail;
+	return tail;
+}
+
+void TLSFAllocator::merge_next( uint32_t handle )
+{
+	uint32_t next = Nodes[handle].NextPhysical;
+
+	Nodes[handle].Size += Nodes[next].Size;
+	Nodes[handle].NextPhysical = Nodes[next].NextPhysical;
+	if ( Nodes[next].NextPhysical != INVALID_HANDLE )
+	{
+		Nodes[Nodes[next].NextPhysical].PrevPhysical = handle;
+	}
+
+	destroy_node( next );
+}
+
+void TLSFAllocator::mapping( uint64_t size, uint32_t* fl, uint32_t* sl )
+{
+	//  small sizes get one list each
+	if ( size < SL_COUNT )
+	{
+		*fl = 0;
+		*sl = (uint32_t)size;
+		return;
+	}
+
+	//  otherwise, first level is the power of two, second level
+	//  subdivides it linearly
+	uint32_t bit = find_last_set( size );
+	*sl = (uint32_t)( size >> ( bit - SL_LOG2 ) ) - SL_COUNT;
+	*fl = bit - SL_LOG2 + 1;
+}
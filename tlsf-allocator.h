@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+//  Two-Level Segregated Fit range allocator: hands out [offset, offset + size) ranges
+//  inside a fixed-size space in O(1), coalescing neighbours on free.
+//  It only does bookkeeping, the caller owns whatever memory the ranges refer to.
+class TLSFAllocator
+{
+public:
+	static const uint32_t INVALID_HANDLE = UINT32_MAX;
+
+	TLSFAllocator() = default;
+	TLSFAllocator( uint64_t size );
+
+	void init( uint64_t size );
+
+	uint32_t allocate( uint64_t size, uint64_t alignment, uint64_t* offset );
+	void free( uint32_t handle );
+
+	uint64_t get_offset( uint32_t handle ) const { return Nodes[handle].Offset; }
+	uint64_t get_size( uint32_t handle ) const { return Nodes[handle].Size; }
+
+	uint64_t get_total_size() const { return TotalSize; }
+	uint64_t get_used_size() const { return UsedSize; }
+	uint32_t get_allocation_count() const { return AllocationCount; }
+	bool is_empty() const { return AllocationCount == 0; }
+
+private:
+	static const uint32_t SL_LOG2 = 4;
+	static const uint32_t SL_COUNT = 1 << SL_LOG2;
+	static const uint32_t FL_COUNT = 64 - SL_LOG2 + 1;
+
+	struct Node
+	{
+		uint64_t Offset = 0;
+		uint64_t Size = 0;
+
+		//  neighbours in address order
+		uint32_t PrevPhysical = INVALID_HANDLE;
+		uint32_t NextPhysical = INVALID_HANDLE;
+
+		//  neighbours in the free list of the same size class
+		uint32_t PrevFree = INVALID_HANDLE;
+		uint32_t NextFree = INVALID_HANDLE;
+
+		bool IsFree = false;
+	};
+
+	std::vector<Node> Nodes;
+	std::vector<uint32_t> UnusedNodes;
+
+	uint64_t FirstLevelBitmap = 0;
+	uint32_t SecondLevelBitmaps[FL_COUNT] {};
+	uint32_t FreeHeads[FL_COUNT][SL_COUNT] {};
+
+	uint64_t TotalSize = 0;
+	uint64_t UsedSize = 0;
+	uint32_t AllocationCount = 0;
+
+	uint32_t create_node();
+	void destroy_node( uint32_t handle );
+
+	void insert_free( uint32_t handle );
+	void remove_free( uint32_t handle );
+	uint32_t find_free( uint64_t size );
+
+	//  cut a node after size bytes, returns the new tail node
+	uint32_t split( uint32_t handle, uint64_t size );
+	//  merge a node with its next physical neighbour
+	void merge_next( uint32_t handle );
+
+	static void mapping( uint64_t size, uint32_t* fl, uint32_t* sl );
+};
@@ -0,0 +1,315 @@
+#include "vulkan-depth-pyramid.h"
+
+#include <algorithm>
+
+#include "vulkan-utils.hpp"
+
+static uint32_t get_previous_power_of_two( uint32_t value )
+{
+	uint32_t power = 1;
+	while ( power * 2 <= value )
+	{
+		power *= 2;
+	}
+	return power;
+}
+
+void VulkanDepthPyramid::init(
+	VulkanMemoryAllocator* allocator,
+	vk::CommandBuffer setup_buffer,
+	vk::Extent2D depth_extent,
+	vk::ImageView depth_view,
+	vk::SampleCountFlagBits depth_samples
+)
+{
+	Allocator = allocator;
+	Device = allocator->get_device();
+	DepthExtent = depth_extent;
+	DepthSampleCount = (uint32_t)depth_samples;
+
+	//  a power of two makes every texel cover exactly 2x2 texels of the next mip,
+	//  texels of the first mip cover 1 to 2 texels of the depth buffer on each axis
+	Extent.width = get_previous_power_of_two( depth_extent.width );
+	Extent.height = get_previous_power_of_two( depth_extent.height );
+	MipLevels = 1;
+	while ( ( std::max( Extent.width, Extent.height ) >> MipLevels ) > 0 )
+	{
+		MipLevels++;
+	}
+
+	create_image( setup_buffer );
+
+	//  without a depth buffer to read, the pyramid is only bound, never built
+	if ( !depth_view ) return;
+	create_pipelines();
+	create_descriptor_sets( depth_view );
+}
+
+void VulkanDepthPyramid::release()
+{
+	Device.destroyPipeline( DepthPipeline );
+	Device.destroyPipeline( ReducePipeline );
+	Device.destroyPipelineLayout( PipelineLayout );
+	Device.destroyDescriptorPool( DescriptorPool );
+	Device.destroyDescriptorSetLayout( DescriptorSetLayout );
+	DescriptorSets.clear();
+
+	Device.destroySampler( Sampler );
+	for ( auto& view : MipViews )
+	{
+		Device.destroyImageView( view );
+	}
+	MipViews.clear();
+	Device.destroyImageView( View );
+	Device.destroyImage( Image );
+	Allocator->free( Allocation );
+}
+
+void VulkanDepthPyramid::record_build( vk::CommandBuffer buffer )
+{
+	//  culling of this frame is done reading the previous pyramid
+	vk::MemoryBarrier read_barrier {};
+	read_barrier.srcAccessMask = vk::AccessFlagBits::eShaderRead;
+	read_barrier.dstAccessMask = vk::AccessFlagBits::eShaderWrite;
+	buffer.pipelineBarrier(
+		vk::PipelineStageFlagBits::eComputeShader,
+		vk::PipelineStageFlagBits::eComputeShader,
+		{},
+		read_barrier,
+		nullptr,
+		nullptr
+	);
+
+	vk::MemoryBarrier mip_barrier {};
+	mip_barrier.srcAccessMask = vk::AccessFlagBits::eShaderWrite;
+	mip_barrier.dstAccessMask = vk::AccessFlagBits::eShaderRead;
+
+	ReduceConstants constants {};
+	constants.SrcWidth = (int32_t)DepthExtent.width;
+	constants.SrcHeight = (int32_t)DepthExtent.height;
+	constants.SampleCount = (int32_t)DepthSampleCount;
+
+	for ( uint32_t i = 0; i < MipLevels; i++ )
+	{
+		uint32_t width = std::max( Extent.width >> i, 1u );
+		uint32_t height = std::max( Extent.height >> i, 1u );
+		constants.DstWidth = (int32_t)width;
+		constants.DstHeight = (int32_t)height;
+
+		buffer.bindPipeline( vk::PipelineBindPoint::eCompute, i == 0 ? DepthPipeline : ReducePipeline );
+		buffer.bindDescriptorSets( vk::PipelineBindPoint::eCompute, PipelineLayout, 0, DescriptorSets[i], nullptr );
+		buffer.pushConstants( PipelineLayout, vk::ShaderStageFlagBits::eCompute, 0, sizeof( ReduceConstants ), &constants );
+		buffer.dispatch( ( width + GROUP_SIZE - 1 ) / GROUP_SIZE, ( height + GROUP_SIZE - 1 ) / GROUP_SIZE, 1 );
+
+		//  next mip reads this one, and culling the last one
+		buffer.pipelineBarrier(
+			vk::PipelineStageFlagBits::eComputeShader,
+			vk::PipelineStageFlagBits::eComputeShader,
+			{},
+			mip_barrier,
+			nullptr,
+			nullptr
+		);
+
+		constants.SrcWidth = (int32_t)width;
+		constants.SrcHeight = (int32_t)height;
+		constants.SampleCount = 1;
+	}
+}
+
+void VulkanDepthPyramid::create_image( vk::CommandBuffer setup_buffer )
+{
+	vk::ImageCreateInfo image_create_info {};
+	image_create_info.imageType = vk::ImageType::e2D;
+	image_create_info.extent.width = Extent.width;
+	image_create_info.extent.height = Extent.height;
+	image_create_info.extent.depth = 1;
+	image_create_info.mipLevels = MipLevels;
+	image_create_info.arrayLayers = 1;
+	image_create_info.format = vk::Format::eR32Sfloat;
+	image_create_info.tiling = vk::ImageTiling::eOptimal;
+	image_create_info.initialLayout = vk::ImageLayout::eUndefined;
+	image_create_info.usage = vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eSampled;
+	image_create_info.samples = vk::SampleCountFlagBits::e1;
+	image_create_info.sharingMode = vk::SharingMode::eExclusive;
+	Image = Device.createImage( image_create_info );
+
+	Allocation = Allocator->allocate_image_memory(
+		Image,
+		vk::ImageTiling::eOptimal,
+		vk::MemoryPropertyFlagBits::eDeviceLocal,
+		VulkanMemoryCategory::Attachment,
+		"Depth pyramid"
+	);
+
+	vk::ImageViewCreateInfo view_create_info {};
+	view_create_info.image = Image;
+	view_create_info.viewType = vk::ImageViewType::e2D;
+	view_create_info.format = vk::Format::eR32Sfloat;
+	view_create_info.subresourceRange.aspectMask = vk::ImageAspectFlagBits::eColor;
+	view_create_info.subresourceRange.baseMipLevel = 0;
+	view_create_info.subresourceRange.levelCount = MipLevels;
+	view_create_info.subresourceRange.baseArrayLayer = 0;
+	view_create_info.subresourceRange.layerCount = 1;
+	View = Device.createImageView( view_create_info );
+
+	MipViews.resize( MipLevels );
+	for ( uint32_t i = 0; i < MipLevels; i++ )
+	{
+		view_create_info.subresourceRange.baseMipLevel = i;
+		view_create_info.subresourceRange.levelCount = 1;
+		MipViews[i] = Device.createImageView( view_create_info );
+	}
+
+	//  texels are fetched, never filtered
+	vk::SamplerCreateInfo sampler_create_info {};
+	sampler_create_info.magFilter = vk::Filter::eNearest;
+	sampler_create_info.minFilter = vk::Filter::eNearest;
+	sampler_create_info.addressModeU = vk::SamplerAddressMode::eClampToEdge;
+	sampler_create_info.addressModeV = vk::SamplerAddressMode::eClampToEdge;
+	sampler_create_info.addressModeW = vk::SamplerAddressMode::eClampToEdge;
+	sampler_create_info.mipmapMode = vk::SamplerMipmapMode::eNearest;
+	sampler_create_info.minLod = 0.0f;
+	sampler_create_info.maxLod = (float)MipLevels;
+	Sampler = Device.createSampler( sampler_create_info );
+
+	//  the pyramid is always fully rewritten, its content does not matter until then
+	vk::ImageMemoryBarrier barrier {};
+	barrier.oldLayout = vk::ImageLayout::eUndefined;
+	barrier.newLayout = vk::ImageLayout::eGeneral;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = Image;
+	barrier.subresourceRange = view_create_info.subresourceRange;
+	barrier.subresourceRange.baseMipLevel = 0;
+	barrier.subresourceRange.levelCount = MipLevels;
+	barrier.srcAccessMask = {};
+	barrier.dstAccessMask = vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite;
+	setup_buffer.pipelineBarrier(
+		vk::PipelineStageFlagBits::eTopOfPipe,
+		vk::PipelineStageFlagBits::eComputeShader,
+		{},
+		nullptr,
+		nullptr,
+		barrier
+	);
+}
+
+void VulkanDepthPyramid::create_descriptor_sets( vk::ImageView depth_view )
+{
+	vk::DescriptorPoolSize pool_sizes[2] {};
+	pool_sizes[0].type = vk::DescriptorType::eCombinedImageSampler;
+	pool_sizes[0].descriptorCount = 1;
+	pool_sizes[1].type = vk::DescriptorType::eStorageImage;
+	pool_sizes[1].descriptorCount = 2 * MipLevels;
+
+	vk::DescriptorPoolCreateInfo pool_create_info {};
+	pool_create_info.maxSets = MipLevels;
+	pool_create_info.poolSizeCount = 2;
+	pool_create_info.pPoolSizes = pool_sizes;
+	DescriptorPool = Device.createDescriptorPool( pool_create_info );
+
+	std::vector<vk::DescriptorSetLayout> set_layouts( MipLevels, DescriptorSetLayout );
+	vk::DescriptorSetAllocateInfo set_alloc_info {};
+	set_alloc_info.descriptorPool = DescriptorPool;
+	set_alloc_info.descriptorSetCount = MipLevels;
+	set_alloc_info.pSetLayouts = set_layouts.data();
+	DescriptorSets = Device.allocateDescriptorSets( set_alloc_info );
+
+	//  the first mip reads the depth buffer, the others the previous mip;
+	//  each shader only uses its own source binding
+	for ( uint32_t i = 0; i < MipLevels; i++ )
+	{
+		vk::DescriptorImageInfo src_info {};
+		vk::WriteDescriptorSet src_write {};
+		src_write.dstSet = DescriptorSets[i];
+		src_write.descriptorCount = 1;
+		src_write.pImageInfo = &src_info;
+		if ( i == 0 )
+		{
+			src_info.sampler = Sampler;
+			src_info.imageView = depth_view;
+			src_info.imageLayout = vk::ImageLayout::eDepthStencilReadOnlyOptimal;
+			src_write.dstBinding = 0;
+			src_write.descriptorType = vk::DescriptorType::eCombinedImageSampler;
+		}
+		else
+		{
+			src_info.imageView = MipViews[i - 1];
+			src_info.imageLayout = vk::ImageLayout::eGeneral;
+			src_write.dstBinding = 1;
+			src_write.descriptorType = vk::DescriptorType::eStorageImage;
+		}
+
+		vk::DescriptorImageInfo dst_info {};
+		dst_info.imageView = MipViews[i];
+		dst_info.imageLayout = vk::ImageLayout::eGeneral;
+		vk::WriteDescriptorSet dst_write {};
+		dst_write.dstSet = DescriptorSets[i];
+		dst_write.dstBinding = 2;
+		dst_write.descriptorType = vk::DescriptorType::eStorageImage;
+		dst_write.descriptorCount = 1;
+		dst_write.pImageInfo = &dst_info;
+
+		vk::WriteDescriptorSet set_writes[] = { src_write, dst_write };
+		Device.updateDescriptorSets( 2, set_writes, 0, nullptr );
+	}
+}
+
+void VulkanDepthPyramid::create_pipelines()
+{
+	//  depth buffer, source mip & destination mip
+	vk::DescriptorSetLayoutBinding bindings[3] {};
+	bindings[0].binding = 0;
+	bindings[0].descriptorType = vk::DescriptorType::eCombinedImageSampler;
+	bindings[1].binding = 1;
+	bindings[1].descriptorType = vk::DescriptorType::eStorageImage;
+	bindings[2].binding = 2;
+	bindings[2].descriptorType = vk::DescriptorType::eStorageImage;
+	for ( uint32_t i = 0; i < 3; i++ )
+	{
+		bindings[i].descriptorCount = 1;
+		bindings[i].stageFlags = vk::ShaderStageFlagBits::eCompute;
+	}
+
+	vk::DescriptorSetLayoutCreateInfo layout_create_info {};
+	layout_create_info.bindingCount = 3;
+	layout_create_info.pBindings = bindings;
+	DescriptorSetLayout = Device.createDescriptorSetLayout( layout_create_info );
+
+	vk::PushConstantRange push_constant_range {};
+	push_constant_range.stageFlags = vk::ShaderStageFlagBits::eCompute;
+	push_constant_range.offset = 0;
+	push_constant_range.size = sizeof( ReduceConstants );
+
+	vk::PipelineLayoutCreateInfo pipeline_layout_create_info {};
+	pipeline_layout_create_info.setLayoutCount = 1;
+	pipeline_layout_create_info.pSetLayouts = &DescriptorSetLayout;
+	pipeline_layout_create_info.pushConstantRangeCount = 1;
+	pipeline_layout_create_info.pPushConstantRanges = &push_constant_range;
+	PipelineLayout = Device.createPipelineLayout( pipeline_layout_create_info );
+
+	//  a multisampled depth buffer is read through another sampler type
+	DepthPipeline = create_pipeline( DepthSampleCount > 1 ? "shaders/hiz_depth_ms.spv" : "shaders/hiz_depth.spv" );
+	ReducePipeline = create_pipeline( "shaders/hiz_reduce.spv" );
+}
+
+vk::Pipeline VulkanDepthPyramid::create_pipeline( const char* shader_file )
+{
+	std::vector<char> shader_code = read_shader_file( shader_file );
+	vk::ShaderModuleCreateInfo module_create_info {};
+	module_create_info.codeSize = shader_code.size();
+	module_create_info.pCode = reinterpret_cast<const uint32_t*>( shader_code.data() );
+	vk::ShaderModule shader_module = Device.createShaderModule( module_create_info );
+
+	vk::ComputePipelineCreateInfo pipeline_create_info {};
+	pipeline_create_info.stage.stage = vk::ShaderStageFlagBits::eCompute;
+	pipeline_create_info.stage.module = shader_module;
+	pipeline_create_info.stage.pName = "main";
+	pipeline_create_info.layout = PipelineLayout;
+
+	auto result = Device.createComputePipeline( VK_NULL_HANDLE, pipeline_create_info );
+	Device.destroyShaderModule( shader_module );
+	if ( result.result != vk::Result::eSuccess ) throw std::runtime_error( "Could not create the depth pyramid pipeline" );
+	return result.value;
+}
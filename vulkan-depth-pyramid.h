@@ -0,0 +1,78 @@
+#pragma once
+
+#include <vector>
+
+#include <vulkan/vulkan.hpp>
+
+#include "vulkan-memory-allocator.h"
+
+//  Hierarchical depth buffer (Hi-Z): every mip of an R32F image holds the
+//  farthest depth of the texels it covers in the previous one, the first mip
+//  covering the depth buffer at the previous power of two size. A bounding
+//  box is then tested against a single mip whose texels are about its size:
+//  it is hidden if its nearest depth is behind the farthest depth there.
+//
+//  The pyramid stays in general layout, written by the reduction & read by
+//  culling shaders through get_view() & get_sampler().
+class VulkanDepthPyramid
+{
+public:
+	//  setup_buffer records the initial layout transition of the pyramid;
+	//  without depth_view (depth buffer not sampled), it can't be built
+	void init(
+		VulkanMemoryAllocator* allocator,
+		vk::CommandBuffer setup_buffer,
+		vk::Extent2D depth_extent,
+		vk::ImageView depth_view,
+		vk::SampleCountFlagBits depth_samples
+	);
+	void release();
+
+	//  reduce the depth buffer, in depth read only layout, into every mip;
+	//  the pyramid is then visible to compute shaders recorded afterwards
+	void record_build( vk::CommandBuffer buffer );
+	bool can_build() const { return (bool)DepthPipeline; }
+
+	vk::ImageView get_view() const { return View; }
+	vk::Sampler get_sampler() const { return Sampler; }
+	vk::Extent2D get_extent() const { return Extent; }
+	uint32_t get_mip_levels() const { return MipLevels; }
+
+private:
+	struct ReduceConstants
+	{
+		int32_t SrcWidth = 0;
+		int32_t SrcHeight = 0;
+		int32_t DstWidth = 0;
+		int32_t DstHeight = 0;
+		int32_t SampleCount = 1;
+	};
+
+	VulkanMemoryAllocator* Allocator = nullptr;
+	vk::Device Device;
+
+	vk::Image Image;
+	VulkanAllocation Allocation;
+	vk::ImageView View;  //  every mip, for culling
+	std::vector<vk::ImageView> MipViews;  //  one mip each, for the reduction
+	vk::Sampler Sampler;
+	vk::Extent2D Extent;
+	uint32_t MipLevels = 0;
+
+	vk::Extent2D DepthExtent;
+	uint32_t DepthSampleCount = 1;
+
+	vk::DescriptorSetLayout DescriptorSetLayout;
+	vk::DescriptorPool DescriptorPool;
+	std::vector<vk::DescriptorSet> DescriptorSets;  //  per mip
+	vk::PipelineLayout PipelineLayout;
+	vk::Pipeline DepthPipeline;  //  depth buffer to the first mip
+	vk::Pipeline ReducePipeline;  //  mip to the next one
+
+	const uint32_t GROUP_SIZE = 8;  //  local_size_x & local_size_y of the shaders
+
+	void create_image( vk::CommandBuffer setup_buffer );
+	void create_descriptor_sets( vk::ImageView depth_view );
+	void create_pipelines();
+	vk::Pipeline create_pipeline( const char* shader_file );
+};
@@ -0,0 +1,144 @@
+#include "vulkan-draw-buffer.h"
+
+#include <algorithm>
+
+#include "vulkan-utils.hpp"
+
+void VulkanDrawBuffer::init( 
+	VulkanMemoryAllocator* allocator, 
+	uint32_t initial_commands, 
+	uint32_t initial_instances, 
+	vk::DeviceSize instance_data_size, 
+	uint32_t frame_count,
+	bool is_gpu_written
+)
+{
+	Allocator = allocator;
+	InstanceDataSize = instance_data_size;
+	MemoryProperties = is_gpu_written
+		? vk::MemoryPropertyFlags( vk::MemoryPropertyFlagBits::eDeviceLocal )
+		: vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent;
+
+	Frames.resize( frame_count );
+	for ( auto& frame : Frames )
+	{
+		create_indirect_buffer( frame, std::max( initial_commands, 1u ) );
+		create_instance_buffer( frame, std::max( initial_instances, 1u ) );
+	}
+
+	begin_frame( 0 );
+}
+
+void VulkanDrawBuffer::release()
+{
+	vk::Device device = Allocator->get_device();
+
+	for ( auto& frame : Frames )
+	{
+		device.destroyBuffer( frame.IndirectBuffer );
+		Allocator->free( frame.IndirectAllocation );
+
+		device.destroyBuffer( frame.InstanceBuffer );
+		Allocator->free( frame.InstanceAllocation );
+	}
+	Frames.clear();
+}
+
+void VulkanDrawBuffer::begin_frame( uint32_t frame )
+{
+	Frame = frame % (uint32_t)Frames.size();
+	CommandCount = 0;
+	InstanceCount = 0;
+}
+
+bool VulkanDrawBuffer::reserve( uint32_t command_count, uint32_t instance_count )
+{
+	vk::Device device = Allocator->get_device();
+	FrameBuffers& frame = Frames[Frame];
+	bool is_recreated = false;
+
+	//  grow by half again as much, so that a slowly growing scene rarely reallocates
+	command_count += CommandCount;
+	if ( command_count > frame.MaxCommands )
+	{
+		device.destroyBuffer( frame.IndirectBuffer );
+		Allocator->free( frame.IndirectAllocation );
+		create_indirect_buffer( frame, std::max( command_count, frame.MaxCommands + frame.MaxCommands / 2 ) );
+		is_recreated = true;
+	}
+
+	instance_count += InstanceCount;
+	if ( instance_count > frame.MaxInstances )
+	{
+		device.destroyBuffer( frame.InstanceBuffer );
+		Allocator->free( frame.InstanceAllocation );
+		create_instance_buffer( frame, std::max( instance_count, frame.MaxInstances + frame.MaxInstances / 2 ) );
+		is_recreated = true;
+	}
+
+	return is_recreated;
+}
+
+uint32_t VulkanDrawBuffer::allocate_commands( uint32_t count )
+{
+	if ( CommandCount + count > Frames[Frame].MaxCommands )
+	{
+		throw std::runtime_error( "Draw buffer is out of commands for this frame, reserve them first" );
+	}
+
+	uint32_t first = CommandCount;
+	CommandCount += count;
+	return first;
+}
+
+uint32_t VulkanDrawBuffer::allocate_instances( uint32_t count )
+{
+	if ( InstanceCount + count > Frames[Frame].MaxInstances )
+	{
+		throw std::runtime_error( "Draw buffer is out of instances for this frame, reserve them first" );
+	}
+
+	uint32_t first = InstanceCount;
+	InstanceCount += count;
+	return first;
+}
+
+vk::DrawIndexedIndirectCommand* VulkanDrawBuffer::get_commands() const
+{
+	return (vk::DrawIndexedIndirectCommand*)Frames[Frame].IndirectAllocation.MappedData;
+}
+
+void VulkanDrawBuffer::create_indirect_buffer( FrameBuffers& frame, uint32_t max_commands )
+{
+	frame.MaxCommands = max_commands;
+	create_buffer(
+		Allocator,
+		(vk::DeviceSize)max_commands * get_indirect_stride(),
+		vk::BufferUsageFlagBits::eIndirectBuffer | vk::BufferUsageFlagBits::eStorageBuffer,  //  written by GPU culling
+		MemoryProperties,
+		&frame.IndirectBuffer,
+		&frame.IndirectAllocation,
+		VulkanMemoryCategory::Storage,
+		"Indirect draws"
+	);
+}
+
+void VulkanDrawBuffer::create_instance_buffer( FrameBuffers& frame, uint32_t max_instances )
+{
+	frame.MaxInstances = max_instances;
+	create_buffer(
+		Allocator,
+		max_instances * InstanceDataSize,
+		vk::BufferUsageFlagBits::eStorageBuffer,
+		MemoryProperties,
+		&frame.InstanceBuffer,
+		&frame.InstanceAllocation,
+		VulkanMemoryCategory::Storage,
+		"Instance data"
+	);
+}
+
+void* VulkanDrawBuffer::get_instance_data() const
+{
+	return Frames[Frame].InstanceAllocation.MappedData;
+}
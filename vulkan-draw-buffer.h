@@ -0,0 +1,78 @@
+#pragma once
+
+#include <vector>
+
+#include <vulkan/vulkan.hpp>
+
+#include "vulkan-memory-allocator.h"
+
+//  Per frame in flight, persistently mapped arrays of indexed indirect draw
+//  commands and of per-instance data. A command points at its data with its
+//  firstInstance, which shaders fetch with gl_InstanceIndex; a whole frame is
+//  then submitted with a few multi-draw indirect calls instead of one per mesh.
+//
+//  Arrays have no fixed capacity: each frame has its own buffers, which grow
+//  when the frame starts writing, once its previous use is done. When the GPU
+//  writes them (GPU culling), they are device local and not mapped.
+class VulkanDrawBuffer
+{
+public:
+	void init( 
+		VulkanMemoryAllocator* allocator, 
+		uint32_t initial_commands, 
+		uint32_t initial_instances, 
+		vk::DeviceSize instance_data_size, 
+		uint32_t frame_count,
+		bool is_gpu_written
+	);
+	void release();
+
+	//  start writing the arrays of a frame, whose previous use must be done
+	void begin_frame( uint32_t frame );
+	//  make room for the whole frame before allocating, returns true if the
+	//  buffers of the frame were recreated and their descriptors must be updated
+	bool reserve( uint32_t command_count, uint32_t instance_count );
+
+	//  reserve consecutive entries in the current frame, returns the first index
+	uint32_t allocate_commands( uint32_t count );
+	uint32_t allocate_instances( uint32_t count );
+
+	//  mapped arrays of the current frame, to be filled at allocated indices,
+	//  null when the GPU writes them
+	vk::DrawIndexedIndirectCommand* get_commands() const;
+	template <typename T>
+	T* get_instances() const { return (T*)get_instance_data(); }
+
+	uint32_t get_command_count() const { return CommandCount; }
+	uint32_t get_instance_count() const { return InstanceCount; }
+
+	static uint32_t get_indirect_stride() { return sizeof( vk::DrawIndexedIndirectCommand ); }
+	vk::Buffer get_indirect_buffer() const { return Frames[Frame].IndirectBuffer; }
+	vk::Buffer get_instance_buffer() const { return Frames[Frame].InstanceBuffer; }
+	vk::Buffer get_instance_buffer( uint32_t frame ) const { return Frames[frame].InstanceBuffer; }
+
+private:
+	struct FrameBuffers
+	{
+		vk::Buffer IndirectBuffer;
+		VulkanAllocation IndirectAllocation;
+		uint32_t MaxCommands = 0;
+
+		vk::Buffer InstanceBuffer;
+		VulkanAllocation InstanceAllocation;
+		uint32_t MaxInstances = 0;
+	};
+
+	VulkanMemoryAllocator* Allocator = nullptr;
+	vk::DeviceSize InstanceDataSize = 0;
+	vk::MemoryPropertyFlags MemoryProperties;
+
+	std::vector<FrameBuffers> Frames;
+	uint32_t Frame = 0;
+	uint32_t CommandCount = 0;
+	uint32_t InstanceCount = 0;
+
+	void create_indirect_buffer( FrameBuffers& frame, uint32_t max_commands );
+	void create_instance_buffer( FrameBuffers& frame, uint32_t max_instances );
+	void* get_instance_data() const;
+};
@@ -0,0 +1,278 @@
+#include "vulkan-geometry-buffer.h"
+
+void VulkanGeometryBuffer::init( VulkanMemoryAllocator* allocator, vk::DeviceSize vertex_buffer_size, vk::DeviceSize index_buffer_size )
+{
+	Allocator = allocator;
+	Device = allocator->get_device();
+
+	create_buffer(
+		Allocator,
+		vertex_buffer_size,
+		vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eVertexBuffer,
+		vk::MemoryPropertyFlagBits::eDeviceLocal,
+		&VertexBuffer,
+		&VertexBufferAllocation,
+		VulkanMemoryCategory::Geometry,
+		"Geometry vertices"
+	);
+	VertexRanges.init( vertex_buffer_size / VERTEX_UNIT );
+
+	create_buffer(
+		Allocator,
+		index_buffer_size,
+		vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eIndexBuffer,
+		vk::MemoryPropertyFlagBits::eDeviceLocal,
+		&IndexBuffer,
+		&IndexBufferAllocation,
+		VulkanMemoryCategory::Geometry,
+		"Geometry indices"
+	);
+	IndexRanges.init( index_buffer_size / INDEX_UNIT );
+}
+
+void VulkanGeometryBuffer::release()
+{
+	release_retired( UINT64_MAX );
+
+	if ( !VertexRanges.is_empty() || !IndexRanges.is_empty() )
+	{
+		printf( "Geometry buffer released with %d vertex ranges & %d index ranges still alive\n",
+			VertexRanges.get_allocation_count(), IndexRanges.get_allocation_count() );
+	}
+
+	Device.destroyBuffer( VertexBuffer );
+	Allocator->free( VertexBufferAllocation );
+
+	Device.destroyBuffer( IndexBuffer );
+	Allocator->free( IndexBufferAllocation );
+}
+
+uint32_t VulkanGeometryBuffer::allocate(
+	VulkanUploadContext* upload_context,
+	const void* vertices,
+	uint32_t vertex_count,
+	uint32_t vertex_stride,
+	const void* indices,
+	uint32_t index_count,
+	vk::IndexType index_type
+)
+{
+	if ( vertex_stride % VERTEX_UNIT != 0 ) throw std::runtime_error( "Vertex stride is not a multiple of the geometry buffer unit" );
+
+	VulkanGeometryRange range {};
+	range.VertexCount = vertex_count;
+	range.VertexStride = vertex_stride;
+	range.IndexCount = index_count;
+	range.IndexType = index_type;
+	uint32_t index_size = get_index_size( index_type );
+
+	//  ranges are aligned to their stride, in units
+	uint64_t vertex_unit_offset, index_unit_offset;
+	range.VertexHandle = VertexRanges.allocate(
+		(uint64_t)vertex_count * vertex_stride / VERTEX_UNIT, 
+		vertex_stride / VERTEX_UNIT, 
+		&vertex_unit_offset 
+	);
+	if ( range.VertexHandle == TLSFAllocator::INVALID_HANDLE )
+	{
+		throw std::runtime_error( "Geometry buffer is out of vertex space" );
+	}
+
+	range.IndexHandle = IndexRanges.allocate( 
+		(uint64_t)index_count * index_size / INDEX_UNIT, 
+		index_size / INDEX_UNIT, 
+		&index_unit_offset 
+	);
+	if ( range.IndexHandle == TLSFAllocator::INVALID_HANDLE )
+	{
+		VertexRanges.free( range.VertexHandle );
+		throw std::runtime_error( "Geometry buffer is out of index space" );
+	}
+
+	vk::DeviceSize vertex_offset = vertex_unit_offset * VERTEX_UNIT;
+	vk::DeviceSize index_offset = index_unit_offset * INDEX_UNIT;
+	range.VertexOffset = (int32_t)( vertex_offset / vertex_stride );
+	range.FirstIndex = (uint32_t)( index_offset / index_size );
+
+	//  indices stay relative to the mesh, vertexOffset is added when drawing
+	if ( vertex_count > 0 )
+	{
+		upload_context->upload_buffer(
+			vertices,
+			(vk::DeviceSize)vertex_stride * vertex_count,
+			VertexBuffer,
+			vertex_offset
+		);
+	}
+	if ( index_count > 0 )
+	{
+		upload_context->upload_buffer(
+			indices,
+			(vk::DeviceSize)index_size * index_count,
+			IndexBuffer,
+			index_offset
+		);
+	}
+
+	uint32_t range_id;
+	if ( !FreeRangeIds.empty() )
+	{
+		range_id = FreeRangeIds.back();
+		FreeRangeIds.pop_back();
+		Ranges[range_id] = range;
+	}
+	else
+	{
+		range_id = (uint32_t)Ranges.size();
+		Ranges.push_back( range );
+	}
+
+	return range_id;
+}
+
+void VulkanGeometryBuffer::free( uint32_t range_id, uint64_t retire_key )
+{
+	//  like moved ranges, the space is still read by frames in flight
+	VulkanGeometryRange& range = Ranges[range_id];
+	if ( range.VertexHandle != TLSFAllocator::INVALID_HANDLE )
+	{
+		RetiredRanges.push_back( RetiredRange { retire_key, true, range.VertexHandle } );
+	}
+	if ( range.IndexHandle != TLSFAllocator::INVALID_HANDLE )
+	{
+		RetiredRanges.push_back( RetiredRange { retire_key, false, range.IndexHandle } );
+	}
+
+	range = VulkanGeometryRange {};
+	FreeRangeIds.push_back( range_id );
+}
+
+vk::DeviceSize VulkanGeometryBuffer::record_compaction( vk::CommandBuffer command_buffer, vk::DeviceSize max_bytes, uint64_t retire_key )
+{
+	//  free space may still be read by frames in flight from before it was
+	//  freed, copies must not overwrite it before they are done
+	vk::MemoryBarrier barrier {};
+	barrier.srcAccessMask = {};
+	barrier.dstAccessMask = vk::AccessFlagBits::eTransferWrite;
+	command_buffer.pipelineBarrier(
+		vk::PipelineStageFlagBits::eVertexInput,
+		vk::PipelineStageFlagBits::eTransfer,
+		{},
+		barrier,
+		nullptr,
+		nullptr
+	);
+
+	vk::DeviceSize moved_bytes = 0;
+	bool can_move_vertices = true, can_move_indices = true;
+	while ( moved_bytes < max_bytes && ( can_move_vertices || can_move_indices ) )
+	{
+		if ( can_move_vertices )
+		{
+			vk::DeviceSize bytes = move_last_range( command_buffer, true, retire_key );
+			can_move_vertices = bytes > 0;
+			moved_bytes += bytes;
+		}
+		if ( can_move_indices )
+		{
+			vk::DeviceSize bytes = move_last_range( command_buffer, false, retire_key );
+			can_move_indices = bytes > 0;
+			moved_bytes += bytes;
+		}
+	}
+	IsCompact = !can_move_vertices && !can_move_indices;
+
+	return moved_bytes;
+}
+
+void VulkanGeometryBuffer::release_retired( uint64_t retire_key )
+{
+	for ( size_t i = 0; i < RetiredRanges.size(); )
+	{
+		const RetiredRange& retired = RetiredRanges[i];
+		if ( retired.RetireKey > retire_key )
+		{
+			i++;
+			continue;
+		}
+
+		if ( retired.IsVertex )
+		{
+			VertexRanges.free( retired.Handle );
+		}
+		else
+		{
+			IndexRanges.free( retired.Handle );
+		}
+
+		RetiredRanges[i] = RetiredRanges.back();
+		RetiredRanges.pop_back();
+		IsCompact = false;
+	}
+}
+
+vk::DeviceSize VulkanGeometryBuffer::move_last_range( vk::CommandBuffer command_buffer, bool is_vertex, uint64_t retire_key )
+{
+	TLSFAllocator& allocator = is_vertex ? VertexRanges : IndexRanges;
+	vk::DeviceSize unit = is_vertex ? VERTEX_UNIT : INDEX_UNIT;
+
+	//  find the range ending the highest
+	uint32_t last_id = INVALID_RANGE;
+	uint64_t last_end = 0;
+	for ( uint32_t i = 0; i < Ranges.size(); i++ )
+	{
+		const VulkanGeometryRange& range = Ranges[i];
+		uint32_t handle = is_vertex ? range.VertexHandle : range.IndexHandle;
+		if ( handle == TLSFAllocator::INVALID_HANDLE ) continue;
+
+		uint64_t end = allocator.get_offset( handle ) + allocator.get_size( handle );
+		if ( end > last_end )
+		{
+			last_id = i;
+			last_end = end;
+		}
+	}
+	if ( last_id == INVALID_RANGE ) return 0;
+
+	//  allocate a new place, keep it only if it is lower
+	VulkanGeometryRange& range = Ranges[last_id];
+	uint32_t& handle = is_vertex ? range.VertexHandle : range.IndexHandle;
+	uint64_t src_offset = allocator.get_offset( handle );
+	uint64_t count = allocator.get_size( handle );
+	uint32_t element_size = is_vertex ? range.VertexStride : get_index_size( range.IndexType );
+
+	uint64_t dst_offset;
+	uint32_t new_handle = allocator.allocate( count, element_size / unit, &dst_offset );
+	if ( new_handle == TLSFAllocator::INVALID_HANDLE ) return 0;
+	if ( dst_offset >= src_offset )
+	{
+		allocator.free( new_handle );
+		return 0;
+	}
+
+	vk::Buffer buffer = is_vertex ? VertexBuffer : IndexBuffer;
+	vk::BufferCopy region {};
+	region.srcOffset = src_offset * unit;
+	region.dstOffset = dst_offset * unit;
+	region.size = count * unit;
+	command_buffer.copyBuffer( buffer, buffer, region );
+
+	//  the old place is still read by frames in flight
+	RetiredRange retired {};
+	retired.RetireKey = retire_key;
+	retired.IsVertex = is_vertex;
+	retired.Handle = handle;
+	RetiredRanges.push_back( retired );
+
+	handle = new_handle;
+	if ( is_vertex )
+	{
+		range.VertexOffset = (int32_t)( region.dstOffset / element_size );
+	}
+	else
+	{
+		range.FirstIndex = (uint32_t)( region.dstOffset / element_size );
+	}
+
+	return region.size;
+}
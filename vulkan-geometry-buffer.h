@@ -0,0 +1,109 @@
+#pragma once
+
+#include <vector>
+
+#include <vulkan/vulkan.hpp>
+
+#include "tlsf-allocator.h"
+#include "vulkan-memory-allocator.h"
+#include "vulkan-upload-context.h"
+#include "vulkan-utils.hpp"
+
+//  Vertices & indices ranges of a mesh inside the geometry buffer,
+//  offsets are counted in elements to be used as draw parameters
+struct VulkanGeometryRange
+{
+	int32_t VertexOffset = 0;
+	uint32_t VertexCount = 0;
+	uint32_t VertexStride = 0;
+	uint32_t FirstIndex = 0;
+	uint32_t IndexCount = 0;
+	vk::IndexType IndexType = vk::IndexType::eUint32;
+
+	uint32_t VertexHandle = TLSFAllocator::INVALID_HANDLE;
+	uint32_t IndexHandle = TLSFAllocator::INVALID_HANDLE;
+};
+
+//  One device local vertex buffer & one index buffer shared by every mesh.
+//  Meshes allocate ranges inside them, so that a whole frame binds them
+//  once and draws with vertexOffset & firstIndex.
+//
+//  Vertex layouts & index types are mixed in the same buffers: space is
+//  allocated in units that every stride is a multiple of, ranges aligned to
+//  their stride so that offsets in elements are whole numbers.
+//
+//  Meshes refer to their range by id: ranges can then be moved toward the
+//  start of the buffers to compact them, without the meshes noticing.
+class VulkanGeometryBuffer
+{
+public:
+	static const uint32_t INVALID_RANGE = UINT32_MAX;
+	static const uint32_t VERTEX_UNIT = 4;  //  bytes
+	static const uint32_t INDEX_UNIT = 2;
+
+	static uint32_t get_index_size( vk::IndexType index_type ) { return index_type == vk::IndexType::eUint16 ? 2 : 4; }
+
+	//  sizes in bytes
+	void init( VulkanMemoryAllocator* allocator, vk::DeviceSize vertex_buffer_size, vk::DeviceSize index_buffer_size );
+	void release();
+
+	//  allocate ranges and record their upload, throws when the buffers are full;
+	//  vertex_stride must be a multiple of VERTEX_UNIT
+	uint32_t allocate(
+		VulkanUploadContext* upload_context,
+		const void* vertices,
+		uint32_t vertex_count,
+		uint32_t vertex_stride,
+		const void* indices,
+		uint32_t index_count,
+		vk::IndexType index_type
+	);
+	//  the range id can be reused at once, its space only once release_retired
+	//  is called with retire_key, as frames in flight may still draw from it
+	void free( uint32_t range_id, uint64_t retire_key );
+
+	const VulkanGeometryRange& get_range( uint32_t range_id ) const { return Ranges[range_id]; }
+
+	//  record GPU copies moving the last ranges of the buffers to lower free
+	//  space, up to max_bytes; returns the amount of bytes moved. Draws recorded
+	//  after the command buffer is submitted already use the new ranges, the old
+	//  ones are kept until release_retired is called with the same retire_key.
+	vk::DeviceSize record_compaction( vk::CommandBuffer command_buffer, vk::DeviceSize max_bytes, uint64_t retire_key );
+	//  give back the space of ranges freed or moved with a retire_key up to this one
+	void release_retired( uint64_t retire_key );
+	//  false once ranges were freed, until a compaction finds nothing left to move
+	bool needs_compaction() const { return !IsCompact; }
+
+	vk::Buffer get_vertex_buffer() const { return VertexBuffer; }
+	vk::Buffer get_index_buffer() const { return IndexBuffer; }
+
+	vk::DeviceSize get_used_vertex_size() const { return VertexRanges.get_used_size() * VERTEX_UNIT; }
+	vk::DeviceSize get_used_index_size() const { return IndexRanges.get_used_size() * INDEX_UNIT; }
+
+private:
+	struct RetiredRange
+	{
+		uint64_t RetireKey = 0;
+		bool IsVertex = false;
+		uint32_t Handle = TLSFAllocator::INVALID_HANDLE;
+	};
+
+	VulkanMemoryAllocator* Allocator = nullptr;
+	vk::Device Device;
+
+	vk::Buffer VertexBuffer;
+	VulkanAllocation VertexBufferAllocation;
+	TLSFAllocator VertexRanges;
+
+	vk::Buffer IndexBuffer;
+	VulkanAllocation IndexBufferAllocation;
+	TLSFAllocator IndexRanges;
+
+	std::vector<VulkanGeometryRange> Ranges;
+	std::vector<uint32_t> FreeRangeIds;
+	std::vector<RetiredRange> RetiredRanges;
+	bool IsCompact = true;
+
+	//  move the range ending the highest in either buffer, if it fits lower
+	vk::DeviceSize move_last_range( vk::CommandBuffer command_buffer, bool is_vertex, uint64_t retire_key );
+};
@@ -0,0 +1,393 @@
+#include "vulkan-gpu-culling.h"
+
+#include <algorithm>
+
+#include "vulkan-utils.hpp"
+
+void VulkanGpuCulling::init( VulkanMemoryAllocator* allocator, uint32_t queue_family, uint32_t frame_count, const VulkanDepthPyramid* pyramid )
+{
+	Allocator = allocator;
+	Device = allocator->get_device();
+	Pyramid = pyramid;
+	HasOcclusion = pyramid->can_build();
+
+	create_pipeline();
+
+	//  a set & a command buffer per frame
+	vk::DescriptorPoolSize pool_sizes[3] {};
+	pool_sizes[0].type = vk::DescriptorType::eStorageBuffer;
+	pool_sizes[0].descriptorCount = 5 * frame_count;
+	pool_sizes[1].type = vk::DescriptorType::eCombinedImageSampler;
+	pool_sizes[1].descriptorCount = frame_count;
+	pool_sizes[2].type = vk::DescriptorType::eUniformBuffer;
+	pool_sizes[2].descriptorCount = frame_count;
+
+	vk::DescriptorPoolCreateInfo pool_create_info {};
+	pool_create_info.maxSets = frame_count;
+	pool_create_info.poolSizeCount = 3;
+	pool_create_info.pPoolSizes = pool_sizes;
+	DescriptorPool = Device.createDescriptorPool( pool_create_info );
+
+	vk::CommandPoolCreateInfo command_pool_create_info {};
+	command_pool_create_info.queueFamilyIndex = queue_family;
+	command_pool_create_info.flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer;
+	CommandPool = Device.createCommandPool( command_pool_create_info );
+
+	std::vector<vk::DescriptorSetLayout> set_layouts( frame_count, DescriptorSetLayout );
+	vk::DescriptorSetAllocateInfo set_alloc_info {};
+	set_alloc_info.descriptorPool = DescriptorPool;
+	set_alloc_info.descriptorSetCount = frame_count;
+	set_alloc_info.pSetLayouts = set_layouts.data();
+	std::vector<vk::DescriptorSet> descriptor_sets = Device.allocateDescriptorSets( set_alloc_info );
+
+	vk::CommandBufferAllocateInfo command_alloc_info {};
+	command_alloc_info.commandPool = CommandPool;
+	command_alloc_info.commandBufferCount = frame_count;
+	command_alloc_info.level = vk::CommandBufferLevel::ePrimary;
+	std::vector<vk::CommandBuffer> command_buffers = Device.allocateCommandBuffers( command_alloc_info );
+
+	Frames.resize( frame_count );
+	for ( uint32_t i = 0; i < frame_count; i++ )
+	{
+		FrameBuffers& frame = Frames[i];
+		frame.DescriptorSet = descriptor_sets[i];
+		frame.CommandBuffer = command_buffers[i];
+		reserve( i, 1, 1, 1 );
+
+		//  written every frame before its culling
+		create_storage_buffer(
+			sizeof( CullingParams ),
+			vk::BufferUsageFlagBits::eUniformBuffer,
+			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
+			&frame.ParamsBuffer,
+			&frame.ParamsAllocation,
+			"Culling parameters"
+		);
+
+		//  neither the pyramid nor the parameters ever change
+		vk::DescriptorImageInfo pyramid_info {};
+		pyramid_info.sampler = Pyramid->get_sampler();
+		pyramid_info.imageView = Pyramid->get_view();
+		pyramid_info.imageLayout = vk::ImageLayout::eGeneral;
+
+		vk::DescriptorBufferInfo params_info {};
+		params_info.buffer = frame.ParamsBuffer;
+		params_info.offset = 0;
+		params_info.range = sizeof( CullingParams );
+
+		vk::WriteDescriptorSet set_writes[2] {};
+		set_writes[0].dstSet = frame.DescriptorSet;
+		set_writes[0].dstBinding = 5;
+		set_writes[0].descriptorType = vk::DescriptorType::eCombinedImageSampler;
+		set_writes[0].descriptorCount = 1;
+		set_writes[0].pImageInfo = &pyramid_info;
+		set_writes[1].dstSet = frame.DescriptorSet;
+		set_writes[1].dstBinding = 6;
+		set_writes[1].descriptorType = vk::DescriptorType::eUniformBuffer;
+		set_writes[1].descriptorCount = 1;
+		set_writes[1].pBufferInfo = &params_info;
+		Device.updateDescriptorSets( 2, set_writes, 0, nullptr );
+	}
+}
+
+void VulkanGpuCulling::release()
+{
+	for ( auto& frame : Frames )
+	{
+		destroy_buffer( frame.ObjectBuffer, frame.ObjectAllocation );
+		destroy_buffer( frame.DrawBuffer, frame.DrawAllocation );
+		destroy_buffer( frame.CountBuffer, frame.CountAllocation );
+		destroy_buffer( frame.ParamsBuffer, frame.ParamsAllocation );
+	}
+	Frames.clear();
+
+	Device.destroyCommandPool( CommandPool );
+	Device.destroyDescriptorPool( DescriptorPool );
+	Device.destroyPipeline( Pipeline );
+	Device.destroyPipelineLayout( PipelineLayout );
+	Device.destroyDescriptorSetLayout( DescriptorSetLayout );
+}
+
+bool VulkanGpuCulling::reserve( uint32_t frame_index, uint32_t object_count, uint32_t draw_count, uint32_t run_count )
+{
+	FrameBuffers& frame = Frames[frame_index];
+	bool is_recreated = false;
+
+	//  grow by half again as much, like draw buffers
+	if ( object_count > frame.MaxObjects )
+	{
+		destroy_buffer( frame.ObjectBuffer, frame.ObjectAllocation );
+		frame.MaxObjects = std::max( object_count, frame.MaxObjects + frame.MaxObjects / 2 );
+		create_storage_buffer(
+			(vk::DeviceSize)frame.MaxObjects * sizeof( MeshData ),
+			vk::BufferUsageFlagBits::eStorageBuffer,
+			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
+			&frame.ObjectBuffer,
+			&frame.ObjectAllocation,
+			"Culling objects"
+		);
+		is_recreated = true;
+	}
+
+	if ( draw_count > frame.MaxDraws )
+	{
+		destroy_buffer( frame.DrawBuffer, frame.DrawAllocation );
+		frame.MaxDraws = std::max( draw_count, frame.MaxDraws + frame.MaxDraws / 2 );
+		create_storage_buffer(
+			(vk::DeviceSize)frame.MaxDraws * sizeof( CullDraw ),
+			vk::BufferUsageFlagBits::eStorageBuffer,
+			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
+			&frame.DrawBuffer,
+			&frame.DrawAllocation,
+			"Culling draws"
+		);
+		is_recreated = true;
+	}
+
+	//  counters are only touched by the GPU, keep them in device memory
+	uint32_t count_count = run_count + draw_count;
+	if ( HasOcclusion )
+	{
+		count_count = 2 * ( run_count + draw_count ) + 1 + object_count;
+	}
+	if ( count_count > frame.MaxCounts )
+	{
+		destroy_buffer( frame.CountBuffer, frame.CountAllocation );
+		frame.MaxCounts = std::max( count_count, frame.MaxCounts + frame.MaxCounts / 2 );
+		create_storage_buffer(
+			(vk::DeviceSize)frame.MaxCounts * sizeof( uint32_t ),
+			vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eIndirectBuffer
+				| vk::BufferUsageFlagBits::eTransferDst,
+			vk::MemoryPropertyFlagBits::eDeviceLocal,
+			&frame.CountBuffer,
+			&frame.CountAllocation,
+			"Culling counts"
+		);
+		is_recreated = true;
+	}
+
+	return is_recreated;
+}
+
+bool VulkanGpuCulling::update_descriptors( uint32_t frame_index, vk::Buffer instance_buffer, vk::Buffer indirect_buffer )
+{
+	FrameBuffers& frame = Frames[frame_index];
+
+	//  objects, draws, counts, instances & commands
+	vk::Buffer buffers[5] { frame.ObjectBuffer, frame.DrawBuffer, frame.CountBuffer, instance_buffer, indirect_buffer };
+	if ( std::equal( buffers, buffers + 5, frame.DescribedBuffers ) ) return false;
+
+	//  the frame's previous culling is done, its set can be rewritten
+	vk::DescriptorBufferInfo buffer_infos[5] {};
+	vk::WriteDescriptorSet set_writes[5] {};
+	for ( uint32_t i = 0; i < 5; i++ )
+	{
+		buffer_infos[i].buffer = buffers[i];
+		buffer_infos[i].offset = 0;
+		buffer_infos[i].range = VK_WHOLE_SIZE;
+
+		set_writes[i].dstSet = frame.DescriptorSet;
+		set_writes[i].dstBinding = i;
+		set_writes[i].descriptorType = vk::DescriptorType::eStorageBuffer;
+		set_writes[i].descriptorCount = 1;
+		set_writes[i].pBufferInfo = &buffer_infos[i];
+
+		frame.DescribedBuffers[i] = buffers[i];
+	}
+	Device.updateDescriptorSets( 5, set_writes, 0, nullptr );
+
+	return true;
+}
+
+vk::CommandBuffer VulkanGpuCulling::record(
+	uint32_t frame_index,
+	const Frustum& frustum,
+	const glm::mat4& view_projection,
+	float lod_error_scale,
+	bool use_pyramid,
+	uint32_t object_count,
+	uint32_t instance_count,
+	uint32_t draw_count,
+	uint32_t run_count
+)
+{
+	FrameBuffers& frame = Frames[frame_index];
+
+	//  read by both phases, the second one recorded with cached draws
+	CullingParams* params = (CullingParams*)frame.ParamsAllocation.MappedData;
+	params->ViewProjection = view_projection;
+	for ( int i = 0; i < 6; i++ )
+	{
+		params->Planes[i] = frustum.Planes[i];
+	}
+	params->ObjectCount = object_count;
+	params->DrawCount = draw_count;
+	params->RunCount = run_count;
+	params->UsePyramid = HasOcclusion && use_pyramid ? 1 : 0;
+	params->LODErrorScale = lod_error_scale;
+	params->InstanceCount = instance_count;
+
+	vk::CommandBuffer buffer = frame.CommandBuffer;
+	vk::CommandBufferBeginInfo begin_info {};
+	begin_info.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
+	buffer.begin( begin_info );
+
+	//  reset counters of both phases
+	uint32_t count_count = run_count + draw_count;
+	if ( HasOcclusion )
+	{
+		count_count = 2 * ( run_count + draw_count ) + 1;
+	}
+	if ( count_count > 0 )
+	{
+		buffer.fillBuffer( frame.CountBuffer, 0, (vk::DeviceSize)count_count * sizeof( uint32_t ), 0 );
+	}
+
+	vk::MemoryBarrier fill_barrier {};
+	fill_barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+	fill_barrier.dstAccessMask = vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite;
+	buffer.pipelineBarrier(
+		vk::PipelineStageFlagBits::eTransfer,
+		vk::PipelineStageFlagBits::eComputeShader,
+		{},
+		fill_barrier,
+		nullptr,
+		nullptr
+	);
+
+	buffer.bindPipeline( vk::PipelineBindPoint::eCompute, Pipeline );
+	buffer.bindDescriptorSets( vk::PipelineBindPoint::eCompute, PipelineLayout, 0, frame.DescriptorSet, nullptr );
+
+	//  pass 0: visible instances, per instance
+	dispatch( buffer, 0, object_count );
+	record_barrier( buffer, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite );
+
+	//  pass 1: commands of draws with visible instances, per draw
+	dispatch( buffer, 1, draw_count );
+
+	//  commands, counts & instances are read by the draws submitted next
+	record_barrier( 
+		buffer, 
+		vk::PipelineStageFlagBits::eDrawIndirect | vk::PipelineStageFlagBits::eVertexShader, 
+		vk::AccessFlagBits::eIndirectCommandRead | vk::AccessFlagBits::eShaderRead 
+	);
+
+	buffer.end();
+	return buffer;
+}
+
+void VulkanGpuCulling::record_second_phase( vk::CommandBuffer buffer, uint32_t frame_index )
+{
+	const FrameBuffers& frame = Frames[frame_index];
+
+	buffer.bindPipeline( vk::PipelineBindPoint::eCompute, Pipeline );
+	buffer.bindDescriptorSets( vk::PipelineBindPoint::eCompute, PipelineLayout, 0, frame.DescriptorSet, nullptr );
+
+	//  pass 2: hidden instances visible in the new pyramid, per instance left
+	dispatch( buffer, 2, frame.MaxObjects );
+	record_barrier( buffer, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite );
+
+	//  pass 3: commands of the second phase, per draw
+	dispatch( buffer, 3, frame.MaxDraws );
+	record_barrier( 
+		buffer, 
+		vk::PipelineStageFlagBits::eDrawIndirect | vk::PipelineStageFlagBits::eVertexShader, 
+		vk::AccessFlagBits::eIndirectCommandRead | vk::AccessFlagBits::eShaderRead 
+	);
+}
+
+void VulkanGpuCulling::dispatch( vk::CommandBuffer buffer, uint32_t pass, uint32_t count )
+{
+	if ( count == 0 ) return;
+
+	PushConstants constants {};
+	constants.Pass = pass;
+	buffer.pushConstants( PipelineLayout, vk::ShaderStageFlagBits::eCompute, 0, sizeof( PushConstants ), &constants );
+	buffer.dispatch( ( count + GROUP_SIZE - 1 ) / GROUP_SIZE, 1, 1 );
+}
+
+void VulkanGpuCulling::record_barrier( vk::CommandBuffer buffer, vk::PipelineStageFlags dst_stages, vk::AccessFlags dst_access )
+{
+	vk::MemoryBarrier barrier {};
+	barrier.srcAccessMask = vk::AccessFlagBits::eShaderWrite;
+	barrier.dstAccessMask = dst_access;
+	buffer.pipelineBarrier(
+		vk::PipelineStageFlagBits::eComputeShader,
+		dst_stages,
+		{},
+		barrier,
+		nullptr,
+		nullptr
+	);
+}
+
+void VulkanGpuCulling::create_pipeline()
+{
+	//  objects, draws, counts, instances & commands, then the pyramid & parameters
+	vk::DescriptorSetLayoutBinding bindings[7] {};
+	for ( uint32_t i = 0; i < 7; i++ )
+	{
+		bindings[i].binding = i;
+		bindings[i].descriptorType = vk::DescriptorType::eStorageBuffer;
+		bindings[i].descriptorCount = 1;
+		bindings[i].stageFlags = vk::ShaderStageFlagBits::eCompute;
+	}
+	bindings[5].descriptorType = vk::DescriptorType::eCombinedImageSampler;
+	bindings[6].descriptorType = vk::DescriptorType::eUniformBuffer;
+
+	vk::DescriptorSetLayoutCreateInfo layout_create_info {};
+	layout_create_info.bindingCount = 7;
+	layout_create_info.pBindings = bindings;
+	DescriptorSetLayout = Device.createDescriptorSetLayout( layout_create_info );
+
+	vk::PushConstantRange push_constant_range {};
+	push_constant_range.stageFlags = vk::ShaderStageFlagBits::eCompute;
+	push_constant_range.offset = 0;
+	push_constant_range.size = sizeof( PushConstants );
+
+	vk::PipelineLayoutCreateInfo pipeline_layout_create_info {};
+	pipeline_layout_create_info.setLayoutCount = 1;
+	pipeline_layout_create_info.pSetLayouts = &DescriptorSetLayout;
+	pipeline_layout_create_info.pushConstantRangeCount = 1;
+	pipeline_layout_create_info.pPushConstantRanges = &push_constant_range;
+	PipelineLayout = Device.createPipelineLayout( pipeline_layout_create_info );
+
+	std::vector<char> shader_code = read_shader_file( "shaders/cull.spv" );
+	vk::ShaderModuleCreateInfo module_create_info {};
+	module_create_info.codeSize = shader_code.size();
+	module_create_info.pCode = reinterpret_cast<const uint32_t*>( shader_code.data() );
+	vk::ShaderModule shader_module = Device.createShaderModule( module_create_info );
+
+	vk::ComputePipelineCreateInfo pipeline_create_info {};
+	pipeline_create_info.stage.stage = vk::ShaderStageFlagBits::eCompute;
+	pipeline_create_info.stage.module = shader_module;
+	pipeline_create_info.stage.pName = "main";
+	pipeline_create_info.layout = PipelineLayout;
+
+	auto result = Device.createComputePipeline( VK_NULL_HANDLE, pipeline_create_info );
+	Device.destroyShaderModule( shader_module );
+	if ( result.result != vk::Result::eSuccess ) throw std::runtime_error( "Could not create the culling pipeline" );
+	Pipeline = result.value;
+}
+
+void VulkanGpuCulling::create_storage_buffer( 
+	vk::DeviceSize size, 
+	vk::BufferUsageFlags usage, 
+	vk::MemoryPropertyFlags properties, 
+	vk::Buffer* buffer, 
+	VulkanAllocation* allocation, 
+	const char* name 
+)
+{
+	//  the parameters are the only uniform buffer
+	VulkanMemoryCategory category = ( usage & vk::BufferUsageFlagBits::eUniformBuffer ) ? VulkanMemoryCategory::Uniform : VulkanMemoryCategory::Storage;
+	create_buffer( Allocator, size, usage, properties, buffer, allocation, category, name );
+}
+
+void VulkanGpuCulling::destroy_buffer( vk::Buffer buffer, const VulkanAllocation& allocation )
+{
+	if ( !buffer ) return;
+
+	Device.destroyBuffer( buffer );
+	Allocator->free( allocation );
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <vector>
+
+#include <vulkan/vulkan.hpp>
+
+#include "vulkan-memory-allocator.h"
+#include "vulkan-mesh.h"
+#include "vulkan-depth-pyramid.h"
+#include "frustum-culler.h"
+
+//  draw as read by the culling shader, laid out as std430
+struct CullDraw
+{
+	uint32_t IndexCount = 0;
+	uint32_t FirstIndex = 0;
+	int32_t VertexOffset = 0;
+	uint32_t FirstInstance = 0;  //  where its visible instances are written
+	uint32_t RunIndex = 0;  //  counter of the run its command is appended to
+	uint32_t CommandBase = 0;  //  first command of the run
+	uint32_t LODCount = 1;  //  levels of detail of the mesh, drawn by this draw & the next ones
+	float LODError = 0.0f;  //  of the level this draw draws, in mesh space
+	glm::vec4 Sphere { 0.0f };  //  bounding sphere in mesh space, radius in w
+};
+static_assert( sizeof( CullDraw ) == 48, "CullDraw must match its std430 layout" );
+
+//  Frustum culling on the GPU. Every instance (MeshData with its DrawIndex) and
+//  every draw of a frame are written into storage buffers; a first compute pass
+//  appends visible instances to their draw, a second one appends draws with
+//  visible instances to the commands of their run and counts them. Runs are
+//  then drawn with vkCmdDrawIndexedIndirectCount, the count read from a buffer.
+//
+//  Meshes with levels of detail have a draw per level, one after the other:
+//  instances point at the first one, and are appended to the coarsest level
+//  whose error stays under the threshold once projected on the screen.
+//
+//  Culling is recorded every frame into its own small command buffer, which
+//  is submitted before the frame's draws, so that cached draws stay valid.
+//
+//  With occlusion culling, the first phase also hides instances behind the
+//  depth pyramid of the previous frame. Once the first phase is drawn and the
+//  pyramid built again from its depth, a second phase recorded with the draws
+//  tests hidden instances again, as the camera or them may have moved since:
+//  those now visible are drawn by a second render pass, into their own
+//  commands & instances placed after the first phase ones.
+class VulkanGpuCulling
+{
+public:
+	//  the pyramid is read by occlusion culling, which only happens if it can be built
+	void init( VulkanMemoryAllocator* allocator, uint32_t queue_family, uint32_t frame_count, const VulkanDepthPyramid* pyramid );
+	void release();
+
+	//  make room for a frame's inputs, whose previous use must be done; returns
+	//  true if buffers were recreated and draws using them must be recorded again
+	bool reserve( uint32_t frame, uint32_t object_count, uint32_t draw_count, uint32_t run_count );
+	//  point the frame's set at its buffers, returns true if it changed and
+	//  recorded draws using it must be recorded again
+	bool update_descriptors( uint32_t frame, vk::Buffer instance_buffer, vk::Buffer indirect_buffer );
+
+	bool has_occlusion() const { return HasOcclusion; }
+	//  phases drawn every frame, each with as many commands & instances as draws & objects
+	uint32_t get_phase_count() const { return HasOcclusion ? 2 : 1; }
+
+	MeshData* get_objects( uint32_t frame ) const { return (MeshData*)Frames[frame].ObjectAllocation.MappedData; }
+	CullDraw* get_draws( uint32_t frame ) const { return (CullDraw*)Frames[frame].DrawAllocation.MappedData; }
+	//  draw count of each run, in order
+	vk::Buffer get_count_buffer( uint32_t frame ) const { return Frames[frame].CountBuffer; }
+	//  offset of a run's draw count in a phase
+	static vk::DeviceSize get_run_count_offset( uint32_t phase, uint32_t run, uint32_t run_count, uint32_t draw_count )
+	{
+		return ( (vk::DeviceSize)phase * ( run_count + draw_count ) + run ) * sizeof( uint32_t );
+	}
+
+	//  record the first phase of a frame's culling, writing instances & commands
+	//  into the buffers of update_descriptors(), and make them visible to draws
+	//  submitted afterwards; use_pyramid once the pyramid holds a previous frame.
+	//  instance_count is the room of a phase's instances, lod_error_scale the
+	//  error allowed per unit of distance from the camera
+	vk::CommandBuffer record(
+		uint32_t frame,
+		const Frustum& frustum,
+		const glm::mat4& view_projection,
+		float lod_error_scale,
+		bool use_pyramid,
+		uint32_t object_count,
+		uint32_t instance_count,
+		uint32_t draw_count,
+		uint32_t run_count
+	);
+	//  record the second phase, after the pyramid was built from the first phase's
+	//  draws; sized by capacity, it stays valid while reserve() recreates nothing
+	void record_second_phase( vk::CommandBuffer buffer, uint32_t frame );
+
+private:
+	//  std140 uniform block of the shader
+	struct CullingParams
+	{
+		glm::mat4 ViewProjection;
+		glm::vec4 Planes[6];
+		uint32_t ObjectCount = 0;
+		uint32_t DrawCount = 0;
+		uint32_t RunCount = 0;
+		uint32_t UsePyramid = 0;
+		float LODErrorScale = 0.0f;
+		uint32_t InstanceCount = 0;
+	};
+
+	struct PushConstants
+	{
+		uint32_t Pass = 0;
+	};
+
+	struct FrameBuffers
+	{
+		vk::Buffer ObjectBuffer;
+		VulkanAllocation ObjectAllocation;
+		uint32_t MaxObjects = 0;
+
+		vk::Buffer DrawBuffer;
+		VulkanAllocation DrawAllocation;
+		uint32_t MaxDraws = 0;
+
+		//  run draw counts, then visible instance counts of draws, for each phase;
+		//  then instances left to the second phase
+		vk::Buffer CountBuffer;
+		VulkanAllocation CountAllocation;
+		uint32_t MaxCounts = 0;
+
+		vk::Buffer ParamsBuffer;
+		VulkanAllocation ParamsAllocation;
+
+		vk::DescriptorSet DescriptorSet;
+		vk::Buffer DescribedBuffers[5];  //  buffers the set points at
+		vk::CommandBuffer CommandBuffer;
+	};
+
+	VulkanMemoryAllocator* Allocator = nullptr;
+	vk::Device Device;
+	const VulkanDepthPyramid* Pyramid = nullptr;
+	bool HasOcclusion = false;
+
+	vk::DescriptorSetLayout DescriptorSetLayout;
+	vk::DescriptorPool DescriptorPool;
+	vk::PipelineLayout PipelineLayout;
+	vk::Pipeline Pipeline;
+	vk::CommandPool CommandPool;
+
+	std::vector<FrameBuffers> Frames;
+
+	const uint32_t GROUP_SIZE = 64;  //  local_size_x of the shader
+
+	void create_pipeline();
+	void dispatch( vk::CommandBuffer buffer, uint32_t pass, uint32_t count );
+	//  make compute writes visible to the next passes, or to draws
+	void record_barrier( vk::CommandBuffer buffer, vk::PipelineStageFlags dst_stages, vk::AccessFlags dst_access );
+	void create_storage_buffer( vk::DeviceSize size, vk::BufferUsageFlags usage, vk::MemoryPropertyFlags properties, vk::Buffer* buffer, VulkanAllocation* allocation, const char* name );
+	void destroy_buffer( vk::Buffer buffer, const VulkanAllocation& allocation );
+};
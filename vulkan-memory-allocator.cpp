@@ -0,0 +1,526 @@
+#include "vulkan-memory-allocator.h"
+
+#include <algorithm>
+
+//  block size on heaps bigger than SMALL_HEAP_MAX_SIZE, smaller heaps use 1/8 of their size
+static const vk::DeviceSize LARGE_HEAP_BLOCK_SIZE = 256ull * 1024 * 1024;
+static const vk::DeviceSize SMALL_HEAP_MAX_SIZE = 1024ull * 1024 * 1024;
+
+const char* get_memory_category_name( VulkanMemoryCategory category )
+{
+	switch ( category )
+	{
+		case VulkanMemoryCategory::Geometry: return "Geometry";
+		case VulkanMemoryCategory::Texture: return "Texture";
+		case VulkanMemoryCategory::Attachment: return "Attachment";
+		case VulkanMemoryCategory::Uniform: return "Uniform";
+		case VulkanMemoryCategory::Storage: return "Storage";
+		case VulkanMemoryCategory::Staging: return "Staging";
+		default: return "Other";
+	}
+}
+
+static double to_megabytes( vk::DeviceSize size )
+{
+	return (double)size / ( 1024.0 * 1024.0 );
+}
+
+void VulkanMemoryAllocator::init( vk::PhysicalDevice physical_device, vk::Device device, bool has_memory_budget )
+{
+	PhysicalDevice = physical_device;
+	Device = device;
+	HasMemoryBudget = has_memory_budget;
+	MemoryProperties = PhysicalDevice.getMemoryProperties();
+
+	HeapAllocatedBytes.resize( MemoryProperties.memoryHeapCount );
+	HeapUsedBytes.resize( MemoryProperties.memoryHeapCount );
+
+	//  two pools per memory type: linear & optimal resources
+	Pools.resize( MemoryProperties.memoryTypeCount * 2 );
+	for ( uint32_t i = 0; i < Pools.size(); i++ )
+	{
+		Pool& pool = Pools[i];
+		pool.MemoryTypeIndex = i / 2;
+
+		uint32_t heap_index = MemoryProperties.memoryTypes[pool.MemoryTypeIndex].heapIndex;
+		vk::DeviceSize heap_size = MemoryProperties.memoryHeaps[heap_index].size;
+		pool.PreferredBlockSize = heap_size <= SMALL_HEAP_MAX_SIZE ? heap_size / 8 : LARGE_HEAP_BLOCK_SIZE;
+	}
+}
+
+void VulkanMemoryAllocator::release()
+{
+	for ( auto& pool : Pools )
+	{
+		for ( auto& block : pool.Blocks )
+		{
+			if ( !block.Memory ) continue;
+
+			if ( !block.Ranges.is_empty() )
+			{
+				printf( "Memory block released with %d allocations still alive\n", block.Ranges.get_allocation_count() );
+			}
+			free_device_memory( block.Memory, block.Size, pool.MemoryTypeIndex );
+		}
+	}
+	Pools.clear();
+}
+
+VulkanAllocation VulkanMemoryAllocator::allocate_buffer_memory( 
+	vk::Buffer buffer, 
+	vk::MemoryPropertyFlags properties,
+	VulkanMemoryCategory category,
+	const std::string& name
+)
+{
+	//  ask the driver whether this buffer would rather have its own memory
+	vk::BufferMemoryRequirementsInfo2 requirements_info {};
+	requirements_info.buffer = buffer;
+	auto requirements = Device.getBufferMemoryRequirements2<vk::MemoryRequirements2, vk::MemoryDedicatedRequirements>( requirements_info );
+	const auto& dedicated_requirements = requirements.get<vk::MemoryDedicatedRequirements>();
+
+	vk::MemoryDedicatedAllocateInfo dedicated_info {};
+	dedicated_info.buffer = buffer;
+
+	VulkanAllocation allocation = allocate(
+		requirements.get<vk::MemoryRequirements2>().memoryRequirements,
+		properties,
+		true,
+		dedicated_requirements.prefersDedicatedAllocation || dedicated_requirements.requiresDedicatedAllocation,
+		dedicated_info
+	);
+
+	Device.bindBufferMemory( buffer, allocation.Memory, allocation.Offset );
+	track( &allocation, requirements.get<vk::MemoryRequirements2>().memoryRequirements.alignment, category, name );
+	return allocation;
+}
+
+VulkanAllocation VulkanMemoryAllocator::allocate_image_memory( 
+	vk::Image image, 
+	vk::ImageTiling tiling, 
+	vk::MemoryPropertyFlags properties,
+	VulkanMemoryCategory category,
+	const std::string& name
+)
+{
+	vk::ImageMemoryRequirementsInfo2 requirements_info {};
+	requirements_info.image = image;
+	auto requirements = Device.getImageMemoryRequirements2<vk::MemoryRequirements2, vk::MemoryDedicatedRequirements>( requirements_info );
+	const auto& dedicated_requirements = requirements.get<vk::MemoryDedicatedRequirements>();
+
+	vk::MemoryDedicatedAllocateInfo dedicated_info {};
+	dedicated_info.image = image;
+
+	VulkanAllocation allocation = allocate(
+		requirements.get<vk::MemoryRequirements2>().memoryRequirements,
+		properties,
+		tiling == vk::ImageTiling::eLinear,
+		dedicated_requirements.prefersDedicatedAllocation || dedicated_requirements.requiresDedicatedAllocation,
+		dedicated_info
+	);
+
+	Device.bindImageMemory( image, allocation.Memory, allocation.Offset );
+	track( &allocation, requirements.get<vk::MemoryRequirements2>().memoryRequirements.alignment, category, name );
+	return allocation;
+}
+
+void VulkanMemoryAllocator::free( const VulkanAllocation& allocation )
+{
+	if ( !allocation.is_valid() ) return;
+
+	untrack( allocation );
+
+	Pool& pool = Pools[allocation.PoolIndex];
+	if ( allocation.IsDedicated )
+	{
+		free_device_memory( allocation.Memory, allocation.Size, pool.MemoryTypeIndex );
+		return;
+	}
+
+	free_range( allocation.PoolIndex, allocation.BlockIndex, allocation.Handle );
+}
+
+bool VulkanMemoryAllocator::plan_defragmentation_move( VulkanDefragmentationMove* move )
+{
+	for ( uint32_t pool_index = 0; pool_index < Pools.size(); pool_index++ )
+	{
+		Pool& pool = Pools[pool_index];
+
+		//  the emptiest block is the one to drain
+		uint32_t src_block_index = UINT32_MAX;
+		uint32_t block_count = 0;
+		for ( uint32_t i = 0; i < pool.Blocks.size(); i++ )
+		{
+			const Block& block = pool.Blocks[i];
+			if ( !block.Memory || block.Ranges.is_empty() ) continue;
+
+			block_count++;
+			if ( src_block_index == UINT32_MAX
+			  || block.Ranges.get_used_size() < pool.Blocks[src_block_index].Ranges.get_used_size() )
+			{
+				src_block_index = i;
+			}
+		}
+		if ( block_count < 2 ) continue;
+
+		const Block& src_block = pool.Blocks[src_block_index];
+		for ( uint32_t resource_index = 0; resource_index < Resources.size(); resource_index++ )
+		{
+			Resource& resource = Resources[resource_index];
+			if ( !resource.IsAlive || resource.IsMoving || resource.IsDedicated ) continue;
+			if ( resource.Category != VulkanMemoryCategory::Texture ) continue;  //  only textures know how to be moved
+			if ( resource.Allocation.PoolIndex != pool_index || resource.Allocation.BlockIndex != src_block_index ) continue;
+
+			//  move it into a fuller block, fullest first
+			vk::DeviceSize offset;
+			std::vector<uint32_t> dst_blocks;
+			for ( uint32_t i = 0; i < pool.Blocks.size(); i++ )
+			{
+				const Block& block = pool.Blocks[i];
+				if ( i == src_block_index || !block.Memory ) continue;
+				if ( block.Ranges.get_used_size() < src_block.Ranges.get_used_size() ) continue;
+
+				dst_blocks.push_back( i );
+			}
+			std::sort( dst_blocks.begin(), dst_blocks.end(), [&]( uint32_t a, uint32_t b ) {
+				return pool.Blocks[a].Ranges.get_used_size() > pool.Blocks[b].Ranges.get_used_size();
+			} );
+
+			for ( uint32_t dst_block_index : dst_blocks )
+			{
+				Block& dst_block = pool.Blocks[dst_block_index];
+
+				//  an identical resource has identical memory requirements
+				uint32_t handle = dst_block.Ranges.allocate( resource.Size, resource.Alignment, &offset );
+				if ( handle == TLSFAllocator::INVALID_HANDLE ) continue;
+
+				move->ResourceIndex = resource_index;
+				move->Src = resource.Allocation;
+				move->Dst = resource.Allocation;
+				move->Dst.Memory = dst_block.Memory;
+				move->Dst.Offset = offset;
+				move->Dst.MappedData = dst_block.MappedData ? (char*)dst_block.MappedData + offset : nullptr;
+				move->Dst.BlockIndex = dst_block_index;
+				move->Dst.Handle = handle;
+				resource.IsMoving = true;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+void VulkanMemoryAllocator::complete_defragmentation_move( const VulkanDefragmentationMove& move )
+{
+	Resource& resource = Resources[move.ResourceIndex];
+	resource.Allocation = move.Dst;
+	resource.IsMoving = false;
+
+	free_range( move.Src.PoolIndex, move.Src.BlockIndex, move.Src.Handle );
+}
+
+void VulkanMemoryAllocator::free_range( uint32_t pool_index, uint32_t block_index, uint32_t handle )
+{
+	Pool& pool = Pools[pool_index];
+	Block& block = pool.Blocks[block_index];
+	block.Ranges.free( handle );
+	if ( !block.Ranges.is_empty() ) return;
+
+	//  keep one empty block around to avoid re-allocating memory
+	//  when a resource is destroyed and another created right after
+	for ( uint32_t i = 0; i < pool.Blocks.size(); i++ )
+	{
+		const Block& other = pool.Blocks[i];
+		if ( i == block_index || !other.Memory || !other.Ranges.is_empty() ) continue;
+
+		free_device_memory( block.Memory, block.Size, pool.MemoryTypeIndex );
+		block = Block {};
+		return;
+	}
+}
+
+VulkanAllocation VulkanMemoryAllocator::allocate(
+	const vk::MemoryRequirements& requirements,
+	vk::MemoryPropertyFlags properties,
+	bool is_linear,
+	bool prefers_dedicated,
+	const vk::MemoryDedicatedAllocateInfo& dedicated_info
+)
+{
+	uint32_t memory_type_index = find_memory_type( requirements.memoryTypeBits, properties );
+	uint32_t pool_index = memory_type_index * 2 + ( is_linear ? 0 : 1 );
+	Pool& pool = Pools[pool_index];
+
+	VulkanAllocation allocation {};
+	allocation.PoolIndex = pool_index;
+
+	//  very large resources get their own device memory
+	if ( prefers_dedicated || requirements.size > pool.PreferredBlockSize / 2 )
+	{
+		allocation.Memory = allocate_device_memory(
+			requirements.size,
+			memory_type_index,
+			&dedicated_info,
+			&allocation.MappedData
+		);
+		allocation.Offset = 0;
+		allocation.Size = requirements.size;
+		allocation.IsDedicated = true;
+		return allocation;
+	}
+
+	//  find a block with enough space
+	for ( uint32_t i = 0; i < pool.Blocks.size(); i++ )
+	{
+		Block& block = pool.Blocks[i];
+		if ( !block.Memory ) continue;
+
+		vk::DeviceSize offset;
+		uint32_t handle = block.Ranges.allocate( requirements.size, requirements.alignment, &offset );
+		if ( handle == TLSFAllocator::INVALID_HANDLE ) continue;
+
+		allocation.Memory = block.Memory;
+		allocation.Offset = offset;
+		allocation.Size = requirements.size;
+		allocation.MappedData = block.MappedData ? (char*)block.MappedData + offset : nullptr;
+		allocation.BlockIndex = i;
+		allocation.Handle = handle;
+		return allocation;
+	}
+
+	//  no space left, create a new block
+	uint32_t block_index = create_block( pool, requirements.size + requirements.alignment );
+	Block& block = pool.Blocks[block_index];
+
+	vk::DeviceSize offset;
+	uint32_t handle = block.Ranges.allocate( requirements.size, requirements.alignment, &offset );
+	if ( handle == TLSFAllocator::INVALID_HANDLE ) throw std::runtime_error( "Failed to sub-allocate from a new memory block" );
+
+	allocation.Memory = block.Memory;
+	allocation.Offset = offset;
+	allocation.Size = requirements.size;
+	allocation.MappedData = block.MappedData ? (char*)block.MappedData + offset : nullptr;
+	allocation.BlockIndex = block_index;
+	allocation.Handle = handle;
+	return allocation;
+}
+
+uint32_t VulkanMemoryAllocator::create_block( Pool& pool, vk::DeviceSize min_size )
+{
+	//  find a free slot, so that indices of existing blocks stay valid
+	uint32_t block_index = (uint32_t)pool.Blocks.size();
+	uint32_t block_count = 0;
+	for ( uint32_t i = 0; i < pool.Blocks.size(); i++ )
+	{
+		if ( pool.Blocks[i].Memory )
+		{
+			block_count++;
+		}
+		else if ( block_index == pool.Blocks.size() )
+		{
+			block_index = i;
+		}
+	}
+	if ( block_index == pool.Blocks.size() )
+	{
+		pool.Blocks.push_back( Block {} );
+	}
+
+	//  start small and grow up to the preferred size, so that small
+	//  scenes don't reserve hundreds of megabytes up-front
+	vk::DeviceSize size = pool.PreferredBlockSize >> ( 3 - std::min( block_count, 3u ) );
+	if ( size < min_size ) size = min_size;
+
+	Block& block = pool.Blocks[block_index];
+	block.Memory = allocate_device_memory( size, pool.MemoryTypeIndex, nullptr, &block.MappedData );
+	block.Size = size;
+	block.Ranges.init( size );
+
+	return block_index;
+}
+
+vk::DeviceMemory VulkanMemoryAllocator::allocate_device_memory(
+	vk::DeviceSize size,
+	uint32_t memory_type_index,
+	const void* next,
+	void** mapped_data
+)
+{
+	vk::MemoryAllocateInfo memory_alloc_info {};
+	memory_alloc_info.pNext = next;
+	memory_alloc_info.allocationSize = size;
+	memory_alloc_info.memoryTypeIndex = memory_type_index;
+
+	vk::DeviceMemory memory;
+	auto result = Device.allocateMemory( &memory_alloc_info, nullptr, &memory );
+	if ( result != vk::Result::eSuccess )
+	{
+		throw std::runtime_error( "Failed to allocate device memory" );
+	}
+	DeviceAllocationCount++;
+	HeapAllocatedBytes[MemoryProperties.memoryTypes[memory_type_index].heapIndex] += size;
+
+	//  host visible memory stays mapped for its whole lifetime
+	*mapped_data = nullptr;
+	if ( MemoryProperties.memoryTypes[memory_type_index].propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible )
+	{
+		result = Device.mapMemory( memory, 0, VK_WHOLE_SIZE, {}, mapped_data );
+		if ( result != vk::Result::eSuccess )
+		{
+			throw std::runtime_error( "Failed to map device memory" );
+		}
+	}
+
+	return memory;
+}
+
+void VulkanMemoryAllocator::free_device_memory( vk::DeviceMemory memory, vk::DeviceSize size, uint32_t memory_type_index )
+{
+	//  freeing implicitly unmaps the memory
+	Device.freeMemory( memory, nullptr );
+	DeviceAllocationCount--;
+	HeapAllocatedBytes[MemoryProperties.memoryTypes[memory_type_index].heapIndex] -= size;
+}
+
+uint32_t VulkanMemoryAllocator::find_memory_type( uint32_t types, vk::MemoryPropertyFlags properties )
+{
+	for ( uint32_t i = 0; i < MemoryProperties.memoryTypeCount; i++ )
+	{
+		if ( ( types & ( 1 << i ) )
+			&& ( MemoryProperties.memoryTypes[i].propertyFlags & properties ) == properties )
+		{
+			return i;
+		}
+	}
+
+	throw std::runtime_error( "Failed to find a suitable memory type" );
+}
+
+std::vector<VulkanHeapBudget> VulkanMemoryAllocator::get_heap_budgets() const
+{
+	std::vector<VulkanHeapBudget> budgets( MemoryProperties.memoryHeapCount );
+
+	//  driver view of the whole process usage, including other APIs & allocators
+	vk::PhysicalDeviceMemoryBudgetPropertiesEXT budget_properties {};
+	if ( HasMemoryBudget )
+	{
+		auto properties = PhysicalDevice.getMemoryProperties2<vk::PhysicalDeviceMemoryProperties2, vk::PhysicalDeviceMemoryBudgetPropertiesEXT>();
+		budget_properties = properties.get<vk::PhysicalDeviceMemoryBudgetPropertiesEXT>();
+	}
+
+	for ( uint32_t i = 0; i < budgets.size(); i++ )
+	{
+		VulkanHeapBudget& budget = budgets[i];
+		budget.Size = MemoryProperties.memoryHeaps[i].size;
+		budget.AllocatedBytes = HeapAllocatedBytes[i];
+		budget.UsedBytes = HeapUsedBytes[i];
+
+		if ( HasMemoryBudget )
+		{
+			budget.Budget = budget_properties.heapBudget[i];
+			budget.Usage = budget_properties.heapUsage[i];
+		}
+		else
+		{
+			//  same heuristic as most drivers: leave some room to the system & other processes
+			budget.Budget = budget.Size * 8 / 10;
+			budget.Usage = budget.AllocatedBytes;
+		}
+	}
+
+	return budgets;
+}
+
+void VulkanMemoryAllocator::print_report( size_t max_resources ) const
+{
+	printf( "Memory report (%s):\n", HasMemoryBudget ? "VK_EXT_memory_budget" : "estimated budgets" );
+
+	//  heaps
+	std::vector<VulkanHeapBudget> budgets = get_heap_budgets();
+	for ( uint32_t i = 0; i < budgets.size(); i++ )
+	{
+		const VulkanHeapBudget& budget = budgets[i];
+		bool is_device_local = (bool)( MemoryProperties.memoryHeaps[i].flags & vk::MemoryHeapFlagBits::eDeviceLocal );
+		printf( "  Heap %d (%s): usage %.1f / %.1f MB budget (%.1f MB heap), allocated %.1f MB, used %.1f MB\n",
+			i, is_device_local ? "device local" : "host",
+			to_megabytes( budget.Usage ), to_megabytes( budget.Budget ), to_megabytes( budget.Size ),
+			to_megabytes( budget.AllocatedBytes ), to_megabytes( budget.UsedBytes ) );
+	}
+
+	//  categories
+	for ( int i = 0; i < (int)VulkanMemoryCategory::Count; i++ )
+	{
+		if ( CategoryCounts[i] == 0 ) continue;
+
+		printf( "  %-10s %.2f MB in %d resources\n",
+			get_memory_category_name( (VulkanMemoryCategory)i ), to_megabytes( CategoryBytes[i] ), CategoryCounts[i] );
+	}
+
+	//  biggest resources first
+	std::vector<uint32_t> alive_resources;
+	for ( uint32_t i = 0; i < Resources.size(); i++ )
+	{
+		if ( Resources[i].IsAlive ) alive_resources.push_back( i );
+	}
+
+	size_t count = std::min( max_resources, alive_resources.size() );
+	std::partial_sort( alive_resources.begin(), alive_resources.begin() + count, alive_resources.end(),
+		[&]( uint32_t a, uint32_t b ) { return Resources[a].Size > Resources[b].Size; } );
+
+	printf( "  %zu biggest of %zu resources:\n", count, alive_resources.size() );
+	for ( size_t i = 0; i < count; i++ )
+	{
+		const Resource& resource = Resources[alive_resources[i]];
+		printf( "    %8.2f MB  %-10s %s%s\n",
+			to_megabytes( resource.Size ),
+			get_memory_category_name( resource.Category ),
+			resource.Name.empty() ? "<unnamed>" : resource.Name.c_str(),
+			resource.IsDedicated ? " (dedicated)" : "" );
+	}
+}
+
+void VulkanMemoryAllocator::track( VulkanAllocation* allocation, vk::DeviceSize alignment, VulkanMemoryCategory category, const std::string& name )
+{
+	uint32_t index;
+	if ( !FreeResourceIndices.empty() )
+	{
+		index = FreeResourceIndices.back();
+		FreeResourceIndices.pop_back();
+	}
+	else
+	{
+		index = (uint32_t)Resources.size();
+		Resources.push_back( Resource {} );
+	}
+
+	Resource& resource = Resources[index];
+	resource.Name = name;
+	resource.Category = category;
+	resource.Size = allocation->Size;
+	resource.Alignment = alignment;
+	resource.HeapIndex = MemoryProperties.memoryTypes[Pools[allocation->PoolIndex].MemoryTypeIndex].heapIndex;
+	resource.IsDedicated = allocation->IsDedicated;
+	resource.IsAlive = true;
+	resource.Allocation = *allocation;
+
+	CategoryBytes[(int)category] += resource.Size;
+	CategoryCounts[(int)category]++;
+	HeapUsedBytes[resource.HeapIndex] += resource.Size;
+
+	allocation->ResourceIndex = index;
+	resource.Allocation.ResourceIndex = index;
+}
+
+void VulkanMemoryAllocator::untrack( const VulkanAllocation& allocation )
+{
+	if ( allocation.ResourceIndex >= Resources.size() ) return;
+
+	Resource& resource = Resources[allocation.ResourceIndex];
+	CategoryBytes[(int)resource.Category] -= resource.Size;
+	CategoryCounts[(int)resource.Category]--;
+	HeapUsedBytes[resource.HeapIndex] -= resource.Size;
+
+	resource = Resource {};
+	FreeResourceIndices.push_back( allocation.ResourceIndex );
+}
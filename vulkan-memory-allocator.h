@@ -0,0 +1,171 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan.hpp>
+
+#include "tlsf-allocator.h"
+
+//  what a resource is used for, to account memory per kind of resource
+enum class VulkanMemoryCategory
+{
+	Geometry,
+	Texture,
+	Attachment,
+	Uniform,
+	Storage,
+	Staging,
+	Other,
+	Count,
+};
+
+const char* get_memory_category_name( VulkanMemoryCategory category );
+
+struct VulkanAllocation
+{
+	vk::DeviceMemory Memory;
+	vk::DeviceSize Offset = 0;
+	vk::DeviceSize Size = 0;
+	void* MappedData = nullptr;  //  persistently mapped pointer, only for host visible memory
+
+	uint32_t PoolIndex = 0;
+	uint32_t BlockIndex = 0;
+	uint32_t Handle = TLSFAllocator::INVALID_HANDLE;  //  range inside the block
+	bool IsDedicated = false;
+
+	uint32_t ResourceIndex = UINT32_MAX;  //  accounting record
+
+	bool is_valid() const { return (bool)Memory; }
+};
+
+//  Relocation of a resource to a denser block: the caller creates a new resource
+//  bound to Dst, copies the data on the GPU, switches its handles to the new
+//  resource and completes the move once the old one is no longer in use.
+struct VulkanDefragmentationMove
+{
+	uint32_t ResourceIndex = UINT32_MAX;
+	VulkanAllocation Src;
+	VulkanAllocation Dst;
+};
+
+struct VulkanHeapBudget
+{
+	vk::DeviceSize Size = 0;
+	vk::DeviceSize Budget = 0;  //  how much the process can use before suffering, estimated without VK_EXT_memory_budget
+	vk::DeviceSize Usage = 0;  //  whole process usage, only our own allocations without VK_EXT_memory_budget
+	vk::DeviceSize AllocatedBytes = 0;  //  device memory allocated by this allocator
+	vk::DeviceSize UsedBytes = 0;  //  part of it bound to live resources
+};
+
+//  Sub-allocates buffers and images from large device memory blocks, so that
+//  hundreds of resources only cost a handful of vkAllocateMemory calls.
+//  Every resource is tagged with a category & a name for memory reports.
+class VulkanMemoryAllocator
+{
+public:
+	//  has_memory_budget tells whether VK_EXT_memory_budget is enabled on the device
+	void init( vk::PhysicalDevice physical_device, vk::Device device, bool has_memory_budget );
+	void release();
+
+	//  allocate and bind memory to a resource
+	VulkanAllocation allocate_buffer_memory( 
+		vk::Buffer buffer, 
+		vk::MemoryPropertyFlags properties,
+		VulkanMemoryCategory category = VulkanMemoryCategory::Other,
+		const std::string& name = ""
+	);
+	VulkanAllocation allocate_image_memory( 
+		vk::Image image, 
+		vk::ImageTiling tiling, 
+		vk::MemoryPropertyFlags properties,
+		VulkanMemoryCategory category = VulkanMemoryCategory::Other,
+		const std::string& name = ""
+	);
+	void free( const VulkanAllocation& allocation );
+
+	//  find a movable resource in the emptiest block of a pool, and reserve
+	//  space for it in a fuller one; returns false if there is nothing to compact
+	bool plan_defragmentation_move( VulkanDefragmentationMove* move );
+	//  release the source range, possibly its whole block
+	void complete_defragmentation_move( const VulkanDefragmentationMove& move );
+
+	std::vector<VulkanHeapBudget> get_heap_budgets() const;
+	vk::DeviceSize get_category_bytes( VulkanMemoryCategory category ) const { return CategoryBytes[(int)category]; }
+	//  print heaps budgets, usage per category and the biggest resources
+	void print_report( size_t max_resources = 20 ) const;
+
+	vk::PhysicalDevice get_physical_device() const { return PhysicalDevice; }
+	vk::Device get_device() const { return Device; }
+	uint32_t get_device_allocation_count() const { return DeviceAllocationCount; }
+
+private:
+	struct Block
+	{
+		vk::DeviceMemory Memory;
+		vk::DeviceSize Size = 0;
+		void* MappedData = nullptr;
+		TLSFAllocator Ranges;
+	};
+
+	//  Linear resources (buffers) and optimal images of a same memory type live
+	//  in separate pools: neighbours in a block are then always of the same kind
+	//  and bufferImageGranularity never has to be padded between them.
+	struct Pool
+	{
+		uint32_t MemoryTypeIndex = 0;
+		vk::DeviceSize PreferredBlockSize = 0;
+		std::vector<Block> Blocks;
+	};
+
+	vk::PhysicalDevice PhysicalDevice;
+	vk::Device Device;
+	vk::PhysicalDeviceMemoryProperties MemoryProperties;
+
+	struct Resource
+	{
+		std::string Name;
+		VulkanMemoryCategory Category = VulkanMemoryCategory::Other;
+		vk::DeviceSize Size = 0;
+		vk::DeviceSize Alignment = 0;
+		uint32_t HeapIndex = 0;
+		bool IsDedicated = false;
+		bool IsAlive = false;
+		bool IsMoving = false;
+
+		VulkanAllocation Allocation;  //  where it currently lives
+	};
+
+	std::vector<Pool> Pools;
+	uint32_t DeviceAllocationCount = 0;
+
+	bool HasMemoryBudget = false;
+	std::vector<Resource> Resources;
+	std::vector<uint32_t> FreeResourceIndices;
+	vk::DeviceSize CategoryBytes[(int)VulkanMemoryCategory::Count] {};
+	uint32_t CategoryCounts[(int)VulkanMemoryCategory::Count] {};
+	std::vector<vk::DeviceSize> HeapAllocatedBytes;
+	std::vector<vk::DeviceSize> HeapUsedBytes;
+
+	VulkanAllocation allocate(
+		const vk::MemoryRequirements& requirements,
+		vk::MemoryPropertyFlags properties,
+		bool is_linear,
+		bool prefers_dedicated,
+		const vk::MemoryDedicatedAllocateInfo& dedicated_info
+	);
+	uint32_t create_block( Pool& pool, vk::DeviceSize min_size );
+	vk::DeviceMemory allocate_device_memory(
+		vk::DeviceSize size,
+		uint32_t memory_type_index,
+		const void* next,
+		void** mapped_data
+	);
+	void free_device_memory( vk::DeviceMemory memory, vk::DeviceSize size, uint32_t memory_type_index );
+	void free_range( uint32_t pool_index, uint32_t block_index, uint32_t handle );
+
+	void track( VulkanAllocation* allocation, vk::DeviceSize alignment, VulkanMemoryCategory category, const std::string& name );
+	void untrack( const VulkanAllocation& allocation );
+
+	uint32_t find_memory_type( uint32_t types, vk::MemoryPropertyFlags properties );
+};
@@ -1,10 +1,27 @@
 #include "vulkan-mesh-model.h"
 
+#include <cstddef>
+#include <cstring>
+
+#include "mesh-optimizer.h"
+#include "mesh-simplifier.h"
+
+//  entries of the post-transform cache simulated when reordering triangles
+static const uint32_t VERTEX_CACHE_SIZE = 16;
+//  ACMR allowed above the vertex cache order, to reorder against overdraw
+static const float OVERDRAW_THRESHOLD = 1.05f;
+//  triangles every level of detail aims to keep from the previous one
+static const float LOD_TRIANGLE_RATIO = 0.5f;
+//  a level keeping more of them is not worth its memory, and ends the chain
+static const float LOD_MAX_TRIANGLE_RATIO = 0.8f;
+//  farthest a level may move the surface from the full mesh, relative to its radius
+static const float LOD_MAX_ERROR = 0.1f;
+
 VulkanMeshModel::VulkanMeshModel() 
 {}
 
 VulkanMeshModel::VulkanMeshModel( std::vector<VulkanMesh> meshes )
-	: Meshes( meshes ), ModelMatrix( glm::mat4( 1.0f ) ) 
+	: Meshes( meshes )
 {}
 
 VulkanMeshModel::~VulkanMeshModel()
@@ -16,11 +33,25 @@ VulkanMesh* VulkanMeshModel::get_mesh( size_t id )
 	return &Meshes[id];
 }
 
-void VulkanMeshModel::release_mesh_model()
+size_t VulkanMeshModel::add_instance( const glm::mat4& matrix )
+{
+	InstanceMatrices.push_back( matrix );
+	Version++;
+	return InstanceMatrices.size() - 1;
+}
+
+void VulkanMeshModel::set_instance_matrix( size_t id, const glm::mat4& matrix )
+{
+	if ( id >= InstanceMatrices.size() ) throw std::runtime_error( "Attempted to access an instance outside bounds" );
+	InstanceMatrices[id] = matrix;
+	Version++;
+}
+
+void VulkanMeshModel::release_mesh_model( uint64_t retire_key )
 {
 	for ( auto& mesh : Meshes )
 	{
-		mesh.release_buffers();
+		mesh.release_buffers( retire_key );
 	}
 }
 
@@ -51,16 +82,28 @@ std::vector<std::string> VulkanMeshModel::get_materials( const aiScene* scene )
 	return textures;
 }
 
-VulkanMesh VulkanMeshModel::load_mesh( 
-	vk::PhysicalDevice phys_device, 
-	vk::Device device, 
-	vk::Queue transfer_queue, 
-	vk::CommandPool transfer_command_pool, 
-	aiMesh* mesh, 
-	const aiScene* scene, 
-	std::vector<int> texture_ids 
-)
+VulkanMeshGeometry ImportedMesh::get_geometry() const
 {
+	VulkanMeshGeometry geometry;
+	geometry.VertexLayout = VertexLayout;
+	geometry.Vertices = Vertices.data();
+	geometry.VertexCount = VertexCount;
+	geometry.IndexType = IndexType;
+	geometry.Indices = Indices.data();
+	geometry.IndexCount = IndexCount;
+	geometry.Bounds = Bounds;
+	geometry.LODs = LODs.data();
+	geometry.LODCount = (uint32_t)LODs.size();
+	return geometry;
+}
+
+ImportedMesh VulkanMeshModel::import_mesh( const aiMesh* mesh, VulkanVertexLayout vertex_layout )
+{
+	ImportedMesh imported;
+	imported.Name = mesh->mName.data;
+	imported.MaterialIndex = mesh->mMaterialIndex;
+	imported.VertexLayout = vertex_layout;
+
 	std::vector<VulkanVertex> vertices( mesh->mNumVertices );
 	std::vector<uint32_t> indices;
 
@@ -96,68 +139,127 @@ VulkanMesh VulkanMeshModel::load_mesh(
 	//  copy indices
 	for ( size_t i = 0; i < mesh->mNumFaces; i++ )
 	{
-		aiFace face = mesh->mFaces[i];
+		const aiFace& face = mesh->mFaces[i];
 		for ( size_t j = 0; j < face.mNumIndices; j++ )
 		{
 			indices.push_back( face.mIndices[j] );
 		}
 	}
 
-	//  create mesh
-	VulkanMesh new_mesh(
-		phys_device,
-		device,
-		transfer_queue,
-		transfer_command_pool,
-		&vertices,
-		&indices,
-		texture_ids[mesh->mMaterialIndex]
+	imported.Bounds = MeshBounds::compute( vertices.data(), vertices.size() );
+	float acmr = compute_acmr( indices.data(), indices.size(), vertices.size(), VERTEX_CACHE_SIZE );
+	int source_size = (int)( vertices.size() * sizeof( VulkanVertex ) + indices.size() * sizeof( uint32_t ) );
+
+	//  levels of detail, each one simplified from the previous one so their errors add up
+	const void* positions = (const char*)vertices.data() + offsetof( VulkanVertex, Position );
+	std::vector<std::vector<uint32_t>> lods { indices };
+	std::vector<float> lod_errors { 0.0f };
+	while ( lods.size() < MAX_MESH_LODS )
+	{
+		const std::vector<uint32_t>& previous = lods.back();
+		float max_error = imported.Bounds.Radius * LOD_MAX_ERROR - lod_errors.back();
+		if ( max_error <= 0.0f ) break;
+
+		std::vector<uint32_t> lod( previous );
+		size_t target_index_count = (size_t)( previous.size() / 3 * LOD_TRIANGLE_RATIO ) * 3;
+		float error = 0.0f;
+		lod.resize( simplify_mesh( 
+			lod.data(), 
+			lod.size(), 
+			positions, 
+			vertices.size(), 
+			sizeof( VulkanVertex ), 
+			target_index_count, 
+			max_error, 
+			&error 
+		) );
+		if ( lod.empty() || lod.size() > previous.size() * LOD_MAX_TRIANGLE_RATIO ) break;
+
+		float lod_error = lod_errors.back() + error;
+		lods.push_back( std::move( lod ) );
+		lod_errors.push_back( lod_error );
+	}
+
+	//  reorder triangles of every level for the vertex cache & against overdraw,
+	//  then lay levels out one after the other
+	indices.clear();
+	for ( size_t i = 0; i < lods.size(); i++ )
+	{
+		std::vector<uint32_t>& lod = lods[i];
+		std::vector<uint32_t> clusters = optimize_vertex_cache( lod.data(), lod.size(), vertices.size(), VERTEX_CACHE_SIZE );
+		optimize_overdraw(
+			lod.data(),
+			lod.size(),
+			positions,
+			vertices.size(),
+			sizeof( VulkanVertex ),
+			clusters,
+			VERTEX_CACHE_SIZE,
+			OVERDRAW_THRESHOLD
+		);
+
+		VulkanMeshLOD level;
+		level.FirstIndex = (uint32_t)indices.size();
+		level.IndexCount = (uint32_t)lod.size();
+		level.Error = lod_errors[i];
+		imported.LODs.push_back( level );
+		indices.insert( indices.end(), lod.begin(), lod.end() );
+	}
+
+	//  encode vertices, colors are left out of compact ones as they are all white
+	uint32_t vertex_stride = get_vertex_stride( vertex_layout );
+	imported.Vertices.resize( vertices.size() * vertex_stride );
+	if ( vertex_layout == VulkanVertexLayout::Compact )
+	{
+		encode_compact_vertices(
+			vertices.data(),
+			vertices.size(),
+			imported.Bounds,
+			(VulkanCompactVertex*)imported.Vertices.data()
+		);
+	}
+	else
+	{
+		memcpy( imported.Vertices.data(), vertices.data(), imported.Vertices.size() );
+	}
+
+	//  then put vertices in the order they are fetched, the full mesh first as
+	//  coarser levels only use some of its vertices
+	imported.VertexCount = (uint32_t)optimize_vertex_fetch( 
+		imported.Vertices.data(), 
+		vertices.size(), 
+		vertex_stride, 
+		indices.data(), 
+		indices.size() 
 	);
-	printf( "New Mesh: %s\n", mesh->mName.data );
-	return new_mesh;
+	imported.Vertices.resize( (size_t)imported.VertexCount * vertex_stride );
+
+	imported.IndexCount = (uint32_t)indices.size();
+	imported.IndexType = encode_indices( indices.data(), indices.size(), imported.VertexCount, &imported.Indices );
+
+	float optimized_acmr = compute_acmr( indices.data(), imported.LODs[0].IndexCount, imported.VertexCount, VERTEX_CACHE_SIZE );
+	printf( "Mesh %s: ACMR %.3f -> %.3f, %d bytes -> %d bytes, %d LODs down to %d triangles\n", 
+		imported.Name.c_str(), 
+		acmr, 
+		optimized_acmr,
+		source_size,
+		(int)( imported.Vertices.size() + imported.Indices.size() ),
+		(int)imported.LODs.size(),
+		(int)( imported.LODs.back().IndexCount / 3 ) );
+
+	return imported;
 }
 
-std::vector<VulkanMesh> VulkanMeshModel::load_node( 
-	vk::PhysicalDevice phys_device, 
-	vk::Device device, 
-	vk::Queue transfer_queue, 
-	vk::CommandPool transfer_command_pool, 
-	aiNode* node, 
-	const aiScene* scene, 
-	std::vector<int> texture_ids 
-)
+void VulkanMeshModel::get_node_meshes( const aiNode* node, const aiScene* scene, std::vector<const aiMesh*>* meshes )
 {
-	std::vector<VulkanMesh> meshes;
 	for ( size_t i = 0; i < node->mNumMeshes; i++ )
 	{
-		//  load mesh
-		meshes.push_back(
-			load_mesh(
-				phys_device,
-				device,
-				transfer_queue,
-				transfer_command_pool,
-				scene->mMeshes[node->mMeshes[i]],
-				scene,
-				texture_ids
-			)
-		);
+		meshes->push_back( scene->mMeshes[node->mMeshes[i]] );
 	}
 
 	//  recursive loading
 	for ( size_t i = 0; i < node->mNumChildren; i++ )
 	{
-		std::vector<VulkanMesh> new_meshes = load_node(
-			phys_device,
-			device,
-			transfer_queue,
-			transfer_command_pool,
-			node->mChildren[i],
-			scene,
-			texture_ids
-		);
-		meshes.insert( meshes.end(), new_meshes.begin(), new_meshes.end());
+		get_node_meshes( node->mChildren[i], scene, meshes );
 	}
-
-	return meshes;
 }
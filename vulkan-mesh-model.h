@@ -5,6 +5,24 @@
 
 #include "vulkan-mesh.h"
 
+//  mesh of an imported model, encoded as it is uploaded
+struct ImportedMesh
+{
+	std::string Name;
+	uint32_t MaterialIndex = 0;
+	VulkanVertexLayout VertexLayout = VulkanVertexLayout::Full;
+	std::vector<uint8_t> Vertices;
+	uint32_t VertexCount = 0;
+	vk::IndexType IndexType = vk::IndexType::eUint32;
+	std::vector<uint8_t> Indices;
+	uint32_t IndexCount = 0;
+	MeshBounds Bounds;
+	std::vector<VulkanMeshLOD> LODs;  //  finest first, laid out one after the other in indices
+
+	//  points into the vertices & indices of the mesh
+	VulkanMeshGeometry get_geometry() const;
+};
+
 class VulkanMeshModel
 {
 public:
@@ -15,32 +33,29 @@ public:
 	size_t get_mesh_count() const { return Meshes.size(); }
 	VulkanMesh* get_mesh( size_t id );
 
-	glm::mat4 get_model_matrix() const { return ModelMatrix; }
-	void set_model_matrix( glm::mat4 matrix ) { ModelMatrix = matrix; }
-	void release_mesh_model();
+	//  copies of the whole model, each mesh draws all of them with a single
+	//  instanced draw; the first instance is the model itself
+	size_t add_instance( const glm::mat4& matrix );
+	void set_instance_matrix( size_t id, const glm::mat4& matrix );
+	const glm::mat4& get_instance_matrix( size_t id ) const { return InstanceMatrices[id]; }
+	size_t get_instance_count() const { return InstanceMatrices.size(); }
+
+	glm::mat4 get_model_matrix() const { return InstanceMatrices[0]; }
+	void set_model_matrix( glm::mat4 matrix ) { set_instance_matrix( 0, matrix ); }
+
+	//  increased by every change of the instances, meshes have their own
+	uint64_t get_version() const { return Version; }
+	void release_mesh_model( uint64_t retire_key );
 
 	static std::vector<std::string> get_materials( const aiScene* scene );
-	static VulkanMesh load_mesh(
-		vk::PhysicalDevice phys_device,
-		vk::Device device,
-		vk::Queue transfer_queue,
-		vk::CommandPool transfer_command_pool,
-		aiMesh* mesh,
-		const aiScene* scene,
-		std::vector<int> texture_ids
-	);
-	static std::vector<VulkanMesh> load_node(
-		vk::PhysicalDevice phys_device,
-		vk::Device device,
-		vk::Queue transfer_queue,
-		vk::CommandPool transfer_command_pool,
-		aiNode* node,
-		const aiScene* scene,
-		std::vector<int> texture_ids
-	);
+	//  convert a mesh, safe to call from job threads on a same scene
+	static ImportedMesh import_mesh( const aiMesh* mesh, VulkanVertexLayout vertex_layout );
+	//  meshes of the node & its children, in the order they are loaded
+	static void get_node_meshes( const aiNode* node, const aiScene* scene, std::vector<const aiMesh*>* meshes );
 
 private:
 	std::vector<VulkanMesh> Meshes;
-	glm::mat4 ModelMatrix;
+	std::vector<glm::mat4> InstanceMatrices { glm::mat4( 1.0f ) };
+	uint64_t Version = 0;
 };
 
@@ -1,120 +1,154 @@
 #include "vulkan-mesh.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include <glm/gtc/packing.hpp>
+
 VulkanMesh::VulkanMesh(
-	vk::PhysicalDevice physical_device,
-	vk::Device device,
-	vk::Queue transfer_queue,
-	vk::CommandPool transfer_command_pool,
-	std::vector<VulkanVertex>* vertices,
-	std::vector<uint32_t>* indices,
+	VulkanGeometryBuffer* geometry_buffer,
+	VulkanUploadContext* upload_context,
+	const VulkanMeshGeometry& geometry,
 	int texture_id
 )
-	: PhysicalDevice( physical_device ), Device( device ),
-	  VertexCount( vertices->size() ), IndexCount( indices->size() ),
-	  TextureID( texture_id )
+	: GeometryBuffer( geometry_buffer ), Bounds( geometry.Bounds ), VertexLayout( geometry.VertexLayout ), TextureID( texture_id )
 {
-	MeshData.Model = glm::mat4( 1.0f );
+	//  allocate ranges in the shared vertex & index buffers and record
+	//  their upload, submitted along with the rest of the upload batch
+	GeometryRangeID = GeometryBuffer->allocate( 
+		upload_context, 
+		geometry.Vertices, 
+		geometry.VertexCount, 
+		get_vertex_stride( geometry.VertexLayout ),
+		geometry.Indices, 
+		geometry.IndexCount,
+		geometry.IndexType
+	);
 
-	setup_vertex_buffer( transfer_queue, transfer_command_pool, vertices );
-	setup_index_buffer( transfer_queue, transfer_command_pool, indices );
+	LODCount = std::min( std::max( geometry.LODCount, 1u ), MAX_MESH_LODS );
+	if ( geometry.LODCount == 0 )
+	{
+		LODs[0].IndexCount = geometry.IndexCount;
+	}
+	for ( uint32_t i = 0; i < geometry.LODCount && i < MAX_MESH_LODS; i++ )
+	{
+		LODs[i] = geometry.LODs[i];
+	}
 }
 
-void VulkanMesh::release_buffers()
+uint32_t VulkanMesh::select_lod( float max_error ) const
 {
-	Device.destroyBuffer( VertexBuffer, nullptr );
-	Device.freeMemory( VertexBufferMemory, nullptr );
-
-	Device.destroyBuffer( IndexBuffer, nullptr );
-	Device.freeMemory( IndexBufferMemory, nullptr );
+	//  errors increase with levels
+	uint32_t lod = 0;
+	while ( lod + 1 < LODCount && LODs[lod + 1].Error <= max_error )
+	{
+		lod++;
+	}
+	return lod;
 }
 
-void VulkanMesh::setup_vertex_buffer( vk::Queue transfer_queue, vk::CommandPool transfer_command_pool, std::vector<VulkanVertex>* vertices )
+glm::vec3 VulkanMesh::get_position_offset() const
 {
-	vk::DeviceSize buffer_size = sizeof( VulkanVertex ) * vertices->size();
-
-	//  temporary buffer to stage vertex data before transfering to GPU
-	vk::Buffer staging_buffer;
-	vk::DeviceMemory staging_buffer_memory;
-	create_buffer(
-		PhysicalDevice,
-		Device,
-		buffer_size,
-		vk::BufferUsageFlagBits::eTransferSrc,
-		vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
-		&staging_buffer,
-		&staging_buffer_memory
-	);
+	return VertexLayout == VulkanVertexLayout::Compact ? Bounds.Min : glm::vec3( 0.0f );
+}
 
-	//  map memory to staging buffer
-	void* data;
-	Device.mapMemory( staging_buffer_memory, {}, buffer_size, {}, &data );
-	memcpy( data, vertices->data(), (size_t)buffer_size );
-	Device.unmapMemory( staging_buffer_memory );
-
-	// Create buffer with vk::BufferUsageFlagBits::eTransferDst to mark as recipient
-	// of transfer data Buffer memory need to be vk::MemoryPropertyFlagBits::eDeviceLocal
-	// meaning memory is on GPU only and not CPU-accessible
-	create_buffer( 
-		PhysicalDevice, 
-		Device, 
-		buffer_size, 
-		vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eVertexBuffer, 
-		vk::MemoryPropertyFlagBits::eDeviceLocal, 
-		&VertexBuffer,
-		&VertexBufferMemory
-	);
+glm::vec3 VulkanMesh::get_position_scale() const
+{
+	return VertexLayout == VulkanVertexLayout::Compact ? Bounds.Max - Bounds.Min : glm::vec3( 1.0f );
+}
 
-	//  copy staging buffer to vertex buffer on GPU
-	copy_buffer( Device, transfer_queue, transfer_command_pool, staging_buffer, VertexBuffer, buffer_size );
+MeshBounds MeshBounds::compute( const VulkanVertex* vertices, size_t vertex_count )
+{
+	MeshBounds bounds;
+	if ( vertex_count == 0 ) return bounds;
+
+	bounds.Min = vertices[0].Position;
+	bounds.Max = vertices[0].Position;
+	for ( size_t i = 1; i < vertex_count; i++ )
+	{
+		bounds.Min = glm::min( bounds.Min, vertices[i].Position );
+		bounds.Max = glm::max( bounds.Max, vertices[i].Position );
+	}
+
+	//  sphere around the box center, tighter than the half diagonal
+	bounds.Center = ( bounds.Min + bounds.Max ) * 0.5f;
+	float radius_squared = 0.0f;
+	for ( size_t i = 0; i < vertex_count; i++ )
+	{
+		glm::vec3 offset = vertices[i].Position - bounds.Center;
+		radius_squared = std::max( radius_squared, glm::dot( offset, offset ) );
+	}
+	bounds.Radius = sqrtf( radius_squared );
+
+	return bounds;
+}
 
-	//  release staging buffer
-	Device.destroyBuffer( staging_buffer, nullptr );
-	Device.freeMemory( staging_buffer_memory, nullptr );
+vk::IndexType encode_indices( const uint32_t* indices, size_t index_count, size_t vertex_count, std::vector<uint8_t>* output )
+{
+	if ( vertex_count > UINT16_MAX + 1 )
+	{
+		output->resize( index_count * sizeof( uint32_t ) );
+		memcpy( output->data(), indices, output->size() );
+		return vk::IndexType::eUint32;
+	}
+
+	output->resize( index_count * sizeof( uint16_t ) );
+	uint16_t* short_indices = (uint16_t*)output->data();
+	for ( size_t i = 0; i < index_count; i++ )
+	{
+		short_indices[i] = (uint16_t)indices[i];
+	}
+	return vk::IndexType::eUint16;
 }
 
-void VulkanMesh::setup_index_buffer( vk::Queue transfer_queue, vk::CommandPool transfer_command_pool, std::vector<uint32_t>* indices )
+void encode_compact_vertices(
+	const VulkanVertex* vertices,
+	size_t vertex_count,
+	const MeshBounds& bounds,
+	VulkanCompactVertex* output
+)
 {
-	vk::DeviceSize buffer_size = sizeof( uint32_t ) * indices->size();
-
-	vk::Buffer staging_buffer;
-	vk::DeviceMemory staging_buffer_memory;
-	create_buffer( 
-		PhysicalDevice, 
-		Device, 
-		buffer_size, 
-		vk::BufferUsageFlagBits::eTransferSrc,
-		vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
-		&staging_buffer, 
-		&staging_buffer_memory
+	//  flat axes have no extent, their positions are all at the minimum
+	glm::vec3 extent = bounds.Max - bounds.Min;
+	glm::vec3 inverse_extent(
+		extent.x > 0.0f ? 1.0f / extent.x : 0.0f,
+		extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+		extent.z > 0.0f ? 1.0f / extent.z : 0.0f
 	);
 
-	void* data;
-	Device.mapMemory( staging_buffer_memory, {}, buffer_size, {}, &data );
-	memcpy( data, indices->data(), static_cast<size_t>( buffer_size ) );
-	Device.unmapMemory( staging_buffer_memory );
-
-	// This time with vk::BufferUsageFlagBits::eIndexBuffer,
-	// &indexBuffer and &indexBufferMemory
-	create_buffer( 
-		PhysicalDevice, 
-		Device, 
-		buffer_size,
-		vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eIndexBuffer,
-		vk::MemoryPropertyFlagBits::eDeviceLocal,
-		&IndexBuffer, 
-		&IndexBufferMemory 
-	);
+	for ( size_t i = 0; i < vertex_count; i++ )
+	{
+		const VulkanVertex& vertex = vertices[i];
+		VulkanCompactVertex& compact = output[i];
+
+		glm::vec3 position = glm::clamp( ( vertex.Position - bounds.Min ) * inverse_extent, 0.0f, 1.0f );
+		for ( int j = 0; j < 3; j++ )
+		{
+			compact.Position[j] = (uint16_t)std::lround( position[j] * 65535.0f );
+		}
+		compact.Position[3] = 0;
+
+		compact.UV[0] = (uint16_t)glm::packHalf1x16( vertex.UV.x );
+		compact.UV[1] = (uint16_t)glm::packHalf1x16( vertex.UV.y );
+	}
+}
 
-	// Copy to IndexBuffer
-	copy_buffer( 
-		Device,
-		transfer_queue,
-		transfer_command_pool,
-		staging_buffer, 
-		IndexBuffer, 
-		buffer_size 
-	);
+void VulkanMesh::release_buffers( uint64_t retire_key )
+{
+	GeometryBuffer->free( GeometryRangeID, retire_key );
+}
 
-	Device.destroyBuffer( staging_buffer );
-	Device.freeMemory( staging_buffer_memory );
+size_t VulkanMesh::add_instance( const glm::mat4& matrix )
+{
+	InstanceMatrices.push_back( matrix );
+	Version++;
+	return InstanceMatrices.size() - 1;
+}
+
+void VulkanMesh::set_instance_matrix( size_t id, const glm::mat4& matrix )
+{
+	if ( id >= InstanceMatrices.size() ) throw std::runtime_error( "Attempted to access an instance outside bounds" );
+	InstanceMatrices[id] = matrix;
+	Version++;
 }
@@ -4,55 +4,145 @@
 #include <GLFW/glfw3.h>
 
 #include "vulkan-utils.hpp"
+#include "vulkan-geometry-buffer.h"
 
+//  MeshData::Flags bits, read by shaders
+enum MeshFlags : uint32_t
+{
+	MESH_FLAG_NONE = 0,
+	MESH_FLAG_VERTEX_COLOR = 1 << 0,  //  draw with vertex colors instead of the texture
+};
+
+//  per instance data read by shaders, laid out as std430
 struct MeshData
 {
 	glm::mat4 Model;
+	glm::mat4 Normal;  //  inverse transpose of the model matrix
+	glm::vec3 PositionOffset { 0.0f };  //  compact vertices position is offset + position * scale
+	uint32_t MaterialIndex = 0;
+	glm::vec3 PositionScale { 1.0f };
+	uint32_t Flags = MESH_FLAG_NONE;
+	uint32_t DrawIndex = 0;  //  draw it belongs to, read by GPU culling
+	uint32_t Padding[3] {};
+};
+static_assert( sizeof( MeshData ) % 16 == 0, "MeshData size must match its std430 array stride" );
+
+//  bounds of a mesh in its own space
+struct MeshBounds
+{
+	glm::vec3 Min { 0.0f };
+	glm::vec3 Max { 0.0f };
+	glm::vec3 Center { 0.0f };  //  of the bounding sphere, center of the box
+	float Radius = 0.0f;
+
+	static MeshBounds compute( const VulkanVertex* vertices, size_t vertex_count );
+};
+
+//  most levels of detail of a mesh, the full mesh included
+static const uint32_t MAX_MESH_LODS = 4;
+
+//  level of detail of a mesh: a range of its indices, every level drawing
+//  vertices of the same vertex range
+struct VulkanMeshLOD
+{
+	uint32_t FirstIndex = 0;  //  from the first index of the mesh
+	uint32_t IndexCount = 0;
+	float Error = 0.0f;  //  farthest the surface moved from the full mesh, in mesh space
+};
+
+//  vertices & indices of a mesh, as they are uploaded
+struct VulkanMeshGeometry
+{
+	VulkanVertexLayout VertexLayout = VulkanVertexLayout::Full;
+	const void* Vertices = nullptr;
+	uint32_t VertexCount = 0;
+	vk::IndexType IndexType = vk::IndexType::eUint32;
+	const void* Indices = nullptr;
+	uint32_t IndexCount = 0;
+	MeshBounds Bounds;  //  compact vertices positions are quantized to them
+
+	//  levels of detail, finest first; none draws every index as a single level
+	const VulkanMeshLOD* LODs = nullptr;
+	uint32_t LODCount = 0;
 };
 
+//  write indices as 16-bit ones when every vertex can be addressed, 32-bit
+//  otherwise; returns the type written
+vk::IndexType encode_indices( const uint32_t* indices, size_t index_count, size_t vertex_count, std::vector<uint8_t>* output );
+
+//  quantize positions to bounds and UVs to half floats
+void encode_compact_vertices(
+	const VulkanVertex* vertices,
+	size_t vertex_count,
+	const MeshBounds& bounds,
+	VulkanCompactVertex* output
+);
+
 class VulkanMesh
 {
 public:
+	//  vertices & indices are copied into staging memory, they can be
+	//  released as soon as the mesh is constructed
 	VulkanMesh( 
-		vk::PhysicalDevice physical_device, 
-		vk::Device device, 
-		vk::Queue transfer_queue, 
-		vk::CommandPool transfer_command_pool, 
-		std::vector<VulkanVertex>* vertices,
-		std::vector<uint32_t>* indices,
+		VulkanGeometryBuffer* geometry_buffer, 
+		VulkanUploadContext* upload_context, 
+		const VulkanMeshGeometry& geometry,
 		int texture_id
 	);
 	VulkanMesh() = default;
 	~VulkanMesh() = default;
 
-	size_t get_vertex_count() const { return VertexCount; }
-	vk::Buffer get_vertex_buffer() const { return VertexBuffer; }
+	//  range inside the shared geometry buffer, which may move it
+	size_t get_vertex_count() const { return get_geometry_range().VertexCount; }
+	int32_t get_vertex_offset() const { return get_geometry_range().VertexOffset; }
+
+	size_t get_index_count() const { return get_geometry_range().IndexCount; }
+	uint32_t get_first_index() const { return get_geometry_range().FirstIndex; }
+	vk::IndexType get_index_type() const { return get_geometry_range().IndexType; }
 
-	size_t get_index_count() const { return IndexCount; }
-	vk::Buffer get_index_buffer() const { return IndexBuffer; }
+	size_t get_lod_count() const { return LODCount; }
+	const VulkanMeshLOD& get_lod( size_t id ) const { return LODs[id]; }
+	//  coarsest level whose error is at most max_error, in mesh space
+	uint32_t select_lod( float max_error ) const;
 
-	MeshData get_mesh_data() const { return MeshData; }
-	void set_model_matrix( const glm::mat4& matrix ) { MeshData.Model = matrix; }
+	VulkanVertexLayout get_vertex_layout() const { return VertexLayout; }
+	//  turn vertices positions back into the mesh space, see MeshData
+	glm::vec3 get_position_offset() const;
+	glm::vec3 get_position_scale() const;
 
-	void release_buffers();
+	//  copies of the mesh drawn by a single instanced draw, the first
+	//  instance is the mesh itself
+	size_t add_instance( const glm::mat4& matrix );
+	void set_instance_matrix( size_t id, const glm::mat4& matrix );
+	const glm::mat4& get_instance_matrix( size_t id ) const { return InstanceMatrices[id]; }
+	size_t get_instance_count() const { return InstanceMatrices.size(); }
+
+	void set_model_matrix( const glm::mat4& matrix ) { set_instance_matrix( 0, matrix ); }
+
+	//  its geometry stays readable by frames up to retire_key, see VulkanGeometryBuffer::free
+	void release_buffers( uint64_t retire_key );
 
 	int get_texture_id() const { return TextureID; }
+	const MeshBounds& get_bounds() const { return Bounds; }
+
+	uint32_t get_flags() const { return Flags; }
+	void set_flags( uint32_t flags ) { Flags = flags; Version++; }
+
+	//  increased by every change of what is drawn, to detect idle meshes
+	uint64_t get_version() const { return Version; }
 
 private:
-	vk::PhysicalDevice PhysicalDevice;
-	vk::Device Device;
-	
-	size_t VertexCount;
-	vk::Buffer VertexBuffer;
-	vk::DeviceMemory VertexBufferMemory;
-
-	size_t IndexCount;
-	vk::Buffer IndexBuffer;
-	vk::DeviceMemory IndexBufferMemory;
-
-	MeshData MeshData;
+	VulkanGeometryBuffer* GeometryBuffer;
+	uint32_t GeometryRangeID;
+
+	std::vector<glm::mat4> InstanceMatrices { glm::mat4( 1.0f ) };
+	MeshBounds Bounds;
+	VulkanMeshLOD LODs[MAX_MESH_LODS];
+	uint32_t LODCount = 1;
+	VulkanVertexLayout VertexLayout = VulkanVertexLayout::Full;
 	int TextureID;
+	uint32_t Flags = MESH_FLAG_NONE;
+	uint64_t Version = 0;
 
-	void setup_vertex_buffer( vk::Queue transfer_queue, vk::CommandPool transfer_command_pool, std::vector<VulkanVertex>* vertices );
-	void setup_index_buffer( vk::Queue transfer_queue, vk::CommandPool transfer_command_pool, std::vector<uint32_t>* indices );
-};
\ No newline at end of file
+	const VulkanGeometryRange& get_geometry_range() const { return GeometryBuffer->get_range( GeometryRangeID ); }
+};
@@ -1,5 +1,9 @@
 #include "vulkan-renderer.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
 #include <set>
 
 VulkanRenderer::VulkanRenderer( GLFWwindow* window )
@@ -18,12 +22,29 @@ int VulkanRenderer::init()
 		Surface = create_surface();
 		retrieve_physical_device();
 		create_logical_device();
+		MemoryAllocator.init( 
+			MainDevices.Physical, 
+			MainDevices.Logical, 
+			is_device_extension_enabled( VK_EXT_MEMORY_BUDGET_EXTENSION_NAME ) 
+		);
+		StagingRing.init( &MemoryAllocator, STAGING_RING_SIZE );
+		VulkanQueueFamilyIndices queue_families = get_queue_families( MainDevices.Physical );
+		UploadContext.init(
+			MainDevices.Physical,
+			MainDevices.Logical,
+			&StagingRing,
+			GraphicsQueue,
+			queue_families.GraphicsFamily,
+			TransferQueue,
+			queue_families.TransferFamily
+		);
+		GeometryBuffer.init( &MemoryAllocator, GEOMETRY_VERTEX_BUFFER_SIZE, GEOMETRY_INDEX_BUFFER_SIZE );
+		Jobs.init();
 
 		//  pipeline
 		create_swapchain();
 		create_render_pass();
 		create_descriptor_set_layout();
-		create_push_constant_range();
 		create_graphics_pipeline();
 		create_color_buffer_image();
 		create_depth_buffer_image();
@@ -31,16 +52,33 @@ int VulkanRenderer::init()
 		create_graphics_command_pool();
 
 		//  data
-		//allocate_dynamic_buffer_transfer_space();
+		create_frame_arenas();
 		create_uniform_buffers();
 		create_descriptor_pool();
 		create_descriptor_sets();
 
 		//  commands
 		create_graphics_command_buffers();
+		create_recording_pools();
 		create_texture_sampler();
 		create_synchronisation();
 
+		//  record every initial upload into a single submission
+		UploadContext.begin();
+
+		//  culling binds the pyramid even when it can't be built
+		if ( UseGpuCulling )
+		{
+			DepthPyramid.init(
+				&MemoryAllocator,
+				UploadContext.get_graphics_command_buffer(),
+				SwapchainExtent,
+				UseOcclusionCulling ? DepthBufferImageView : vk::ImageView {},
+				MSAASamples
+			);
+			GpuCulling.init( &MemoryAllocator, queue_families.GraphicsFamily, MAX_FRAME_DRAWS, &DepthPyramid );
+		}
+
 		//  textures
 		int cat_texture = create_texture( "cat.jpg" );
 
@@ -82,6 +120,8 @@ int VulkanRenderer::init()
 		};
 		VulkanMesh* mesh1 = create_mesh( &mesh_vertices1, &mesh_indices, cat_texture );
 		VulkanMesh* mesh2 = create_mesh( &mesh_vertices2, &mesh_indices, cat_texture );
+
+		UploadContext.submit();
 	}
 	catch ( const std::runtime_error& err )
 	{
@@ -95,28 +135,26 @@ int VulkanRenderer::init()
 void VulkanRenderer::release()
 {
 	MainDevices.Logical.waitIdle();
+	retire_defragmentation_moves( true );
 
 	//  release textures
 	for ( int i = 0; i < TextureImages.size(); i++ )
 	{
 		MainDevices.Logical.destroyImage( TextureImages[i], nullptr );
-		MainDevices.Logical.freeMemory( TextureImageMemories[i], nullptr );
+		MemoryAllocator.free( TextureImageAllocations[i] );
 		MainDevices.Logical.destroyImageView( TextureImageViews[i], nullptr );
 	}
 
-	//  release models allocation
-	_aligned_free( ModelTransferSpace );
-
 	//  release models
 	for ( auto& model : MeshModels )
 	{
-		model.release_mesh_model();
+		model.release_mesh_model( FrameNumber );
 	}
 
 	//  release meshes
 	for ( auto& mesh : Meshes )
 	{
-		mesh.release_buffers();
+		mesh.release_buffers( FrameNumber );
 	}
 	Meshes.clear();
 
@@ -140,24 +178,20 @@ void VulkanRenderer::release()
 		MainDevices.Logical.destroyFence( DrawFences[i] );
 	}
 
-	//  release buffers
-	for ( int i = 0; i < ViewProjUniformBuffers.size(); i++ )
-	{
-		MainDevices.Logical.destroyBuffer( ViewProjUniformBuffers[i] );
-		MainDevices.Logical.freeMemory( ViewProjUniformBuffersMemory[i] );
-		/*MainDevices.Logical.destroyBuffer( ModelUniformDynBuffers[i] );
-		MainDevices.Logical.freeMemory( ModelUniformDynBuffersMemory[i] );*/
-	}
+	//  release uniform buffer
+	UniformRing.release();
+	DrawBuffer.release();
+	FrameArenas.clear();
 
 	//  release color buffer
 	MainDevices.Logical.destroyImageView( ColorImageView );
 	MainDevices.Logical.destroyImage( ColorImage );
-	MainDevices.Logical.freeMemory( ColorImageMemory );
+	MemoryAllocator.free( ColorImageAllocation );
 
 	//  release depth buffer
 	MainDevices.Logical.destroyImageView( DepthBufferImageView );
 	MainDevices.Logical.destroyImage( DepthBufferImage );
-	MainDevices.Logical.freeMemory( DepthBufferImageMemory );
+	MemoryAllocator.free( DepthBufferImageAllocation );
 
 	//  release sampler
 	MainDevices.Logical.destroySampler( TextureSampler );
@@ -168,11 +202,30 @@ void VulkanRenderer::release()
 	MainDevices.Logical.destroyDescriptorPool( ViewProjDescriptorPool );
 	MainDevices.Logical.destroyDescriptorSetLayout( DescriptorSetLayout );
 	MainDevices.Logical.destroyCommandPool( GraphicsCommandPool );
-	MainDevices.Logical.destroyPipeline( GraphicsPipeline );
+	for ( auto& pool : RecordingPools )
+	{
+		MainDevices.Logical.destroyCommandPool( pool.Pool );
+	}
+	RecordingPools.clear();
+	for ( auto& pipeline : GraphicsPipelines )
+	{
+		MainDevices.Logical.destroyPipeline( pipeline );
+	}
 	MainDevices.Logical.destroyRenderPass( RenderPass );
+	MainDevices.Logical.destroyRenderPass( SecondPhaseRenderPass );
 	MainDevices.Logical.destroyPipelineLayout( PipelineLayout );
 	MainDevices.Logical.destroySwapchainKHR( Swapchain );
+	GeometryBuffer.release();
+	if ( UseGpuCulling )
+	{
+		GpuCulling.release();
+		DepthPyramid.release();
+	}
+	UploadContext.release();
+	StagingRing.release();
+	MemoryAllocator.release();
 	MainDevices.Logical.destroy();
+	Jobs.release();
 
 	//  release instance
 	Instance.destroySurfaceKHR( Surface );
@@ -184,6 +237,13 @@ void VulkanRenderer::draw()
 	// 0. Freeze code until the drawFences[currentFrame] is open
 	MainDevices.Logical.waitForFences( DrawFences[CurrentFrame], VK_TRUE, std::numeric_limits<uint32_t>::max() );
 	MainDevices.Logical.resetFences( DrawFences[CurrentFrame] );
+	get_frame_arena().reset();
+
+	//  frames older than MAX_FRAME_DRAWS are done, resources they used can move,
+	//  and geometry they drew from can be reused: up to the frame whose fence
+	//  was just waited on, which also covers copies submitted before its draws
+	if ( FrameNumber >= (uint64_t)MAX_FRAME_DRAWS ) GeometryBuffer.release_retired( FrameNumber - MAX_FRAME_DRAWS );
+	defragment_memory();
 
 	// 1. Get next available image to draw and set a semaphore to signal
 	// when we're finished with the image.
@@ -194,8 +254,9 @@ void VulkanRenderer::draw()
 		VK_NULL_HANDLE
 	).value;
 
+	update_uniform_buffers();
+	build_draw_list();
 	record_commands( image_idx );
-	update_uniform_buffers( image_idx );
 
 	// 2. Submit command buffer to queue for execution, make sure it waits
 	// for the image to be signaled as available before drawing, and
@@ -210,10 +271,14 @@ void VulkanRenderer::draw()
 		vk::PipelineStageFlagBits::eColorAttachmentOutput,
 	};
 	submit_info.pWaitDstStageMask = wait_stages;
-	submit_info.commandBufferCount = 1;
 
-	// Command buffer to submit
-	submit_info.pCommandBuffers = &CommandBuffers[image_idx];
+	// Command buffers to submit, culling first
+	vk::CommandBuffer command_buffers[2];
+	uint32_t command_buffer_count = 0;
+	if ( UseGpuCulling ) command_buffers[command_buffer_count++] = record_culling();
+	command_buffers[command_buffer_count++] = get_command_buffer( image_idx );
+	submit_info.commandBufferCount = command_buffer_count;
+	submit_info.pCommandBuffers = command_buffers;
 
 	// Semaphores to signal when command buffer finishes
 	submit_info.signalSemaphoreCount = 1;
@@ -231,6 +296,7 @@ void VulkanRenderer::draw()
 
 	//  increase frame
 	CurrentFrame = ( CurrentFrame + 1 ) % MAX_FRAME_DRAWS;
+	FrameNumber++;
 }
 
 VulkanMesh* VulkanRenderer::create_mesh( 
@@ -239,26 +305,57 @@ VulkanMesh* VulkanRenderer::create_mesh(
 	int texture_id
 )
 {
+	//  upload on its own unless already part of a batch
+	bool owns_batch = !UploadContext.is_recording();
+	if ( owns_batch ) UploadContext.begin();
+
+	std::vector<uint8_t> encoded_indices;
+	VulkanMeshGeometry geometry;
+	geometry.VertexLayout = VulkanVertexLayout::Full;
+	geometry.Vertices = vertices->data();
+	geometry.VertexCount = (uint32_t)vertices->size();
+	geometry.IndexType = encode_indices( indices->data(), indices->size(), vertices->size(), &encoded_indices );
+	geometry.Indices = encoded_indices.data();
+	geometry.IndexCount = (uint32_t)indices->size();
+	geometry.Bounds = MeshBounds::compute( vertices->data(), vertices->size() );
+
 	VulkanMesh mesh(
-		MainDevices.Physical,
-		MainDevices.Logical,
-		GraphicsQueue,
-		GraphicsCommandPool,
-		vertices,
-		indices,
+		&GeometryBuffer,
+		&UploadContext,
+		geometry,
 		texture_id
 	);
 
+	if ( owns_batch ) UploadContext.submit();
+
 	Meshes.push_back( mesh );
+	SceneVersion++;
 	return &Meshes.back();
 }
 
+void VulkanRenderer::print_memory_report()
+{
+	MemoryAllocator.print_report();
+}
+
 void VulkanRenderer::update_model( int id, glm::mat4 matrix )
 {
 	if ( id >= Meshes.size() ) return;
 
 	Meshes[id].set_model_matrix( matrix );
 }
+int VulkanRenderer::add_mesh_instance( int id, glm::mat4 matrix )
+{
+	if ( id >= Meshes.size() ) throw std::runtime_error( "Attempted to instance a mesh outside bounds" );
+
+	return (int)Meshes[id].add_instance( matrix );
+}
+void VulkanRenderer::update_mesh_instance( int id, int instance_id, glm::mat4 matrix )
+{
+	if ( id >= Meshes.size() ) return;
+
+	Meshes[id].set_instance_matrix( instance_id, matrix );
+}
 
 void VulkanRenderer::create_instance()
 {
@@ -319,6 +416,7 @@ void VulkanRenderer::create_logical_device()
 	std::set<int> queue_family_indices = {
 		indices.GraphicsFamily,
 		indices.PresentationFamily,
+		indices.TransferFamily,
 	};
 
 	for ( int index : queue_family_indices )
@@ -338,21 +436,83 @@ void VulkanRenderer::create_logical_device()
 	//  queues
 	device_create_info.queueCreateInfoCount = (uint32_t)queue_create_infos.size();
 	device_create_info.pQueueCreateInfos = queue_create_infos.data();
-	//  extensions
-	device_create_info.enabledExtensionCount = (uint32_t)VulkanDeviceExtensions.size();
-	device_create_info.ppEnabledExtensionNames = VulkanDeviceExtensions.data();
+	//  extensions, optional ones only if supported
+	EnabledDeviceExtensions = VulkanDeviceExtensions;
+	std::vector<vk::ExtensionProperties> extension_properties = MainDevices.Physical.enumerateDeviceExtensionProperties();
+	for ( const auto& extension : VulkanOptionalDeviceExtensions )
+	{
+		for ( const auto& prop : extension_properties )
+		{
+			if ( strcmp( extension, prop.extensionName ) == 0 )
+			{
+				EnabledDeviceExtensions.push_back( extension );
+				break;
+			}
+		}
+	}
+	device_create_info.enabledExtensionCount = (uint32_t)EnabledDeviceExtensions.size();
+	device_create_info.ppEnabledExtensionNames = EnabledDeviceExtensions.data();
 	//  features
-	vk::PhysicalDeviceFeatures device_features {};
-	device_features.samplerAnisotropy = true;
-	device_features.sampleRateShading = true;
-	device_create_info.pEnabledFeatures = &device_features;
+	vk::PhysicalDeviceFeatures supported_features = MainDevices.Physical.getFeatures();
+	vk::PhysicalDeviceFeatures2 device_features {};
+	device_features.features.samplerAnisotropy = true;
+	device_features.features.sampleRateShading = true;
+	device_features.features.drawIndirectFirstInstance = true;
+	device_features.features.multiDrawIndirect = supported_features.multiDrawIndirect;
+
+	//  texture array, indexed per instance & updated while frames are in flight
+	vk::PhysicalDeviceDescriptorIndexingFeaturesEXT descriptor_indexing_features {};
+	descriptor_indexing_features.runtimeDescriptorArray = true;
+	descriptor_indexing_features.descriptorBindingPartiallyBound = true;
+	descriptor_indexing_features.descriptorBindingSampledImageUpdateAfterBind = true;
+	descriptor_indexing_features.descriptorBindingUpdateUnusedWhilePending = true;
+	descriptor_indexing_features.shaderSampledImageArrayNonUniformIndexing = true;
+	device_features.pNext = &descriptor_indexing_features;
+
+	//  features are given through the pNext chain
+	device_create_info.pNext = &device_features;
+	device_create_info.pEnabledFeatures = nullptr;
+
+	//  size of the texture array
+	auto properties = MainDevices.Physical.getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceDescriptorIndexingPropertiesEXT>();
+	const auto& descriptor_indexing_properties = properties.get<vk::PhysicalDeviceDescriptorIndexingPropertiesEXT>();
+	MaxTextures = std::min( { 
+		MAX_TEXTURES, 
+		descriptor_indexing_properties.maxDescriptorSetUpdateAfterBindSampledImages,
+		descriptor_indexing_properties.maxPerStageDescriptorUpdateAfterBindSampledImages,
+		descriptor_indexing_properties.maxDescriptorSetUpdateAfterBindSamplers,
+		descriptor_indexing_properties.maxPerStageDescriptorUpdateAfterBindSamplers,
+	} );
+
+	//  without multi-draw indirect, commands are drawn one by one from the buffer
+	MaxDrawIndirectCount = 1;
+	if ( supported_features.multiDrawIndirect )
+	{
+		MaxDrawIndirectCount = MainDevices.Physical.getProperties().limits.maxDrawIndirectCount;
+	}
 
 	//  create device
 	MainDevices.Logical = MainDevices.Physical.createDevice( device_create_info );
 
+	//  GPU culling needs compute on the graphics queue, and to draw many commands at once
+	auto queue_family_properties = MainDevices.Physical.getQueueFamilyProperties();
+	bool has_graphics_compute = (bool)( queue_family_properties[indices.GraphicsFamily].queueFlags & vk::QueueFlagBits::eCompute );
+	if ( is_device_extension_enabled( VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME ) 
+	  && supported_features.multiDrawIndirect && has_graphics_compute )
+	{
+		//  extension command, not exported by the loader
+		CmdDrawIndexedIndirectCount = (PFN_vkCmdDrawIndexedIndirectCountKHR)MainDevices.Logical.getProcAddr( "vkCmdDrawIndexedIndirectCountKHR" );
+		UseGpuCulling = CmdDrawIndexedIndirectCount != nullptr;
+	}
+
+	//  occlusion culling samples the depth buffer, at its sample count
+	auto limits = MainDevices.Physical.getProperties().limits;
+	UseOcclusionCulling = UseGpuCulling && (bool)( limits.sampledImageDepthSampleCounts & MSAASamples );
+
 	//  queue accesses
 	GraphicsQueue = MainDevices.Logical.getQueue( indices.GraphicsFamily, 0 );
 	PresentationQueue = MainDevices.Logical.getQueue( indices.PresentationFamily, 0 );
+	TransferQueue = MainDevices.Logical.getQueue( indices.TransferFamily, 0 );
 }
 
 vk::SurfaceKHR VulkanRenderer::create_surface()
@@ -473,18 +633,18 @@ void VulkanRenderer::create_swapchain()
 
 void VulkanRenderer::create_graphics_pipeline()
 {
-	//  read code
-	auto vertex_code = read_shader_file( "shaders/vert.spv" );
+	//  read code, a vertex shader per vertex layout
+	const char* vertex_shader_files[] = { "shaders/vert.spv", "shaders/vert_compact.spv" };
+	static_assert( sizeof( vertex_shader_files ) / sizeof( *vertex_shader_files ) == (size_t)VulkanVertexLayout::Count, 
+		"Every vertex layout needs a vertex shader" );
 	auto fragment_code = read_shader_file( "shaders/frag.spv" );
 
 	//  create shader modules
-	vk::ShaderModule vertex_module = create_shader_module( vertex_code );
 	vk::ShaderModule fragment_module = create_shader_module( fragment_code );
 
-	//  vertex shader create info
+	//  vertex shader create info, module set per layout
 	vk::PipelineShaderStageCreateInfo vertex_shader_create_info {};
 	vertex_shader_create_info.stage = vk::ShaderStageFlagBits::eVertex;
-	vertex_shader_create_info.module = vertex_module;
 	vertex_shader_create_info.pName = "main";  //  pointer to main function
 
 	//  fragment shader create info
@@ -506,15 +666,15 @@ void VulkanRenderer::create_graphics_pipeline()
 	vk::VertexInputBindingDescription binding_description {};
 	// Binding position. Can bind multiple streams of data.
 	binding_description.binding = 0;
-	// Size of a single vertex data object, like in OpenGL
-	binding_description.stride = sizeof( VulkanVertex );
+	// Size of a single vertex data object, like in OpenGL; set per layout
+	binding_description.stride = 0;
 	// How ot move between data after each vertex.
 	// vk::VertexInputRate::eVertex: move onto next vertex
 	// vk::VertexInputRate::eInstance: move to a vertex for the next instance.
 	// Draw each first vertex of each instance, then the next vertex etc.
 	binding_description.inputRate = vk::VertexInputRate::eVertex;
 
-	// Different attributes
+	// Different attributes, of VulkanVertex
 	std::array<vk::VertexInputAttributeDescription, 3> attribute_descriptions;
 
 	// Position attributes
@@ -539,14 +699,24 @@ void VulkanRenderer::create_graphics_pipeline()
 	attribute_descriptions[2].format = vk::Format::eR32G32Sfloat;
 	attribute_descriptions[2].offset = offsetof( VulkanVertex, UV );
 
+	//  and of VulkanCompactVertex, normalized integers & half floats read as floats
+	std::array<vk::VertexInputAttributeDescription, 2> compact_attribute_descriptions;
+	compact_attribute_descriptions[0].binding = 0;
+	compact_attribute_descriptions[0].location = 0;
+	compact_attribute_descriptions[0].format = vk::Format::eR16G16B16A16Unorm;
+	compact_attribute_descriptions[0].offset = offsetof( VulkanCompactVertex, Position );
+
+	compact_attribute_descriptions[1].binding = 0;
+	compact_attribute_descriptions[1].location = 2;
+	compact_attribute_descriptions[1].format = vk::Format::eR16G16Sfloat;
+	compact_attribute_descriptions[1].offset = offsetof( VulkanCompactVertex, UV );
+
 	// -- VERTEX INPUT STAGE --
 	vk::PipelineVertexInputStateCreateInfo vertex_input_create_info {};
 	vertex_input_create_info.vertexBindingDescriptionCount = 1;
 	// List of vertex binding desc. (data spacing, stride...)
-	vertex_input_create_info.vertexAttributeDescriptionCount = (uint32_t)attribute_descriptions.size();
 	vertex_input_create_info.pVertexBindingDescriptions = &binding_description;
-	// List of vertex attribute desc. (data format and where to bind to/from)
-	vertex_input_create_info.pVertexAttributeDescriptions = attribute_descriptions.data();
+	// List of vertex attribute desc. (data format and where to bind to/from), set per layout
 
 	// -- INPUT ASSEMBLY --
 	vk::PipelineInputAssemblyStateCreateInfo input_assembly_create_info {};
@@ -661,8 +831,6 @@ void VulkanRenderer::create_graphics_pipeline()
 	vk::PipelineLayoutCreateInfo pipeline_layout_create_info {};
 	pipeline_layout_create_info.setLayoutCount = (uint32_t)descriptor_set_layouts.size();
 	pipeline_layout_create_info.pSetLayouts = descriptor_set_layouts.data();
-	pipeline_layout_create_info.pushConstantRangeCount = 1;
-	pipeline_layout_create_info.pPushConstantRanges = &PushConstantRange;
 
 	// Create pipeline layout
 	PipelineLayout = MainDevices.Logical.createPipelineLayout( pipeline_layout_create_info );
@@ -701,14 +869,27 @@ void VulkanRenderer::create_graphics_pipeline()
 	// Index of pipeline being created to derive from (in case of creating multiple at once)
 	graphics_pipeline_create_info.basePipelineIndex = -1;
 
-	// The handle is a cache when you want to save your pipeline to create an other later
-	auto result = MainDevices.Logical.createGraphicsPipeline( VK_NULL_HANDLE, graphics_pipeline_create_info );
-	// We could have used createGraphicsPipelines to create multiple pipelines at once.
-	if ( result.result != vk::Result::eSuccess ) throw std::runtime_error( "Cound not create a graphics pipeline" );
-	GraphicsPipeline = result.value;
+	//  a variant per vertex layout, which only differs by its vertex input & shader
+	for ( uint32_t layout = 0; layout < (uint32_t)VulkanVertexLayout::Count; layout++ )
+	{
+		bool is_compact = (VulkanVertexLayout)layout == VulkanVertexLayout::Compact;
+		binding_description.stride = get_vertex_stride( (VulkanVertexLayout)layout );
+		const auto& attributes = is_compact ? compact_attribute_descriptions : attribute_descriptions;
+		vertex_input_create_info.vertexAttributeDescriptionCount = (uint32_t)attributes.size();
+		vertex_input_create_info.pVertexAttributeDescriptions = attributes.data();
+
+		vk::ShaderModule vertex_module = create_shader_module( read_shader_file( vertex_shader_files[layout] ) );
+		stages[0].module = vertex_module;
+
+		// The handle is a cache when you want to save your pipeline to create an other later
+		auto result = MainDevices.Logical.createGraphicsPipeline( VK_NULL_HANDLE, graphics_pipeline_create_info );
+		MainDevices.Logical.destroyShaderModule( vertex_module );
+		// We could have used createGraphicsPipelines to create multiple pipelines at once.
+		if ( result.result != vk::Result::eSuccess ) throw std::runtime_error( "Cound not create a graphics pipeline" );
+		GraphicsPipelines[layout] = result.value;
+	}
 
 	//  destroy modules
-	MainDevices.Logical.destroyShaderModule( vertex_module );
 	MainDevices.Logical.destroyShaderModule( fragment_module );
 }
 
@@ -750,6 +931,11 @@ void VulkanRenderer::create_render_pass()
 		vk::ImageTiling::eOptimal,
 		vk::FormatFeatureFlagBits::eDepthStencilAttachment
 	);
+	vk::FormatFeatureFlags depth_features = MainDevices.Physical.getFormatProperties( DepthBufferFormat ).optimalTilingFeatures;
+	if ( !( depth_features & vk::FormatFeatureFlagBits::eSampledImage ) )
+	{
+		UseOcclusionCulling = false;
+	}
 
 	//  depth attachment
 	vk::AttachmentDescription depth_attachment {};
@@ -761,6 +947,12 @@ void VulkanRenderer::create_render_pass()
 	depth_attachment.stencilStoreOp = vk::AttachmentStoreOp::eDontCare;
 	depth_attachment.initialLayout = vk::ImageLayout::eUndefined;
 	depth_attachment.finalLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal;
+	//  kept to build the depth pyramid from, then to draw the second phase over
+	if ( UseOcclusionCulling )
+	{
+		depth_attachment.storeOp = vk::AttachmentStoreOp::eStore;
+		depth_attachment.finalLayout = vk::ImageLayout::eDepthStencilReadOnlyOptimal;
+	}
 
 	//  color resolve attachment
 	vk::AttachmentDescription color_resolve_attachment {};
@@ -813,7 +1005,7 @@ void VulkanRenderer::create_render_pass()
 	// Subpass dependencies: transitions between subpasses + from the last subpass to what
 	// happens after. Need to determine when layout transitions occur using subpass
 	// dependencies. Will define implicitly layout transitions.
-	std::array<vk::SubpassDependency, 2> subpass_dependencies;
+	std::array<vk::SubpassDependency, 3> subpass_dependencies;
 	// -- From layout undefined to color attachment optimal
 	// ---- Transition must happens after
 	// External: from outside the subpasses
@@ -840,11 +1032,46 @@ void VulkanRenderer::create_render_pass()
 	subpass_dependencies[1].dstStageMask = vk::PipelineStageFlagBits::eBottomOfPipe;
 	subpass_dependencies[1].dstAccessMask = vk::AccessFlagBits::eMemoryRead;
 	subpass_dependencies[1].dependencyFlags = vk::DependencyFlags();
-
-	render_pass_create_info.dependencyCount = static_cast<uint32_t>( subpass_dependencies.size() );
+	// -- From depth attachment writes to the depth pyramid reduction reading it
+	subpass_dependencies[2].srcSubpass = 0;
+	subpass_dependencies[2].srcStageMask = vk::PipelineStageFlagBits::eEarlyFragmentTests | vk::PipelineStageFlagBits::eLateFragmentTests;
+	subpass_dependencies[2].srcAccessMask = vk::AccessFlagBits::eDepthStencilAttachmentWrite;
+	subpass_dependencies[2].dstSubpass = VK_SUBPASS_EXTERNAL;
+	subpass_dependencies[2].dstStageMask = vk::PipelineStageFlagBits::eComputeShader;
+	subpass_dependencies[2].dstAccessMask = vk::AccessFlagBits::eShaderRead;
+	subpass_dependencies[2].dependencyFlags = vk::DependencyFlags();
+
+	render_pass_create_info.dependencyCount = UseOcclusionCulling ? 3 : 2;
 	render_pass_create_info.pDependencies = subpass_dependencies.data();
 
 	RenderPass = MainDevices.Logical.createRenderPass( render_pass_create_info );
+
+	if ( !UseOcclusionCulling ) return;
+
+	//  second phase of occlusion culling: draw over the first one, compatible with it
+	//  so that pipelines & framebuffers are shared
+	render_pass_attachments[0].loadOp = vk::AttachmentLoadOp::eLoad;
+	render_pass_attachments[0].initialLayout = vk::ImageLayout::eColorAttachmentOptimal;
+	render_pass_attachments[1].loadOp = vk::AttachmentLoadOp::eLoad;
+	render_pass_attachments[1].storeOp = vk::AttachmentStoreOp::eDontCare;
+	render_pass_attachments[1].initialLayout = vk::ImageLayout::eDepthStencilReadOnlyOptimal;
+	render_pass_attachments[1].finalLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal;
+
+	// -- After the first phase writes, and the reduction reading depth
+	subpass_dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+	subpass_dependencies[0].srcStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput
+		| vk::PipelineStageFlagBits::eLateFragmentTests | vk::PipelineStageFlagBits::eComputeShader;
+	subpass_dependencies[0].srcAccessMask = vk::AccessFlagBits::eColorAttachmentWrite
+		| vk::AccessFlagBits::eDepthStencilAttachmentWrite;
+	subpass_dependencies[0].dstSubpass = 0;
+	subpass_dependencies[0].dstStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput
+		| vk::PipelineStageFlagBits::eEarlyFragmentTests | vk::PipelineStageFlagBits::eLateFragmentTests;
+	subpass_dependencies[0].dstAccessMask = vk::AccessFlagBits::eColorAttachmentRead
+		| vk::AccessFlagBits::eColorAttachmentWrite | vk::AccessFlagBits::eDepthStencilAttachmentRead
+		| vk::AccessFlagBits::eDepthStencilAttachmentWrite;
+	render_pass_create_info.dependencyCount = 2;
+
+	SecondPhaseRenderPass = MainDevices.Logical.createRenderPass( render_pass_create_info );
 }
 
 void VulkanRenderer::create_frame_buffers()
@@ -888,7 +1115,8 @@ void VulkanRenderer::create_graphics_command_pool()
 
 void VulkanRenderer::create_graphics_command_buffers()
 {
-	CommandBuffers.resize( SwapchainFrameBuffers.size() );
+	//  one per image & frame in flight, so that each stays valid for reuse
+	CommandBuffers.resize( SwapchainFrameBuffers.size() * MAX_FRAME_DRAWS );
 
 	vk::CommandBufferAllocateInfo alloc_info {};
 	alloc_info.commandPool = GraphicsCommandPool;
@@ -899,6 +1127,24 @@ void VulkanRenderer::create_graphics_command_buffers()
 	alloc_info.level = vk::CommandBufferLevel::ePrimary;
 
 	CommandBuffers = MainDevices.Logical.allocateCommandBuffers( alloc_info );
+	CommandBufferRecordingIDs.assign( CommandBuffers.size(), 0 );
+	FrameDrawLists.resize( MAX_FRAME_DRAWS );
+}
+
+void VulkanRenderer::create_recording_pools()
+{
+	VulkanQueueFamilyIndices indices = get_queue_families( MainDevices.Physical );
+
+	//  reset as a whole every frame, buffers are allocated on demand by their thread
+	vk::CommandPoolCreateInfo create_info {};
+	create_info.queueFamilyIndex = indices.GraphicsFamily;
+	create_info.flags = vk::CommandPoolCreateFlagBits::eTransient;
+
+	RecordingPools.resize( MAX_FRAME_DRAWS * Jobs.get_thread_count() );
+	for ( auto& pool : RecordingPools )
+	{
+		pool.Pool = MainDevices.Logical.createCommandPool( create_info );
+	}
 }
 
 void VulkanRenderer::create_synchronisation()
@@ -922,31 +1168,37 @@ void VulkanRenderer::create_synchronisation()
 
 void VulkanRenderer::create_descriptor_pool()
 {
+	//  a set per frame in flight, pointing at the frame's instance buffer
+	//  and bound at the frame's uniform ring offset
 	vk::DescriptorPoolSize vp_pool_size {};
-	vp_pool_size.descriptorCount = (uint32_t)ViewProjUniformBuffers.size();
+	vp_pool_size.type = vk::DescriptorType::eUniformBufferDynamic;
+	vp_pool_size.descriptorCount = MAX_FRAME_DRAWS;
 
-	/*vk::DescriptorPoolSize model_pool_size {};
-	model_pool_size.descriptorCount = (uint32_t)ModelUniformDynBuffers.size();*/
+	vk::DescriptorPoolSize instance_pool_size {};
+	instance_pool_size.type = vk::DescriptorType::eStorageBuffer;
+	instance_pool_size.descriptorCount = MAX_FRAME_DRAWS;
 
 	std::vector<vk::DescriptorPoolSize> pool_sizes
 	{
 		vp_pool_size,
-		//model_pool_size
+		instance_pool_size,
 	};
 
 	vk::DescriptorPoolCreateInfo pool_create_info {};
-	pool_create_info.maxSets = (uint32_t)SwapchainImages.size();
+	pool_create_info.maxSets = MAX_FRAME_DRAWS;
 	pool_create_info.poolSizeCount = (uint32_t)pool_sizes.size();
 	pool_create_info.pPoolSizes = pool_sizes.data();
 
 	ViewProjDescriptorPool = MainDevices.Logical.createDescriptorPool( pool_create_info );
 
-	//  sampler descriptor pool
+	//  sampler descriptor pool, a single set holding every texture
 	vk::DescriptorPoolSize sampler_pool_size {};
-	sampler_pool_size.descriptorCount = MAX_OBJECTS;
+	sampler_pool_size.type = vk::DescriptorType::eCombinedImageSampler;
+	sampler_pool_size.descriptorCount = MaxTextures;
 
 	vk::DescriptorPoolCreateInfo sampler_pool_create_info {};
-	sampler_pool_create_info.maxSets = MAX_OBJECTS;
+	sampler_pool_create_info.flags = vk::DescriptorPoolCreateFlagBits::eUpdateAfterBindEXT;
+	sampler_pool_create_info.maxSets = 1;
 	sampler_pool_create_info.poolSizeCount = 1;
 	sampler_pool_create_info.pPoolSizes = &sampler_pool_size;
 
@@ -960,7 +1212,7 @@ void VulkanRenderer::create_descriptor_set_layout()
 	// Binding number in shader
 	vp_layout_binding.binding = 0;
 	// Type of descriptor (uniform, dynamic uniform, samples...)
-	vp_layout_binding.descriptorType = vk::DescriptorType::eUniformBuffer;
+	vp_layout_binding.descriptorType = vk::DescriptorType::eUniformBufferDynamic;
 	// Number of descriptors for binding
 	vp_layout_binding.descriptorCount = 1;
 	// Shader stage to bind to (here: vertex shader)
@@ -968,18 +1220,18 @@ void VulkanRenderer::create_descriptor_set_layout()
 	// For textures : can make sample data un changeable
 	vp_layout_binding.pImmutableSamplers = nullptr;
 
-	//  model
-	/*vk::DescriptorSetLayoutBinding model_layout_binding;
-	model_layout_binding.binding = 1;
-	model_layout_binding.descriptorType = vk::DescriptorType::eUniformBufferDynamic;
-	model_layout_binding.descriptorCount = 1;
-	model_layout_binding.stageFlags = vk::ShaderStageFlagBits::eVertex;
-	model_layout_binding.pImmutableSamplers = nullptr;*/
+	//  instances data, indexed by gl_InstanceIndex
+	vk::DescriptorSetLayoutBinding instance_layout_binding {};
+	instance_layout_binding.binding = 1;
+	instance_layout_binding.descriptorType = vk::DescriptorType::eStorageBuffer;
+	instance_layout_binding.descriptorCount = 1;
+	instance_layout_binding.stageFlags = vk::ShaderStageFlagBits::eVertex;
+	instance_layout_binding.pImmutableSamplers = nullptr;
 
 	std::vector<vk::DescriptorSetLayoutBinding> layout_bindings
 	{
 		vp_layout_binding,
-		//model_layout_binding
+		instance_layout_binding,
 	};
 
 	// Descriptor set layout with given binding
@@ -990,11 +1242,12 @@ void VulkanRenderer::create_descriptor_set_layout()
 	// Create descriptor set layout
 	DescriptorSetLayout = MainDevices.Logical.createDescriptorSetLayout( layout_create_info );
 
-	//  sampler
+	//  sampler, an array of every texture indexed by the material index of
+	//  instances; slots are written while frames using other slots are in flight
 	vk::DescriptorSetLayoutBinding sampler_layout_binding {};
 	sampler_layout_binding.binding = 0;
 	sampler_layout_binding.descriptorType = vk::DescriptorType::eCombinedImageSampler;
-	sampler_layout_binding.descriptorCount = 1;
+	sampler_layout_binding.descriptorCount = MaxTextures;
 	sampler_layout_binding.stageFlags = vk::ShaderStageFlagBits::eFragment;
 	sampler_layout_binding.pImmutableSamplers = nullptr;
 
@@ -1002,8 +1255,20 @@ void VulkanRenderer::create_descriptor_set_layout()
 	{
 		sampler_layout_binding
 	};
+	std::vector<vk::DescriptorBindingFlagsEXT> sampler_binding_flags
+	{
+		vk::DescriptorBindingFlagBitsEXT::ePartiallyBound 
+		  | vk::DescriptorBindingFlagBitsEXT::eUpdateAfterBind
+		  | vk::DescriptorBindingFlagBitsEXT::eUpdateUnusedWhilePending,
+	};
+
+	vk::DescriptorSetLayoutBindingFlagsCreateInfoEXT sampler_binding_flags_create_info {};
+	sampler_binding_flags_create_info.bindingCount = (uint32_t)sampler_binding_flags.size();
+	sampler_binding_flags_create_info.pBindingFlags = sampler_binding_flags.data();
 
 	vk::DescriptorSetLayoutCreateInfo sampler_layout_create_info {};
+	sampler_layout_create_info.pNext = &sampler_binding_flags_create_info;
+	sampler_layout_create_info.flags = vk::DescriptorSetLayoutCreateFlagBits::eUpdateAfterBindPoolEXT;
 	sampler_layout_create_info.bindingCount = (uint32_t)sampler_layout_bindings.size();
 	sampler_layout_create_info.pBindings = sampler_layout_bindings.data();
 
@@ -1012,118 +1277,95 @@ void VulkanRenderer::create_descriptor_set_layout()
 
 void VulkanRenderer::create_descriptor_sets()
 {
-	DescriptorSets.resize( SwapchainImages.size() );
-
-	//  populate from set layouts
-	std::vector<vk::DescriptorSetLayout> layouts( SwapchainImages.size(), DescriptorSetLayout );
-
 	//  allocate descriptor sets
+	std::vector<vk::DescriptorSetLayout> set_layouts( MAX_FRAME_DRAWS, DescriptorSetLayout );
 	vk::DescriptorSetAllocateInfo set_alloc_info {};
 	set_alloc_info.descriptorPool = ViewProjDescriptorPool;
-	set_alloc_info.descriptorSetCount = (uint32_t)SwapchainImages.size();
-	set_alloc_info.pSetLayouts = layouts.data();
+	set_alloc_info.descriptorSetCount = (uint32_t)set_layouts.size();
+	set_alloc_info.pSetLayouts = set_layouts.data();
 	
-	vk::Result result = MainDevices.Logical.allocateDescriptorSets( &set_alloc_info, DescriptorSets.data() );
+	UniformDescriptorSets.resize( MAX_FRAME_DRAWS );
+	vk::Result result = MainDevices.Logical.allocateDescriptorSets( &set_alloc_info, UniformDescriptorSets.data() );
 	if ( result != vk::Result::eSuccess )
 	{
 		throw std::runtime_error( "Failed to allocate descriptor sets!" );
 	}
 
-	for ( int i = 0; i < ViewProjUniformBuffers.size(); i++ )
+	for ( int frame = 0; frame < MAX_FRAME_DRAWS; frame++ )
 	{
-		//  view proj descriptor
+		//  view proj descriptor, the offset inside the ring is given when binding
 		vk::DescriptorBufferInfo vp_buffer_info {};
-		vp_buffer_info.buffer = ViewProjUniformBuffers[i];
+		vp_buffer_info.buffer = UniformRing.get_buffer();
 		vp_buffer_info.offset = 0;
 		vp_buffer_info.range = sizeof( ViewProjection );
 
 		vk::WriteDescriptorSet vp_set_write {};
 		// Descriptor sets to update
-		vp_set_write.dstSet = DescriptorSets[i];
+		vp_set_write.dstSet = UniformDescriptorSets[frame];
 		// Binding to update (matches with shader binding)
 		vp_set_write.dstBinding = 0;
 		// Index in array to update
 		vp_set_write.dstArrayElement = 0;
-		vp_set_write.descriptorType = vk::DescriptorType::eUniformBuffer;
+		vp_set_write.descriptorType = vk::DescriptorType::eUniformBufferDynamic;
 		// Amount of descriptor sets to update
 		vp_set_write.descriptorCount = 1;
 		// Information about buffer data to bind
 		vp_set_write.pBufferInfo = &vp_buffer_info;
 
-		//  model descriptor
-		/*vk::DescriptorBufferInfo model_buffer_info {};
-		model_buffer_info.buffer = ModelUniformDynBuffers[i];
-		model_buffer_info.offset = 0;
-		model_buffer_info.range = ModelUniformAlignement;
-
-		vk::WriteDescriptorSet model_set_write {};
-		model_set_write.dstSet = DescriptorSets[i];
-		model_set_write.dstBinding = 1;
-		model_set_write.dstArrayElement = 0;
-		model_set_write.descriptorType = vk::DescriptorType::eUniformBufferDynamic;
-		model_set_write.descriptorCount = 1;
-		model_set_write.pBufferInfo = &model_buffer_info;*/
-
-		std::vector<vk::WriteDescriptorSet> set_writes
-		{
-			vp_set_write,
-			//model_set_write
-		};
-
 		// Update descriptor set with new buffer/binding info
-		MainDevices.Logical.updateDescriptorSets( 
-			(uint32_t)set_writes.size(), 
-			set_writes.data(), 
-			0, 
-			nullptr
-		);
-	}
-}
+		MainDevices.Logical.updateDescriptorSets( 1, &vp_set_write, 0, nullptr );
 
-void VulkanRenderer::create_uniform_buffers()
-{
-	vk::DeviceSize vp_buffer_size = sizeof( ViewProjection );
-	//vk::DeviceSize model_buffer_size = ModelUniformAlignement * MAX_OBJECTS;
+		update_instance_descriptor( frame );
+	}
 
-	size_t size = SwapchainImages.size();
-	ViewProjUniformBuffers.resize( size );
-	ViewProjUniformBuffersMemory.resize( size );
-	/*ModelUniformDynBuffers.resize( size );
-	ModelUniformDynBuffersMemory.resize( size );*/
+	//  texture array, slots are written as textures are created
+	vk::DescriptorSetAllocateInfo texture_set_alloc_info {};
+	texture_set_alloc_info.descriptorPool = SamplerDescriptorPool;
+	texture_set_alloc_info.descriptorSetCount = 1;
+	texture_set_alloc_info.pSetLayouts = &SamplerDescriptorSetLayout;
 
-	for ( int i = 0; i < size; i++ )
+	result = MainDevices.Logical.allocateDescriptorSets( &texture_set_alloc_info, &TextureDescriptorSet );
+	if ( result != vk::Result::eSuccess )
 	{
-		//  view proj buffers
-		create_buffer( 
-			MainDevices.Physical, 
-			MainDevices.Logical, 
-			vp_buffer_size, 
-			vk::BufferUsageFlagBits::eUniformBuffer, 
-			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent, 
-			&ViewProjUniformBuffers[i],
-			&ViewProjUniformBuffersMemory[i]
-		);
-
-		//  model buffers
-		/*create_buffer(
-			MainDevices.Physical,
-			MainDevices.Logical,
-			model_buffer_size,
-			vk::BufferUsageFlagBits::eUniformBuffer,
-			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
-			&ModelUniformDynBuffers[i],
-			&ModelUniformDynBuffersMemory[i]
-		);*/
+		throw std::runtime_error( "Failed to allocate texture descriptor set!" );
 	}
 }
+void VulkanRenderer::update_instance_descriptor( uint32_t frame )
+{
+	//  whole instance buffer of the frame, which is recreated when it grows
+	vk::DescriptorBufferInfo instance_buffer_info {};
+	instance_buffer_info.buffer = DrawBuffer.get_instance_buffer( frame );
+	instance_buffer_info.offset = 0;
+	instance_buffer_info.range = VK_WHOLE_SIZE;
+
+	vk::WriteDescriptorSet instance_set_write {};
+	instance_set_write.dstSet = UniformDescriptorSets[frame];
+	instance_set_write.dstBinding = 1;
+	instance_set_write.dstArrayElement = 0;
+	instance_set_write.descriptorType = vk::DescriptorType::eStorageBuffer;
+	instance_set_write.descriptorCount = 1;
+	instance_set_write.pBufferInfo = &instance_buffer_info;
+
+	MainDevices.Logical.updateDescriptorSets( 1, &instance_set_write, 0, nullptr );
+}
 
-void VulkanRenderer::create_push_constant_range()
+void VulkanRenderer::create_frame_arenas()
+{
+	FrameArenas.resize( MAX_FRAME_DRAWS );
+	for ( auto& arena : FrameArenas )
+	{
+		arena.init( FRAME_ARENA_BLOCK_SIZE );
+	}
+}
+void VulkanRenderer::create_uniform_buffers()
 {
-	PushConstantRange.stageFlags = vk::ShaderStageFlagBits::eVertex;
-	PushConstantRange.offset = 0;
-	PushConstantRange.size = sizeof( MeshData );
+	//  one region per frame in flight, written while older frames are still drawn
+	UniformRing.init( &MemoryAllocator, UNIFORM_RING_FRAME_SIZE, MAX_FRAME_DRAWS );
+	//  with GPU culling, only the culling shader writes commands & instances
+	DrawBuffer.init( &MemoryAllocator, INITIAL_DRAW_CAPACITY, INITIAL_DRAW_CAPACITY, sizeof( MeshData ), MAX_FRAME_DRAWS, UseGpuCulling );
 }
 
+
 void VulkanRenderer::create_color_buffer_image()
 {
 	vk::Format color_format = SwapchainImageFormat;
@@ -1134,9 +1376,13 @@ void VulkanRenderer::create_color_buffer_image()
 		1, MSAASamples,
 		color_format,
 		vk::ImageTiling::eOptimal,
-		vk::ImageUsageFlagBits::eTransientAttachment | vk::ImageUsageFlagBits::eColorAttachment,
+		//  the second phase of occlusion culling loads what the first one stored
+		UseOcclusionCulling ? vk::ImageUsageFlagBits::eColorAttachment
+			: vk::ImageUsageFlagBits::eTransientAttachment | vk::ImageUsageFlagBits::eColorAttachment,
 		vk::MemoryPropertyFlagBits::eDeviceLocal,
-		&ColorImageMemory
+		&ColorImageAllocation,
+		VulkanMemoryCategory::Attachment,
+		"Color attachment"
 	);
 	ColorImageView = create_image_view(
 		ColorImage,
@@ -1168,9 +1414,13 @@ void VulkanRenderer::create_depth_buffer_image()
 		MSAASamples,
 		format,
 		vk::ImageTiling::eOptimal,
-		vk::ImageUsageFlagBits::eDepthStencilAttachment,
+		//  read by the depth pyramid reduction
+		UseOcclusionCulling ? vk::ImageUsageFlagBits::eDepthStencilAttachment | vk::ImageUsageFlagBits::eSampled
+			: vk::ImageUsageFlagBits::eDepthStencilAttachment,
 		vk::MemoryPropertyFlagBits::eDeviceLocal,
-		&DepthBufferImageMemory
+		&DepthBufferImageAllocation,
+		VulkanMemoryCategory::Attachment,
+		"Depth attachment"
 	);
 	DepthBufferImageView = create_image_view(
 		DepthBufferImage,
@@ -1198,7 +1448,26 @@ vk::Image VulkanRenderer::create_image(
 	vk::ImageTiling tiling,
 	vk::ImageUsageFlags use_flags, 
 	vk::MemoryPropertyFlags prop_flags,
-	vk::DeviceMemory* image_memory 
+	VulkanAllocation* image_allocation,
+	VulkanMemoryCategory category,
+	const std::string& name
+)
+{
+	vk::Image image = create_image_handle( width, height, mip_levels, samples, format, tiling, use_flags );
+
+	// Now we need to sub-allocate memory for the image and connect it
+	*image_allocation = MemoryAllocator.allocate_image_memory( image, tiling, prop_flags, category, name );
+
+	return image;
+}
+vk::Image VulkanRenderer::create_image_handle(
+	uint32_t width, 
+	uint32_t height, 
+	uint32_t mip_levels,
+	vk::SampleCountFlagBits samples,
+	vk::Format format,
+	vk::ImageTiling tiling,
+	vk::ImageUsageFlags use_flags
 )
 {
 	vk::ImageCreateInfo image_create_info {};
@@ -1223,163 +1492,160 @@ vk::Image VulkanRenderer::create_image(
 	image_create_info.sharingMode = vk::SharingMode::eExclusive;
 
 	// Create the header of the image
-	vk::Image image = MainDevices.Logical.createImage( image_create_info );
-
-	// Now we need to setup and allocate memory for the image
-	vk::MemoryRequirements memory_requirements = MainDevices.Logical.getImageMemoryRequirements( image );
+	return MainDevices.Logical.createImage( image_create_info );
+}
 
-	vk::MemoryAllocateInfo memoryAllocInfo {};
-	memoryAllocInfo.allocationSize = memory_requirements.size;
-	memoryAllocInfo.memoryTypeIndex = find_memory_type_index( 
-		MainDevices.Physical,
-		memory_requirements.memoryTypeBits, 
-		prop_flags 
-	);
+DecodedTexture VulkanRenderer::decode_texture( const std::string& file ) const
+{
+	DecodedTexture texture;
+	texture.Pixels = load_texture_file( file, &texture.Width, &texture.Height, &texture.Size );
 
-	auto result = MainDevices.Logical.allocateMemory(
-		&memoryAllocInfo, 
-		nullptr, 
-		image_memory 
-	);
-	if ( result != vk::Result::eSuccess )
+	//  compute number of mipmap levels, mipmaps are blitted with linear
+	//  filtering so only the full image is kept if the format can't
+	texture.MipLevels = (uint32_t)std::floor( std::log2( std::max( texture.Width, texture.Height ) ) ) + 1;
+	if ( !is_linear_blit_supported( MainDevices.Physical, TEXTURE_FORMAT ) )
 	{
-		throw std::runtime_error( "Failed to allocate memory for an image." );
+		texture.MipLevels = 1;
 	}
 
-	// Connect memory to image
-	MainDevices.Logical.bindImageMemory( image, *image_memory, 0 );
-
-	return image;
+	return texture;
 }
 
-int VulkanRenderer::create_texture_image( const std::string& file, uint32_t* mip_levels )
+void VulkanRenderer::submit_texture_decoding( const std::vector<std::string>& files, std::vector<DecodedTexture>* textures, JobCounter* counter )
 {
-	//  load image
-	int width, height;
-	vk::DeviceSize image_size;
-	stbi_uc* image_data = load_texture_file( file, &width, &height, &image_size );
-
-	//  compute number of mipmap levels
-	*mip_levels = (uint32_t)std::floor( std::log2( std::max( width, height ) ) ) + 1;
-
-	//  create staging buffer holding data
-	vk::Buffer staging_buffer;
-	vk::DeviceMemory staging_buffer_memory;
-	create_buffer(
-		MainDevices.Physical,
-		MainDevices.Logical,
-		image_size,
-		vk::BufferUsageFlagBits::eTransferSrc,
-		vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
-		&staging_buffer,
-		&staging_buffer_memory
-	);
+	textures->resize( files.size() );
 
-	//  copy image data to buffer
-	void* data;
-	MainDevices.Logical.mapMemory(
-		staging_buffer_memory,
-		{},
-		image_size,
-		{},
-		&data
-	);
-	memcpy( data, image_data, (size_t)image_size );
-	MainDevices.Logical.unmapMemory( staging_buffer_memory );
-	
-	//  free image data
-	stbi_image_free( image_data );
+	//  materials often share a same texture, decode it once
+	std::set<std::string> decoded_files;
+	for ( size_t i = 0; i < files.size(); i++ )
+	{
+		if ( files[i].empty() || !decoded_files.insert( files[i] ).second ) continue;
+
+		DecodedTexture* texture = &( *textures )[i];
+		const std::string* file = &files[i];
+		Jobs.submit( [this, texture, file]( uint32_t thread_index )
+		{
+			*texture = decode_texture( *file );
+		}, counter );
+	}
+}
 
+int VulkanRenderer::create_texture_image( const std::string& file, DecodedTexture* texture )
+{
 	//  create image
 	vk::Image texture_image;
-	vk::DeviceMemory texture_image_memory;
+	VulkanAllocation texture_image_allocation;
 	texture_image = create_image(
-		width,
-		height,
-		*mip_levels,
+		texture->Width,
+		texture->Height,
+		texture->MipLevels,
 		vk::SampleCountFlagBits::e1,
-		vk::Format::eR8G8B8A8Unorm,
+		TEXTURE_FORMAT,
 		vk::ImageTiling::eOptimal,
-		vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eSampled 
-		  | vk::ImageUsageFlagBits::eTransferSrc,
+		TEXTURE_USAGE,
 		vk::MemoryPropertyFlagBits::eDeviceLocal,
-		&texture_image_memory
+		&texture_image_allocation,
+		VulkanMemoryCategory::Texture,
+		file
 	);
 	
-	//  transition image to be DST for copy ops
-	transition_image_layout(
-		MainDevices.Logical,
-		GraphicsQueue,
-		GraphicsCommandPool,
-		texture_image,
-		vk::ImageLayout::eUndefined,
-		vk::ImageLayout::eTransferDstOptimal,
-		*mip_levels
-	);
+	//  transition image to be DST for copy ops & copy data through the staging ring
+	UploadContext.upload_image( texture->Pixels, texture->Size, texture_image, texture->Width, texture->Height, texture->MipLevels );
 
-	//  copy data to image
-	copy_image_buffer(
-		MainDevices.Logical,
-		GraphicsQueue,
-		GraphicsCommandPool,
-		staging_buffer,
-		texture_image,
-		width,
-		height
-	);
-
-	//  transition for shader use
-	transition_image_layout(
-		MainDevices.Logical,
-		GraphicsQueue,
-		GraphicsCommandPool,
-		texture_image,
-		vk::ImageLayout::eTransferDstOptimal,
-		vk::ImageLayout::eShaderReadOnlyOptimal,
-		*mip_levels
-	);
+	//  free image data
+	stbi_image_free( texture->Pixels );
+	texture->Pixels = nullptr;
 
-	//  generate mipmaps
-	generate_mipmaps(
-		MainDevices.Physical,
-		MainDevices.Logical,
-		GraphicsQueue,
-		GraphicsCommandPool,
+	//  generate mipmaps from the first one, each mip is left ready for shader use;
+	//  recorded in the same batch as the copy, so no extra submission is needed
+	UploadContext.generate_mipmaps(
 		texture_image,
-		vk::Format::eR8G8B8A8Srgb,
-		width,
-		height,
-		*mip_levels
+		TEXTURE_FORMAT,
+		texture->Width,
+		texture->Height,
+		texture->MipLevels
 	);
-	printf( "Generated %d mipmaps\n", *mip_levels );
+	printf( "Generated %d mipmaps\n", texture->MipLevels );
 
 	//  add to textures
 	TextureImages.push_back( texture_image );
-	TextureImageMemories.push_back( texture_image_memory );
-
-	//  destroy staging buffer
-	MainDevices.Logical.destroyBuffer( staging_buffer, nullptr );
-	MainDevices.Logical.freeMemory( staging_buffer_memory, nullptr );
+	TextureImageAllocations.push_back( texture_image_allocation );
+	TextureExtents.push_back( vk::Extent2D { (uint32_t)texture->Width, (uint32_t)texture->Height } );
+	TextureMipLevels.push_back( texture->MipLevels );
 
 	return TextureImages.size() - 1;
 }
 
 int VulkanRenderer::create_texture( const std::string& file )
 {
-	uint32_t mip_levels = 0;
-	int texture_id = create_texture_image( file, &mip_levels );
+	DecodedTexture texture = decode_texture( file );
+	return create_texture( file, &texture );
+}
+
+int VulkanRenderer::create_texture( const std::string& file, DecodedTexture* texture )
+{
+	bool owns_batch = !UploadContext.is_recording();
+	if ( owns_batch ) UploadContext.begin();
+
+	uint32_t mip_levels = texture->MipLevels;
+	int texture_id = create_texture_image( file, texture );
+
+	if ( owns_batch ) UploadContext.submit();
 
 	vk::ImageView image_view = create_image_view( 
 		TextureImages[texture_id], 
-		vk::Format::eR8G8B8A8Unorm, 
+		TEXTURE_FORMAT, 
 		vk::ImageAspectFlagBits::eColor ,
 		mip_levels
 	);
 	TextureImageViews.push_back( image_view );
 
-	//  descriptor sets
-	int descriptor_id = create_texture_descriptor( image_view );
-	return descriptor_id;
+	//  slot in the texture array
+	TextureDescriptorIndices.push_back( create_texture_descriptor( image_view ) );
+	return texture_id;
+}
+
+std::vector<int> VulkanRenderer::create_textures( const std::vector<std::string>& files )
+{
+	std::vector<DecodedTexture> textures;
+	JobCounter counter;
+	submit_texture_decoding( files, &textures, &counter );
+	Jobs.wait( &counter );
+
+	return create_textures( files, &textures );
+}
+
+std::vector<int> VulkanRenderer::create_textures( const std::vector<std::string>& files, std::vector<DecodedTexture>* textures )
+{
+	//  every texture goes in a single upload batch
+	bool owns_batch = !UploadContext.is_recording();
+	if ( owns_batch ) UploadContext.begin();
+
+	std::vector<int> texture_ids( files.size() );
+	std::map<std::string, int> loaded_ids;
+	for ( size_t i = 0; i < files.size(); i++ )
+	{
+		if ( files[i].empty() )
+		{
+			texture_ids[i] = 0;  //  default texture
+			continue;
+		}
+
+		//  decoded into its first occurrence only
+		auto itr = loaded_ids.find( files[i] );
+		if ( itr != loaded_ids.end() )
+		{
+			texture_ids[i] = itr->second;
+			continue;
+		}
+
+		texture_ids[i] = create_texture( files[i], &( *textures )[i] );
+		loaded_ids[files[i]] = texture_ids[i];
+	}
+
+	if ( owns_batch ) UploadContext.submit();
+
+	return texture_ids;
 }
 
 void VulkanRenderer::create_texture_sampler()
@@ -1413,17 +1679,20 @@ void VulkanRenderer::create_texture_sampler()
 	TextureSampler = MainDevices.Logical.createSampler( sampler_create_info );
 }
 
-int VulkanRenderer::create_texture_descriptor( vk::ImageView image_view )
+uint32_t VulkanRenderer::create_texture_descriptor( vk::ImageView image_view )
 {
-	vk::DescriptorSet descriptor_set;
-
-	vk::DescriptorSetAllocateInfo set_alloc_info {};
-	set_alloc_info.descriptorPool = SamplerDescriptorPool;
-	set_alloc_info.descriptorSetCount = 1;
-	set_alloc_info.pSetLayouts = &SamplerDescriptorSetLayout;
-
-	vk::Result result = MainDevices.Logical.allocateDescriptorSets( &set_alloc_info, &descriptor_set );
-	if ( result != vk::Result::eSuccess ) throw std::runtime_error( "Failed to allocate texutre descriptor set!" );
+	//  reuse slots released by moved textures
+	uint32_t descriptor_index;
+	if ( !FreeTextureDescriptorIndices.empty() )
+	{
+		descriptor_index = FreeTextureDescriptorIndices.back();
+		FreeTextureDescriptorIndices.pop_back();
+	}
+	else
+	{
+		if ( TextureDescriptorCount >= MaxTextures ) throw std::runtime_error( "Texture descriptor array is full!" );
+		descriptor_index = TextureDescriptorCount++;
+	}
 
 	//  texture image info
 	vk::DescriptorImageInfo image_info {};
@@ -1433,61 +1702,370 @@ int VulkanRenderer::create_texture_descriptor( vk::ImageView image_view )
 
 	//  write info
 	vk::WriteDescriptorSet descriptor_write {};
-	descriptor_write.dstSet = descriptor_set;
+	descriptor_write.dstSet = TextureDescriptorSet;
 	descriptor_write.dstBinding = 0;
-	descriptor_write.dstArrayElement = 0;
+	descriptor_write.dstArrayElement = descriptor_index;
 	descriptor_write.descriptorType = vk::DescriptorType::eCombinedImageSampler;
 	descriptor_write.descriptorCount = 1;
 	descriptor_write.pImageInfo = &image_info;
 
-	//  update new descriptor set
+	//  the slot is unused by frames in flight, it can be written while they are
 	MainDevices.Logical.updateDescriptorSets( 1, &descriptor_write, 0, nullptr );
 
-	//  add to sets
-	SamplerDescriptorSets.push_back( descriptor_set );
+	return descriptor_index;
+}
+void VulkanRenderer::defragment_memory()
+{
+	retire_defragmentation_moves( false );
+
+	//  resources of a batch being recorded are not uploaded yet
+	if ( UploadContext.is_recording() ) return;
+
+	//  plan texture moves first, so that nothing is submitted without work
+	VulkanDefragmentationMove* moves = get_frame_arena().allocate_array<VulkanDefragmentationMove>( MAX_PENDING_TEXTURE_MOVES );
+	uint32_t move_count = 0;
+	vk::DeviceSize planned_bytes = 0;
+	while ( PendingTextureMoveCount + move_count < (uint32_t)MAX_PENDING_TEXTURE_MOVES 
+	     && planned_bytes < DEFRAGMENTATION_BYTES_PER_FRAME )
+	{
+		VulkanDefragmentationMove move;
+		if ( !MemoryAllocator.plan_defragmentation_move( &move ) ) break;
+
+		moves[move_count++] = move;
+		planned_bytes += move.Src.Size;
+	}
+
+	bool has_geometry_work = GeometryBuffer.needs_compaction();
+	if ( move_count == 0 && !has_geometry_work ) return;
+
+	DefragmentationBatch batch {};
+	batch.Frame = FrameNumber;
 
-	return SamplerDescriptorSets.size() - 1;
+	UploadContext.begin();
+	vk::CommandBuffer command_buffer = UploadContext.get_graphics_command_buffer();
+
+	if ( has_geometry_work && planned_bytes < DEFRAGMENTATION_BYTES_PER_FRAME )
+	{
+		GeometryBuffer.record_compaction( command_buffer, DEFRAGMENTATION_BYTES_PER_FRAME - planned_bytes, batch.Frame );
+	}
+	for ( uint32_t i = 0; i < move_count; i++ )
+	{
+		batch.TextureMoves.push_back( move_texture( command_buffer, moves[i] ) );
+	}
+	PendingTextureMoveCount += move_count;
+
+	batch.Ticket = UploadContext.submit();
+	DefragmentationBatches.push_back( std::move( batch ) );
+
+	//  meshes & textures moved: rewrite draw data, and record again rather than
+	//  keep command buffers around resources about to be destroyed
+	SceneVersion++;
+	invalidate_recordings();
+}
+VulkanRenderer::TextureMove VulkanRenderer::move_texture( vk::CommandBuffer command_buffer, const VulkanDefragmentationMove& move )
+{
+	TextureMove texture_move {};
+	texture_move.Move = move;
+
+	//  find the texture owning the allocation
+	texture_move.TextureID = -1;
+	for ( int i = 0; i < TextureImageAllocations.size(); i++ )
+	{
+		if ( TextureImageAllocations[i].ResourceIndex != move.ResourceIndex ) continue;
+
+		texture_move.TextureID = i;
+		break;
+	}
+	if ( texture_move.TextureID == -1 ) throw std::runtime_error( "Failed to find the texture to defragment!" );
+
+	int id = texture_move.TextureID;
+	vk::Extent2D extent = TextureExtents[id];
+	uint32_t mip_levels = TextureMipLevels[id];
+
+	//  identical image bound to the new range
+	vk::Image image = create_image_handle(
+		extent.width,
+		extent.height,
+		mip_levels,
+		vk::SampleCountFlagBits::e1,
+		TEXTURE_FORMAT,
+		vk::ImageTiling::eOptimal,
+		TEXTURE_USAGE
+	);
+	MainDevices.Logical.bindImageMemory( image, move.Dst.Memory, move.Dst.Offset );
+
+	//  old image becomes a copy source once previous frames stopped sampling it,
+	//  the new one a copy destination
+	vk::ImageMemoryBarrier barriers[2] {};
+	for ( auto& barrier : barriers )
+	{
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.subresourceRange.aspectMask = vk::ImageAspectFlagBits::eColor;
+		barrier.subresourceRange.baseMipLevel = 0;
+		barrier.subresourceRange.levelCount = mip_levels;
+		barrier.subresourceRange.baseArrayLayer = 0;
+		barrier.subresourceRange.layerCount = 1;
+		barrier.dstAccessMask = vk::AccessFlagBits::eTransferWrite;
+	}
+	barriers[0].image = TextureImages[id];
+	barriers[0].oldLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+	barriers[0].newLayout = vk::ImageLayout::eTransferSrcOptimal;
+	barriers[0].dstAccessMask = vk::AccessFlagBits::eTransferRead;
+	barriers[1].image = image;
+	barriers[1].oldLayout = vk::ImageLayout::eUndefined;
+	barriers[1].newLayout = vk::ImageLayout::eTransferDstOptimal;
+	command_buffer.pipelineBarrier(
+		vk::PipelineStageFlagBits::eFragmentShader | vk::PipelineStageFlagBits::eTransfer,
+		vk::PipelineStageFlagBits::eTransfer,
+		{},
+		nullptr,
+		nullptr,
+		barriers
+	);
+
+	//  copy every mip
+	vk::ImageCopy* regions = get_frame_arena().allocate_array<vk::ImageCopy>( mip_levels );
+	for ( uint32_t mip = 0; mip < mip_levels; mip++ )
+	{
+		vk::ImageCopy& region = regions[mip];
+		region = vk::ImageCopy {};
+		region.srcSubresource.aspectMask = vk::ImageAspectFlagBits::eColor;
+		region.srcSubresource.mipLevel = mip;
+		region.srcSubresource.baseArrayLayer = 0;
+		region.srcSubresource.layerCount = 1;
+		region.dstSubresource = region.srcSubresource;
+		region.extent.width = std::max( extent.width >> mip, 1u );
+		region.extent.height = std::max( extent.height >> mip, 1u );
+		region.extent.depth = 1;
+	}
+	command_buffer.copyImage(
+		TextureImages[id], vk::ImageLayout::eTransferSrcOptimal,
+		image, vk::ImageLayout::eTransferDstOptimal,
+		mip_levels,
+		regions
+	);
+	record_transition_image_layout( command_buffer, image, vk::ImageLayout::eTransferDstOptimal, vk::ImageLayout::eShaderReadOnlyOptimal, mip_levels );
+
+	//  switch the texture to the new image, draws recorded from now on use it
+	texture_move.OldImage = TextureImages[id];
+	texture_move.OldImageView = TextureImageViews[id];
+	texture_move.OldDescriptorIndex = TextureDescriptorIndices[id];
+
+	TextureImages[id] = image;
+	TextureImageViews[id] = create_image_view( image, TEXTURE_FORMAT, vk::ImageAspectFlagBits::eColor, mip_levels );
+	TextureImageAllocations[id] = move.Dst;
+	TextureDescriptorIndices[id] = create_texture_descriptor( TextureImageViews[id] );
+
+	return texture_move;
+}
+void VulkanRenderer::retire_defragmentation_moves( bool force )
+{
+	while ( !DefragmentationBatches.empty() )
+	{
+		DefragmentationBatch& batch = DefragmentationBatches.front();
+
+		//  the last frame using old resources is batch.Frame - 1, it is done once
+		//  its fence has been waited MAX_FRAME_DRAWS frames later
+		if ( !force )
+		{
+			if ( FrameNumber < batch.Frame + MAX_FRAME_DRAWS ) break;
+			if ( !UploadContext.is_complete( batch.Ticket ) ) break;
+		}
+
+		for ( auto& texture_move : batch.TextureMoves )
+		{
+			MainDevices.Logical.destroyImageView( texture_move.OldImageView );
+			MainDevices.Logical.destroyImage( texture_move.OldImage );
+			FreeTextureDescriptorIndices.push_back( texture_move.OldDescriptorIndex );
+			MemoryAllocator.complete_defragmentation_move( texture_move.Move );
+		}
+		PendingTextureMoveCount -= (uint32_t)batch.TextureMoves.size();
+
+		DefragmentationBatches.pop_front();
+	}
 }
 
 VulkanMeshModel* VulkanRenderer::create_mesh_model( const std::string& file )
 {
-	Assimp::Importer importer;
+	static_assert( MAX_MESH_LODS <= MESH_CACHE_MAX_LODS, "Mesh cache must hold every level of detail" );
+
+	const uint32_t import_flags = aiProcess_Triangulate | aiProcess_FlipUVs | aiProcess_JoinIdenticalVertices;
+
+	//  a cooked copy next to the model skips the importer entirely
+	std::string cache_file = file + ".meshcache";
+	MeshCacheKey cache_key;
+	VulkanVertexLayout vertex_layout = ImportVertexLayout;
+	bool has_cache_key = MeshCacheKey::make( 
+		file, 
+		import_flags, 
+		(uint32_t)vertex_layout, 
+		get_vertex_stride( vertex_layout ), 
+		&cache_key 
+	);
 
-	const aiScene* scene = importer.ReadFile( file, aiProcess_Triangulate | aiProcess_FlipUVs | aiProcess_JoinIdenticalVertices );
-	if ( !scene ) throw std::runtime_error( "Failed to load mesh model: " + file );
+	//  textures are decoded on job threads while meshes are prepared, then
+	//  everything is uploaded at once
+	std::vector<std::string> materials;
+	std::vector<DecodedTexture> textures;
+	JobCounter counter;
 
-	//  load textures
-	std::vector<std::string> texture_names = VulkanMeshModel::get_materials( scene );
-	std::vector<int> texture_ids( texture_names.size() );
-	for ( size_t i = 0; i < texture_names.size(); i++ )
+	MeshCache cache;
+	if ( !has_cache_key || !cache.open( cache_file, cache_key ) )
 	{
-		if ( texture_names[i].empty() )
+		Assimp::Importer importer;
+
+		const aiScene* scene = importer.ReadFile( file, import_flags );
+		if ( !scene ) throw std::runtime_error( "Failed to load mesh model: " + file );
+
+		materials = VulkanMeshModel::get_materials( scene );
+		submit_texture_decoding( materials, &textures, &counter );
+
+		//  meshes are converted independently, one job each
+		std::vector<const aiMesh*> scene_meshes;
+		VulkanMeshModel::get_node_meshes( scene->mRootNode, scene, &scene_meshes );
+
+		std::vector<ImportedMesh> imported_meshes( scene_meshes.size() );
+		for ( size_t i = 0; i < scene_meshes.size(); i++ )
 		{
-			texture_ids[i] = 0;  //  default texture
+			ImportedMesh* imported = &imported_meshes[i];
+			const aiMesh* scene_mesh = scene_meshes[i];
+			Jobs.submit( [imported, scene_mesh, vertex_layout]( uint32_t thread_index )
+			{
+				*imported = VulkanMeshModel::import_mesh( scene_mesh, vertex_layout );
+			}, &counter );
 		}
-		else
+		Jobs.wait( &counter );
+
+		std::vector<MeshCacheMesh> cache_meshes( imported_meshes.size() );
+		for ( size_t i = 0; i < imported_meshes.size(); i++ )
 		{
-			texture_ids[i] = create_texture( texture_names[i] );
+			const ImportedMesh& imported = imported_meshes[i];
+			MeshCacheMesh& cache_mesh = cache_meshes[i];
+			cache_mesh.MaterialIndex = imported.MaterialIndex;
+			cache_mesh.VertexCount = imported.VertexCount;
+			cache_mesh.IndexCount = imported.IndexCount;
+			cache_mesh.IndexSize = VulkanGeometryBuffer::get_index_size( imported.IndexType );
+			cache_mesh.Vertices = imported.Vertices.data();
+			cache_mesh.Indices = imported.Indices.data();
+			memcpy( cache_mesh.BoundsMin, &imported.Bounds.Min, sizeof( cache_mesh.BoundsMin ) );
+			memcpy( cache_mesh.BoundsMax, &imported.Bounds.Max, sizeof( cache_mesh.BoundsMax ) );
+			memcpy( cache_mesh.SphereCenter, &imported.Bounds.Center, sizeof( cache_mesh.SphereCenter ) );
+			cache_mesh.SphereRadius = imported.Bounds.Radius;
+			cache_mesh.LODCount = (uint32_t)imported.LODs.size();
+			for ( size_t k = 0; k < imported.LODs.size(); k++ )
+			{
+				cache_mesh.LODs[k].FirstIndex = imported.LODs[k].FirstIndex;
+				cache_mesh.LODs[k].IndexCount = imported.LODs[k].IndexCount;
+				cache_mesh.LODs[k].Error = imported.LODs[k].Error;
+			}
 		}
+
+		//  then read back from the cache, as every later load does
+		if ( !has_cache_key
+		  || !MeshCache::write( cache_file, cache_key, materials, cache_meshes )
+		  || !cache.open( cache_file, cache_key ) )
+		{
+			printf( "Failed to write mesh cache: %s\n", cache_file.c_str() );
+			return create_mesh_model( materials, &textures, cache_meshes, vertex_layout );
+		}
+		printf( "Mesh cache written: %s\n", cache_file.c_str() );
+	}
+	else
+	{
+		materials = cache.get_materials();
+		submit_texture_decoding( materials, &textures, &counter );
+		printf( "Mesh cache loaded: %s\n", cache_file.c_str() );
+		Jobs.wait( &counter );
 	}
 
-	//  load meshes
-	std::vector<VulkanMesh> meshes = VulkanMeshModel::load_node(
-		MainDevices.Physical,
-		MainDevices.Logical,
-		GraphicsQueue,
-		GraphicsCommandPool,
-		scene->mRootNode,
-		scene,
-		texture_ids
-	);
+	std::vector<MeshCacheMesh> cache_meshes( cache.get_mesh_count() );
+	for ( size_t i = 0; i < cache_meshes.size(); i++ )
+	{
+		cache_meshes[i] = cache.get_mesh( i );
+	}
+
+	return create_mesh_model( materials, &textures, cache_meshes, vertex_layout );
+}
+
+VulkanMeshModel* VulkanRenderer::create_mesh_model(
+	const std::vector<std::string>& materials,
+	std::vector<DecodedTexture>* textures,
+	const std::vector<MeshCacheMesh>& meshes,
+	VulkanVertexLayout vertex_layout
+)
+{
+	//  textures & meshes of the model are uploaded in a single submission
+	UploadContext.begin();
+
+	//  load textures
+	std::vector<int> texture_ids = create_textures( materials, textures );
+
+	//  load meshes, copied from wherever they are straight into staging memory
+	std::vector<VulkanMesh> model_meshes;
+	model_meshes.reserve( meshes.size() );
+	for ( const auto& mesh : meshes )
+	{
+		VulkanMeshGeometry geometry;
+		geometry.VertexLayout = vertex_layout;
+		geometry.Vertices = mesh.Vertices;
+		geometry.VertexCount = mesh.VertexCount;
+		geometry.IndexType = mesh.IndexSize == 2 ? vk::IndexType::eUint16 : vk::IndexType::eUint32;
+		geometry.Indices = mesh.Indices;
+		geometry.IndexCount = mesh.IndexCount;
+		memcpy( &geometry.Bounds.Min, mesh.BoundsMin, sizeof( mesh.BoundsMin ) );
+		memcpy( &geometry.Bounds.Max, mesh.BoundsMax, sizeof( mesh.BoundsMax ) );
+		memcpy( &geometry.Bounds.Center, mesh.SphereCenter, sizeof( mesh.SphereCenter ) );
+		geometry.Bounds.Radius = mesh.SphereRadius;
+
+		VulkanMeshLOD lods[MAX_MESH_LODS];
+		geometry.LODs = lods;
+		geometry.LODCount = std::min( mesh.LODCount, MAX_MESH_LODS );
+		for ( uint32_t k = 0; k < geometry.LODCount; k++ )
+		{
+			lods[k].FirstIndex = mesh.LODs[k].FirstIndex;
+			lods[k].IndexCount = mesh.LODs[k].IndexCount;
+			lods[k].Error = mesh.LODs[k].Error;
+		}
+
+		model_meshes.push_back(
+			VulkanMesh(
+				&GeometryBuffer,
+				&UploadContext,
+				geometry,
+				texture_ids[mesh.MaterialIndex]
+			)
+		);
+	}
+	printf( "New Meshes: %d\n", (int)model_meshes.size() );
+
+	//  no need to wait: draws submitted later on the same queue are ordered after it
+	UploadContext.submit();
 
-	MeshModels.push_back( VulkanMeshModel( meshes ) );
+	MeshModels.push_back( VulkanMeshModel( model_meshes ) );
+	SceneVersion++;
 	return &MeshModels.back();
 }
 
 void VulkanRenderer::record_commands( uint32_t image_idx )
 {
+	FrameDrawList& list = FrameDrawLists[CurrentFrame];
+
+	//  draws are recorded once per frame in flight, for every swapchain image
+	bool has_recorded = false;
+	if ( list.RecordingID == 0 || list.RecordedViewProjOffset != ViewProjOffset )
+	{
+		record_secondary_command_buffers( list );
+		has_recorded = true;
+	}
+	FrameStats = list.Stats;
+	FrameStats.IsRecordingCached = !has_recorded;
+
+	//  the primary only executes them, nothing to do if it already does
+	uint32_t command_buffer_idx = image_idx * MAX_FRAME_DRAWS + CurrentFrame;
+	if ( CommandBufferRecordingIDs[command_buffer_idx] == list.RecordingID ) return;
+	CommandBufferRecordingIDs[command_buffer_idx] = list.RecordingID;
+
 	// How to begin each command buffer
 	vk::CommandBufferBeginInfo buffer_begin_info {};
 	// Buffer can be resubmited when it has already been submited
@@ -1513,133 +2091,695 @@ void VulkanRenderer::record_commands( uint32_t image_idx )
 	// Because 1-to-1 relationship
 	render_pass_begin_info.framebuffer = SwapchainFrameBuffers[image_idx];
 
-	auto& buffer = CommandBuffers[image_idx];
+	auto& buffer = CommandBuffers[command_buffer_idx];
 	// Start recording commands to command buffer
 	buffer.begin( buffer_begin_info );
 	// Begin render pass
-	// All draw commands inline (no secondary command buffers)
-	buffer.beginRenderPass( render_pass_begin_info, vk::SubpassContents::eInline );
-	// Bind pipeline to be used in render pass,
-	// you could switch pipelines for different subpasses
-	buffer.bindPipeline( vk::PipelineBindPoint::eGraphics, GraphicsPipeline );
-	
-	//  draw meshes
-	for ( size_t mesh_id = 0; mesh_id < Meshes.size(); mesh_id++ )
-	{
-		const auto& mesh = Meshes[mesh_id];
-
-		//  bind vertex buffer
-		vk::Buffer vertex_buffers[] = { mesh.get_vertex_buffer() };
-		vk::DeviceSize offsets[] = { 0 };
-		buffer.bindVertexBuffers( 0, vertex_buffers, offsets );
-
-		//  bind index buffer
-		buffer.bindIndexBuffer( mesh.get_index_buffer(), 0, vk::IndexType::eUint32 );
-			
-		//  dynamic offset amount
-		//uint32_t dynamic_offset = (uint32_t)ModelUniformAlignement * mesh_id;
-
-		////  bind descriptor sets
-		//buffer.bindDescriptorSets(
-		//	vk::PipelineBindPoint::eGraphics,
-		//	PipelineLayout,
-		//	0,
-		//	1,
-		//	&DescriptorSets[image_idx],
-		//	1,
-		//	&dynamic_offset
-		//);
-
-		//  push constants
-		MeshData model = mesh.get_mesh_data();
-		buffer.pushConstants( 
-			PipelineLayout, 
-			vk::ShaderStageFlagBits::eVertex, 
-			0, 
-			sizeof( MeshData ), 
-			&model 
-		);
+	// All draw commands come from secondary command buffers
+	buffer.beginRenderPass( render_pass_begin_info, vk::SubpassContents::eSecondaryCommandBuffers );
+
+	if ( !list.SecondaryBuffers.empty() )
+	{
+		buffer.executeCommands( list.SecondaryBuffers );
+	}
+
+	// End render pass
+	buffer.endRenderPass();
+
+	//  second phase of occlusion culling: build the pyramid from the depth just drawn,
+	//  test instances it hid again and draw those now visible over the first phase
+	if ( UseOcclusionCulling )
+	{
+		DepthPyramid.record_build( buffer );
+		GpuCulling.record_second_phase( buffer, CurrentFrame );
 
-		std::array<vk::DescriptorSet, 2> descriptor_sets
+		render_pass_begin_info.renderPass = SecondPhaseRenderPass;
+		render_pass_begin_info.clearValueCount = 0;
+		render_pass_begin_info.pClearValues = nullptr;
+		buffer.beginRenderPass( render_pass_begin_info, vk::SubpassContents::eSecondaryCommandBuffers );
+
+		if ( !list.SecondPhaseBuffers.empty() )
 		{
-			DescriptorSets[image_idx],
-			SamplerDescriptorSets[mesh.get_texture_id()],
-		};
+			buffer.executeCommands( list.SecondPhaseBuffers );
+		}
 
-		//  bind descriptor sets
-		buffer.bindDescriptorSets(
-			vk::PipelineBindPoint::eGraphics,
-			PipelineLayout,
-			0,
-			(uint32_t)descriptor_sets.size(),
-			descriptor_sets.data(),
-			0,
-			nullptr
-		);
+		buffer.endRenderPass();
+	}
+
+	// Stop recordind to command buffer
+	buffer.end();
+}
 
-		// Execute pipeline
-		buffer.drawIndexed( (uint32_t)mesh.get_index_count(), 1, 0, 0, 0 );
+void VulkanRenderer::record_secondary_command_buffers( FrameDrawList& list )
+{
+	//  split the sorted commands between job threads, each recording its part
+	//  into a secondary command buffer executed in order by the primaries
+	uint32_t thread_count = Jobs.get_thread_count();
+	uint32_t command_count = list.CommandCount;
+	uint32_t chunk_count = Jobs.get_batch_count( command_count, MIN_DRAWS_PER_RECORDING_JOB );
+	uint32_t chunk_size = chunk_count > 0 ? ( command_count + chunk_count - 1 ) / chunk_count : 0;
+	list.SecondaryBuffers.resize( chunk_count );
+	list.SecondPhaseBuffers.resize( UseOcclusionCulling ? chunk_count : 0 );
+
+	VulkanFrameStats* thread_stats = get_frame_arena().allocate_array<VulkanFrameStats>( thread_count );
+	for ( uint32_t i = 0; i < thread_count; i++ )
+	{
+		thread_stats[i] = VulkanFrameStats {};
 	}
 
-	//  draw mesh models
-	for ( size_t model_id = 0; model_id < MeshModels.size(); model_id++ )
+	//  the previous submission of this frame is done with its secondary buffers,
+	//  primaries executing them are recorded again as the recording changes
+	for ( uint32_t i = 0; i < thread_count; i++ )
 	{
-		VulkanMeshModel& model = MeshModels[model_id];
+		RecordingPool& pool = RecordingPools[CurrentFrame * thread_count + i];
+		MainDevices.Logical.resetCommandPool( pool.Pool );
+		pool.UsedCount = 0;
+	}
 
-		//  push constants
-		glm::mat4 model_matrix = model.get_model_matrix();
-		buffer.pushConstants(
-			PipelineLayout,
-			vk::ShaderStageFlagBits::eVertex,
-			0,
-			sizeof( MeshData ),
-			&model_matrix
+	//  no framebuffer, the same secondaries are executed for every swapchain image
+	vk::CommandBufferInheritanceInfo inheritance_info {};
+	inheritance_info.renderPass = RenderPass;
+	inheritance_info.subpass = 0;
+
+	vk::CommandBufferBeginInfo secondary_begin_info {};
+	secondary_begin_info.flags = vk::CommandBufferUsageFlagBits::eRenderPassContinue
+		| vk::CommandBufferUsageFlagBits::eSimultaneousUse;
+	secondary_begin_info.pInheritanceInfo = &inheritance_info;
+
+	vk::CommandBufferInheritanceInfo second_phase_inheritance_info = inheritance_info;
+	second_phase_inheritance_info.renderPass = SecondPhaseRenderPass;
+	vk::CommandBufferBeginInfo second_phase_begin_info = secondary_begin_info;
+	second_phase_begin_info.pInheritanceInfo = &second_phase_inheritance_info;
+
+	JobCounter counter;
+	for ( uint32_t i = 0; i < chunk_count; i++ )
+	{
+		Jobs.submit( [&, i]( uint32_t thread_index )
+		{
+			uint32_t first_command = i * chunk_size;
+			uint32_t count = std::min( chunk_size, command_count - first_command );
+
+			vk::CommandBuffer secondary = acquire_secondary_command_buffer( thread_index );
+			secondary.begin( secondary_begin_info );
+			record_draw_range( secondary, 0, first_command, count, &thread_stats[thread_index] );
+			secondary.end();
+			list.SecondaryBuffers[i] = secondary;
+
+			if ( UseOcclusionCulling )
+			{
+				secondary = acquire_secondary_command_buffer( thread_index );
+				secondary.begin( second_phase_begin_info );
+				record_draw_range( secondary, 1, first_command, count, &thread_stats[thread_index] );
+				secondary.end();
+				list.SecondPhaseBuffers[i] = secondary;
+			}
+		}, &counter );
+	}
+	Jobs.wait( &counter );
+
+	list.Stats.DrawCalls = 0;
+	list.Stats.PipelineBinds = 0;
+	list.Stats.VertexBufferBinds = 0;
+	list.Stats.IndexBufferBinds = 0;
+	list.Stats.DescriptorSetBinds = 0;
+	for ( uint32_t i = 0; i < thread_count; i++ )
+	{
+		list.Stats.DrawCalls += thread_stats[i].DrawCalls;
+		list.Stats.PipelineBinds += thread_stats[i].PipelineBinds;
+		list.Stats.VertexBufferBinds += thread_stats[i].VertexBufferBinds;
+		list.Stats.IndexBufferBinds += thread_stats[i].IndexBufferBinds;
+		list.Stats.DescriptorSetBinds += thread_stats[i].DescriptorSetBinds;
+	}
+
+	list.RecordingID = ++RecordingCount;
+	list.RecordedViewProjOffset = ViewProjOffset;
+}
+
+//  pipeline (8 bits) | geometry buffer (8 bits) | material (16 bits) | depth (32 bits);
+//  binds cost more than texture switches, which are free with the texture array
+static uint64_t make_draw_key( uint32_t pipeline_id, uint32_t geometry_id, uint32_t material, float depth )
+{
+	//  bits of a positive float sort like the float, draw front to back
+	uint32_t depth_bits;
+	depth = std::max( depth, 0.0f );
+	memcpy( &depth_bits, &depth, sizeof( depth_bits ) );
+
+	return (uint64_t)( pipeline_id & 0xFF ) << 56
+		| (uint64_t)( geometry_id & 0xFF ) << 48
+		| (uint64_t)( material & 0xFFFF ) << 32
+		| depth_bits;
+}
+
+void VulkanRenderer::build_draw_list()
+{
+	LinearArena& arena = get_frame_arena();
+	FrameDrawList& list = FrameDrawLists[CurrentFrame];
+	DrawBuffer.begin_frame( CurrentFrame );
+
+	//  nothing changed since this frame's buffers were written
+	uint64_t scene_signature = get_scene_signature();
+	if ( list.HasData && list.SceneSignature == scene_signature && list.View == Matrices.View )
+	{
+		list.Stats.IsDrawListCached = true;
+		return;
+	}
+
+	//  a source covers every instance of its mesh, whose data is laid out contiguously;
+	//  it is drawn by a draw per level of detail, each with the instances selecting it
+	struct DrawSource
+	{
+		const VulkanMesh* Mesh;
+		const glm::mat4* ModelMatrices;
+		const glm::mat4* NormalMatrices;
+		uint32_t InstanceCount;
+		uint32_t FirstBound;  //  world bounds of its instances, in source order
+		uint32_t FirstDraw;  //  draw of its first level, in sorted order
+		uint32_t VisibleCounts[MAX_MESH_LODS];  //  per level
+	};
+
+	//  count sources, draws, instances & distinct model matrices
+	uint32_t source_count = (uint32_t)Meshes.size();
+	uint32_t draw_count = 0;
+	uint32_t instance_count = 0;
+	uint32_t matrix_count = 0;
+	for ( const auto& mesh : Meshes )
+	{
+		draw_count += (uint32_t)mesh.get_lod_count();
+		instance_count += (uint32_t)mesh.get_instance_count();
+		matrix_count += (uint32_t)mesh.get_instance_count();
+	}
+	for ( auto& model : MeshModels )
+	{
+		source_count += (uint32_t)model.get_mesh_count();
+		for ( size_t k = 0; k < model.get_mesh_count(); k++ )
+		{
+			draw_count += (uint32_t)model.get_mesh( k )->get_lod_count();
+		}
+		instance_count += (uint32_t)( model.get_instance_count() * model.get_mesh_count() );
+		matrix_count += (uint32_t)model.get_instance_count();
+	}
+
+	//  the arena is not thread safe, allocate everything before running jobs
+	DrawSource* sources = arena.allocate_array<DrawSource>( source_count );
+	RadixSortItem* items = arena.allocate_array<RadixSortItem>( source_count );
+	RadixSortItem* sort_scratch = arena.allocate_array<RadixSortItem>( source_count );
+	uint32_t* first_instances = arena.allocate_array<uint32_t>( draw_count );
+	uint32_t* draw_runs = arena.allocate_array<uint32_t>( draw_count );
+	const glm::mat4** model_matrices = arena.allocate_array<const glm::mat4*>( matrix_count );
+	glm::mat4* normal_matrices = arena.allocate_array<glm::mat4>( matrix_count );
+	DrawRun* runs = arena.allocate_array<DrawRun>( draw_count );
+	uint32_t run_count = 0;
+
+	//  world bounding spheres of every instance, as separate arrays for SIMD culling
+	float* bound_xs = arena.allocate_array<float>( instance_count );
+	float* bound_ys = arena.allocate_array<float>( instance_count );
+	float* bound_zs = arena.allocate_array<float>( instance_count );
+	float* bound_radii = arena.allocate_array<float>( instance_count );
+	uint8_t* visible = arena.allocate_array<uint8_t>( instance_count );
+	uint8_t* instance_lods = arena.allocate_array<uint8_t>( instance_count );
+
+	//  gather sources & their keys, normal matrices are computed afterwards
+	uint32_t source_head = 0;
+	uint32_t matrix_head = 0;
+	uint32_t bound_head = 0;
+	auto add_matrices = [&]( const glm::mat4* matrices, size_t count )
+	{
+		glm::mat4* normals = &normal_matrices[matrix_head];
+		for ( size_t i = 0; i < count; i++ )
+		{
+			model_matrices[matrix_head++] = &matrices[i];
+		}
+		return normals;
+	};
+	auto add_draw = [&]( const VulkanMesh& mesh, const glm::mat4* matrices, const glm::mat4* normals, uint32_t count )
+	{
+		//  instances of a draw are not sorted, the first one stands for all
+		float depth = -( Matrices.View * matrices[0][3] ).z;
+		uint32_t material = TextureDescriptorIndices[mesh.get_texture_id()];
+
+		//  pipelines are variants per vertex layout, geometries the index types
+		//  the geometry buffer is bound with
+		uint32_t pipeline_id = (uint32_t)mesh.get_vertex_layout();
+		uint32_t geometry_id = mesh.get_index_type() == vk::IndexType::eUint16 ? 1 : 0;
+		items[source_head].Key = make_draw_key( pipeline_id, geometry_id, material, depth );
+		items[source_head].Value = source_head;
+		sources[source_head++] = DrawSource { &mesh, matrices, normals, count, bound_head, 0, {} };
+		bound_head += count;
+	};
+	for ( const auto& mesh : Meshes )
+	{
+		const glm::mat4* matrices = &mesh.get_instance_matrix( 0 );
+		const glm::mat4* normals = add_matrices( matrices, mesh.get_instance_count() );
+		add_draw( mesh, matrices, normals, (uint32_t)mesh.get_instance_count() );
+	}
+	for ( auto& model : MeshModels )
+	{
+		//  meshes of a model share its matrices, but not their material
+		const glm::mat4* matrices = &model.get_instance_matrix( 0 );
+		const glm::mat4* normals = add_matrices( matrices, model.get_instance_count() );
+		for ( size_t k = 0; k < model.get_mesh_count(); k++ )
+		{
+			add_draw( *model.get_mesh( k ), matrices, normals, (uint32_t)model.get_instance_count() );
+		}
+	}
+
+	Jobs.parallel_for( matrix_count, MIN_DRAWS_PER_BUILD_JOB, [&]( uint32_t begin, uint32_t end, uint32_t thread_index )
+	{
+		for ( uint32_t i = begin; i < end; i++ )
+		{
+			normal_matrices[i] = glm::transpose( glm::inverse( *model_matrices[i] ) );
+		}
+	} );
+
+	//  cull instances against the view frustum & select their level of detail,
+	//  hidden ones are not written and their draws keep their command with fewer
+	//  or no instances; with GPU culling, every instance is given to the culling
+	//  shader instead, and every level has room for all of them
+	Frustum frustum = Frustum::from_matrix( Matrices.Projection * Matrices.View );
+	float lod_error_scale = get_lod_error_scale();
+	Jobs.parallel_for( source_count, MIN_DRAWS_PER_BUILD_JOB, [&]( uint32_t begin, uint32_t end, uint32_t thread_index )
+	{
+		if ( UseGpuCulling )
+		{
+			for ( uint32_t i = begin; i < end; i++ )
+			{
+				for ( size_t l = 0; l < sources[i].Mesh->get_lod_count(); l++ )
+				{
+					sources[i].VisibleCounts[l] = sources[i].InstanceCount;
+				}
+			}
+			return;
+		}
+
+		for ( uint32_t i = begin; i < end; i++ )
+		{
+			DrawSource& source = sources[i];
+			const MeshBounds& bounds = source.Mesh->get_bounds();
+			for ( uint32_t k = 0; k < source.InstanceCount; k++ )
+			{
+				const glm::mat4& matrix = source.ModelMatrices[k];
+				glm::vec3 center = glm::vec3( matrix * glm::vec4( bounds.Center, 1.0f ) );
+				float scale = std::max( glm::length( glm::vec3( matrix[0] ) ), 
+					std::max( glm::length( glm::vec3( matrix[1] ) ), glm::length( glm::vec3( matrix[2] ) ) ) );
+
+				uint32_t bound = source.FirstBound + k;
+				bound_xs[bound] = center.x;
+				bound_ys[bound] = center.y;
+				bound_zs[bound] = center.z;
+				bound_radii[bound] = bounds.Radius * scale;
+
+				//  error allowed at the nearest point of the sphere, back in mesh space
+				float distance = std::max( -( Matrices.View * glm::vec4( center, 1.0f ) ).z - bound_radii[bound], 0.0f );
+				instance_lods[bound] = (uint8_t)source.Mesh->select_lod( distance * lod_error_scale / scale );
+			}
+		}
+
+		//  instances of consecutive sources are contiguous
+		uint32_t first_bound = sources[begin].FirstBound;
+		uint32_t bound_count = sources[end - 1].FirstBound + sources[end - 1].InstanceCount - first_bound;
+		cull_spheres( 
+			frustum, 
+			bound_xs + first_bound, 
+			bound_ys + first_bound, 
+			bound_zs + first_bound, 
+			bound_radii + first_bound, 
+			bound_count, 
+			visible + first_bound 
 		);
 
+		for ( uint32_t i = begin; i < end; i++ )
+		{
+			DrawSource& source = sources[i];
+			for ( uint32_t k = 0; k < source.InstanceCount; k++ )
+			{
+				uint32_t bound = source.FirstBound + k;
+				source.VisibleCounts[instance_lods[bound]] += visible[bound];
+			}
+		}
+	} );
+
+	uint32_t visible_count = 0;
+	uint32_t triangle_count = 0;
+	for ( uint32_t i = 0; i < source_count; i++ )
+	{
+		for ( size_t l = 0; l < sources[i].Mesh->get_lod_count(); l++ )
+		{
+			visible_count += sources[i].VisibleCounts[l];
+			triangle_count += sources[i].VisibleCounts[l] * sources[i].Mesh->get_lod( l ).IndexCount / 3;
+		}
+	}
+
+	const RadixSortItem* sorted = radix_sort( items, sort_scratch, source_count );
+
+	//  the second phase of occlusion culling writes its commands & instances after the first one's
+	uint32_t phase_count = UseGpuCulling ? GpuCulling.get_phase_count() : 1;
+
+	//  the frame's previous draws are done, its buffers can be recreated bigger
+	if ( DrawBuffer.reserve( draw_count * phase_count, visible_count * phase_count ) )
+	{
+		//  recorded command buffers use the old buffers & descriptor
+		update_instance_descriptor( CurrentFrame );
+		list.RecordingID = 0;
+	}
+
+	//  culling inputs, and the counts draws read
+	if ( UseGpuCulling )
+	{
+		if ( GpuCulling.reserve( CurrentFrame, instance_count, draw_count, draw_count ) ) list.RecordingID = 0;
+		if ( GpuCulling.update_descriptors( CurrentFrame, DrawBuffer.get_instance_buffer(), DrawBuffer.get_indirect_buffer() ) ) list.RecordingID = 0;
+	}
+
+	uint32_t first_command = DrawBuffer.allocate_commands( draw_count * phase_count );
+	uint32_t instance_head = DrawBuffer.allocate_instances( visible_count * phase_count );
+	vk::DrawIndexedIndirectCommand* commands = DrawBuffer.get_commands();
+	MeshData* instances = DrawBuffer.get_instances<MeshData>();
+
+	//  place draws & instances in sorted order, levels of a source one after the
+	//  other, starting a new run whenever the bound state changes
+	uint32_t draw_head = 0;
+	for ( uint32_t i = 0; i < source_count; i++ )
+	{
+		DrawSource& source = sources[sorted[i].Value];
+		source.FirstDraw = draw_head;
+
+		uint32_t pipeline_id = (uint32_t)( sorted[i].Key >> 56 );
+		uint32_t geometry_id = (uint32_t)( sorted[i].Key >> 48 ) & 0xFF;
+		for ( size_t l = 0; l < source.Mesh->get_lod_count(); l++, draw_head++ )
+		{
+			first_instances[draw_head] = instance_head;
+			instance_head += source.VisibleCounts[l];
+
+			if ( run_count == 0
+			  || runs[run_count - 1].PipelineID != pipeline_id
+			  || runs[run_count - 1].GeometryID != geometry_id )
+			{
+				DrawRun run {};
+				run.PipelineID = pipeline_id;
+				run.GeometryID = geometry_id;
+				run.FirstCommand = first_command + draw_head;
+				runs[run_count++] = run;
+			}
+			runs[run_count - 1].CommandCount++;
+			draw_runs[draw_head] = run_count - 1;
+		}
+	}
+
+	//  write draws & every instance for the culling shader, which writes commands;
+	//  instances point at the first level of their source
+	if ( UseGpuCulling )
+	{
+		CullDraw* cull_draws = GpuCulling.get_draws( CurrentFrame );
+		MeshData* objects = GpuCulling.get_objects( CurrentFrame );
+		uint32_t* first_objects = arena.allocate_array<uint32_t>( source_count );
+		uint32_t object_head = 0;
+		for ( uint32_t i = 0; i < source_count; i++ )
+		{
+			first_objects[i] = object_head;
+			object_head += sources[sorted[i].Value].InstanceCount;
+		}
+
+		Jobs.parallel_for( source_count, MIN_DRAWS_PER_BUILD_JOB, [&]( uint32_t begin, uint32_t end, uint32_t thread_index )
+		{
+			for ( uint32_t i = begin; i < end; i++ )
+			{
+				const DrawSource& source = sources[sorted[i].Value];
+				const VulkanMesh& mesh = *source.Mesh;
+				const MeshBounds& bounds = mesh.get_bounds();
+
+				for ( size_t l = 0; l < mesh.get_lod_count(); l++ )
+				{
+					const VulkanMeshLOD& lod = mesh.get_lod( l );
+					uint32_t draw_idx = source.FirstDraw + (uint32_t)l;
+
+					CullDraw draw {};
+					draw.IndexCount = lod.IndexCount;
+					draw.FirstIndex = mesh.get_first_index() + lod.FirstIndex;
+					draw.VertexOffset = mesh.get_vertex_offset();
+					draw.FirstInstance = first_instances[draw_idx];
+					draw.RunIndex = draw_runs[draw_idx];
+					draw.CommandBase = runs[draw_runs[draw_idx]].FirstCommand;
+					draw.LODCount = (uint32_t)mesh.get_lod_count();
+					draw.LODError = lod.Error;
+					draw.Sphere = glm::vec4( bounds.Center, bounds.Radius );
+					cull_draws[draw_idx] = draw;
+				}
+
+				MeshData data {};
+				data.PositionOffset = mesh.get_position_offset();
+				data.PositionScale = mesh.get_position_scale();
+				data.MaterialIndex = TextureDescriptorIndices[mesh.get_texture_id()];
+				data.Flags = mesh.get_flags();
+				data.DrawIndex = source.FirstDraw;
+				for ( uint32_t k = 0; k < source.InstanceCount; k++ )
+				{
+					data.Model = source.ModelMatrices[k];
+					data.Normal = source.NormalMatrices[k];
+					objects[first_objects[i] + k] = data;
+				}
+			}
+		} );
+	}
+	//  write commands & instances straight into the mapped buffers
+	else Jobs.parallel_for( source_count, MIN_DRAWS_PER_BUILD_JOB, [&]( uint32_t begin, uint32_t end, uint32_t thread_index )
+	{
+		for ( uint32_t i = begin; i < end; i++ )
+		{
+			const DrawSource& source = sources[sorted[i].Value];
+			const VulkanMesh& mesh = *source.Mesh;
+
+			uint32_t instance_idxs[MAX_MESH_LODS];
+			for ( size_t l = 0; l < mesh.get_lod_count(); l++ )
+			{
+				const VulkanMeshLOD& lod = mesh.get_lod( l );
+				uint32_t draw_idx = source.FirstDraw + (uint32_t)l;
+
+				vk::DrawIndexedIndirectCommand command {};
+				command.indexCount = lod.IndexCount;
+				command.instanceCount = source.VisibleCounts[l];
+				command.firstIndex = mesh.get_first_index() + lod.FirstIndex;
+				command.vertexOffset = mesh.get_vertex_offset();
+				command.firstInstance = first_instances[draw_idx];
+				commands[first_command + draw_idx] = command;
+				instance_idxs[l] = first_instances[draw_idx];
+			}
+
+			MeshData data {};
+			data.PositionOffset = mesh.get_position_offset();
+			data.PositionScale = mesh.get_position_scale();
+			data.MaterialIndex = TextureDescriptorIndices[mesh.get_texture_id()];
+			data.Flags = mesh.get_flags();
+			for ( uint32_t k = 0; k < source.InstanceCount; k++ )
+			{
+				uint32_t bound = source.FirstBound + k;
+				if ( !visible[bound] ) continue;
+
+				data.Model = source.ModelMatrices[k];
+				data.Normal = source.NormalMatrices[k];
+				instances[instance_idxs[instance_lods[bound]]++] = data;
+			}
+		}
+	} );
+
+	//  recordings only depend on runs, not on what commands contain
+	if ( run_count != list.Runs.size() || !std::equal( runs, runs + run_count, list.Runs.begin() ) )
+	{
+		list.Runs.assign( runs, runs + run_count );
+		list.RecordingID = 0;
+	}
+
+	list.HasData = true;
+	list.SceneSignature = scene_signature;
+	list.View = Matrices.View;
+	list.CommandCount = draw_count;
+	list.ObjectCount = instance_count;
+	list.InstanceSlotCount = visible_count;
+	list.Stats.DrawCount = draw_count;
+	list.Stats.InstanceCount = instance_count;
+	list.Stats.VisibleInstanceCount = UseGpuCulling ? instance_count : visible_count;  //  every instance when culled on the GPU
+	list.Stats.TriangleCount = UseGpuCulling ? 0 : triangle_count;
+	list.Stats.IsDrawListCached = false;
+}
+
+float VulkanRenderer::get_lod_error_scale() const
+{
+	//  pixels covered by a unit at a unit of distance, along the height
+	float pixels_per_unit = std::abs( Matrices.Projection[1][1] ) * 0.5f * (float)SwapchainExtent.height;
+	return LODThreshold / pixels_per_unit;
+}
+
+uint64_t VulkanRenderer::get_scene_signature()
+{
+	//  versions only increase, so does their sum whichever changes
+	uint64_t signature = SceneVersion;
+	for ( const auto& mesh : Meshes )
+	{
+		signature += mesh.get_version();
+	}
+	for ( auto& model : MeshModels )
+	{
+		signature += model.get_version();
 		for ( size_t k = 0; k < model.get_mesh_count(); k++ )
 		{
-			VulkanMesh* mesh = model.get_mesh( k );
+			signature += model.get_mesh( k )->get_version();
+		}
+	}
+	return signature;
+}
 
-			//  bind vertex buffer
-			vk::Buffer vertex_buffers[] = { mesh->get_vertex_buffer() };
-			vk::DeviceSize offsets[] = { 0 };
-			buffer.bindVertexBuffers( 0, 1, vertex_buffers, offsets );
+void VulkanRenderer::invalidate_recordings()
+{
+	for ( auto& list : FrameDrawLists )
+	{
+		list.RecordingID = 0;
+	}
+}
+void VulkanRenderer::record_draw_range( vk::CommandBuffer buffer, uint32_t phase, uint32_t first_command, uint32_t command_count, VulkanFrameStats* stats )
+{
+	//  runs are sorted by state, only bind what differs from the previous run;
+	//  a secondary command buffer inherits no state, the first run binds everything
+	const vk::IndexType index_types[] = { vk::IndexType::eUint32, vk::IndexType::eUint16 };
+	uint32_t bound_pipeline = UINT32_MAX;
+	uint32_t bound_geometry = UINT32_MAX;
+	uint32_t end_command = first_command + command_count;
+	const FrameDrawList& list = FrameDrawLists[CurrentFrame];
+	const std::vector<DrawRun>& runs = list.Runs;
+	for ( uint32_t run_idx = 0; run_idx < (uint32_t)runs.size(); run_idx++ )
+	{
+		const DrawRun& run = runs[run_idx];
+		uint32_t begin = std::max( run.FirstCommand, first_command );
+		uint32_t end = std::min( run.FirstCommand + run.CommandCount, end_command );
 
-			//  bind index buffer
-			buffer.bindIndexBuffer( mesh->get_index_buffer(), 0, vk::IndexType::eUint32 );
+		//  with GPU culling, the command count of a run is only known by the GPU:
+		//  the range holding its first command draws all of it
+		if ( UseGpuCulling )
+		{
+			if ( run.FirstCommand < first_command || run.FirstCommand >= end_command ) continue;
+			begin = run.FirstCommand;
+			end = run.FirstCommand + run.CommandCount;
+		}
+		if ( begin >= end ) continue;
 
-			//  bind descriptor sets
-			std::array<vk::DescriptorSet, 2> descriptor_sets
+		if ( run.PipelineID != bound_pipeline )
+		{
+			buffer.bindPipeline( vk::PipelineBindPoint::eGraphics, GraphicsPipelines[run.PipelineID] );
+			stats->PipelineBinds++;
+
+			//  descriptor sets stay bound across pipelines with a compatible layout
+			if ( bound_pipeline == UINT32_MAX )
 			{
-				DescriptorSets[image_idx],
-				SamplerDescriptorSets[mesh->get_texture_id()],
-			};
-			buffer.bindDescriptorSets(
-				vk::PipelineBindPoint::eGraphics,
-				PipelineLayout,
-				0,
-				(uint32_t)descriptor_sets.size(),
-				descriptor_sets.data(),
-				0,
-				nullptr
-			);
+				//  bind this frame's uniforms & instances, at their offset inside the uniform ring
+				buffer.bindDescriptorSets(
+					vk::PipelineBindPoint::eGraphics,
+					PipelineLayout,
+					0,
+					1,
+					&UniformDescriptorSets[CurrentFrame],
+					1,
+					&ViewProjOffset
+				);
+
+				//  every texture, selected by shaders with the material index of instances
+				buffer.bindDescriptorSets(
+					vk::PipelineBindPoint::eGraphics,
+					PipelineLayout,
+					1,
+					1,
+					&TextureDescriptorSet,
+					0,
+					nullptr
+				);
+				stats->DescriptorSetBinds += 2;
+			}
+			bound_pipeline = run.PipelineID;
+		}
 
-			//  execute pipeline
-			buffer.drawIndexed(
-				(uint32_t)mesh->get_index_count(),
-				1, 0, 0, 0
+		//  meshes live in the shared geometry buffer, whose index buffer
+		//  is bound again for each index type
+		if ( run.GeometryID != bound_geometry )
+		{
+			if ( bound_geometry == UINT32_MAX )
+			{
+				vk::Buffer vertex_buffers[] = { GeometryBuffer.get_vertex_buffer() };
+				vk::DeviceSize offsets[] = { 0 };
+				buffer.bindVertexBuffers( 0, vertex_buffers, offsets );
+				stats->VertexBufferBinds++;
+			}
+			buffer.bindIndexBuffer( GeometryBuffer.get_index_buffer(), 0, index_types[run.GeometryID] );
+			stats->IndexBufferBinds++;
+			bound_geometry = run.GeometryID;
+		}
+
+		//  commands of a phase follow those of the previous one
+		if ( UseGpuCulling )
+		{
+			CmdDrawIndexedIndirectCount(
+				static_cast<VkCommandBuffer>( buffer ),
+				static_cast<VkBuffer>( DrawBuffer.get_indirect_buffer() ),
+				( (vk::DeviceSize)run.FirstCommand + phase * list.CommandCount ) * VulkanDrawBuffer::get_indirect_stride(),
+				static_cast<VkBuffer>( GpuCulling.get_count_buffer( CurrentFrame ) ),
+				VulkanGpuCulling::get_run_count_offset( phase, run_idx, (uint32_t)runs.size(), list.CommandCount ),
+				run.CommandCount,
+				VulkanDrawBuffer::get_indirect_stride()
 			);
+			stats->DrawCalls++;
+		}
+		else
+		{
+			record_indirect_draws( buffer, begin, end - begin, stats );
 		}
 	}
+}
 
-	// Draw 3 vertices, 1 instance, with no offset. Instance allow you
-	// to draw several instances with one draw call.
-	//buffer.draw( 3, 1, 0, 0 );
+void VulkanRenderer::record_indirect_draws( vk::CommandBuffer buffer, uint32_t first_command, uint32_t command_count, VulkanFrameStats* stats )
+{
+	uint32_t stride = VulkanDrawBuffer::get_indirect_stride();
+	vk::DeviceSize offset = (vk::DeviceSize)first_command * stride;
 
-	// End render pass
-	buffer.endRenderPass();
-	// Stop recordind to command buffer
-	buffer.end();
+	//  split in calls of at most maxDrawIndirectCount commands, which is 1 without multi-draw
+	while ( command_count > 0 )
+	{
+		uint32_t count = std::min( command_count, MaxDrawIndirectCount );
+		buffer.drawIndexedIndirect( DrawBuffer.get_indirect_buffer(), offset, count, stride );
+		stats->DrawCalls++;
+
+		offset += (vk::DeviceSize)count * stride;
+		command_count -= count;
+	}
+}
+
+vk::CommandBuffer VulkanRenderer::record_culling()
+{
+	const FrameDrawList& list = FrameDrawLists[CurrentFrame];
+	glm::mat4 view_projection = Matrices.Projection * Matrices.View;
+	return GpuCulling.record(
+		CurrentFrame,
+		Frustum::from_matrix( view_projection ),
+		view_projection,
+		get_lod_error_scale(),
+		FrameNumber > 0,  //  every frame builds the pyramid the next one tests against
+		list.ObjectCount,
+		list.InstanceSlotCount,
+		list.CommandCount,
+		(uint32_t)list.Runs.size()
+	);
+}
+
+vk::CommandBuffer VulkanRenderer::acquire_secondary_command_buffer( uint32_t thread_index )
+{
+	RecordingPool& pool = RecordingPools[CurrentFrame * Jobs.get_thread_count() + thread_index];
+
+	//  only this thread uses the pool during the frame, allocate without locking
+	if ( pool.UsedCount == pool.Buffers.size() )
+	{
+		vk::CommandBufferAllocateInfo alloc_info {};
+		alloc_info.commandPool = pool.Pool;
+		alloc_info.commandBufferCount = 1;
+		alloc_info.level = vk::CommandBufferLevel::eSecondary;
+
+		pool.Buffers.push_back( MainDevices.Logical.allocateCommandBuffers( alloc_info )[0] );
+	}
+
+	return pool.Buffers[pool.UsedCount++];
 }
 
 bool VulkanRenderer::check_instance_extensions_support( const std::vector<const char*>& extensions )
@@ -1700,7 +2840,6 @@ void VulkanRenderer::retrieve_physical_device()
 
 			//  store properties
 			vk::PhysicalDeviceProperties properties = device.getProperties();
-			MinUniformBufferOffset = properties.limits.minUniformBufferOffsetAlignment;
 
 			//  get MSAA samples
 			auto counts = properties.limits.framebufferColorSampleCounts & properties.limits.framebufferDepthSampleCounts;
@@ -1722,9 +2861,20 @@ bool VulkanRenderer::check_device_suitable( const vk::PhysicalDevice& device )
 	vk::PhysicalDeviceProperties properties = device.getProperties();
 	vk::PhysicalDeviceFeatures features = device.getFeatures();
 	if ( !features.samplerAnisotropy ) return false;
+	//  instance data is indexed by the first instance of indirect commands
+	if ( !features.drawIndirectFirstInstance ) return false;
 
 	if ( !check_device_extension_support( device ) ) return false;
 
+	//  textures are selected from an array indexed per instance
+	auto features2 = device.getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceDescriptorIndexingFeaturesEXT>();
+	const auto& descriptor_indexing = features2.get<vk::PhysicalDeviceDescriptorIndexingFeaturesEXT>();
+	if ( !descriptor_indexing.runtimeDescriptorArray 
+	  || !descriptor_indexing.descriptorBindingPartiallyBound
+	  || !descriptor_indexing.descriptorBindingSampledImageUpdateAfterBind
+	  || !descriptor_indexing.descriptorBindingUpdateUnusedWhilePending
+	  || !descriptor_indexing.shaderSampledImageArrayNonUniformIndexing ) return false;
+
 	VulkanSwapchainDetails details = get_swapchain_details( device );
 	if ( !details.is_valid() ) return false;
 
@@ -1732,6 +2882,16 @@ bool VulkanRenderer::check_device_suitable( const vk::PhysicalDevice& device )
 	return indices.is_valid();
 }
 
+bool VulkanRenderer::is_device_extension_enabled( const char* name ) const
+{
+	for ( const auto& extension : EnabledDeviceExtensions )
+	{
+		if ( strcmp( extension, name ) == 0 ) return true;
+	}
+
+	return false;
+}
+
 bool VulkanRenderer::check_device_extension_support( const vk::PhysicalDevice& device )
 {
 	std::vector<vk::ExtensionProperties> properties = device.enumerateDeviceExtensionProperties();
@@ -1754,70 +2914,17 @@ bool VulkanRenderer::check_device_extension_support( const vk::PhysicalDevice& d
 	return true;
 }
 
-void VulkanRenderer::update_uniform_buffers( uint32_t image_idx )
+void VulkanRenderer::update_uniform_buffers()
 {
-	//  copy view proj data
-	void* data;
-	MainDevices.Logical.mapMemory( 
-		ViewProjUniformBuffersMemory[image_idx], 
-		{}, 
-		sizeof( ViewProjection ), 
-		{}, 
-		&data 
-	);
-	memcpy( data, &Matrices, sizeof( ViewProjection ) );
-	MainDevices.Logical.unmapMemory( ViewProjUniformBuffersMemory[image_idx] );
+	//  the draw fence of the current frame was waited on, its region is free
+	UniformRing.begin_frame( CurrentFrame );
 
-	//  copy model data
-	/*for ( size_t i = 0; i < Meshes.size(); i++ )
-	{
-		MeshData* model = (MeshData*)( (uint64_t)ModelTransferSpace + i * ModelUniformAlignement );
-		*model = Meshes[i].get_mesh_data();
-	}
-	MainDevices.Logical.mapMemory(
-		ModelUniformDynBuffersMemory[image_idx],
-		{},
-		ModelUniformAlignement * Meshes.size(),
-		{},
-		&data
-	);
-	memcpy( data, &ModelTransferSpace, ModelUniformAlignement * Meshes.size() );
-	MainDevices.Logical.unmapMemory( ModelUniformDynBuffersMemory[image_idx] );*/
+	//  copy view proj data, the ring memory stays mapped
+	ViewProjOffset = UniformRing.push( Matrices );
 }
 
-void VulkanRenderer::allocate_dynamic_buffer_transfer_space()
-{
-	// modelUniformAlignement = sizeof(Model) & ~(minUniformBufferOffet - 1);
-
-	// We take the size of Model and we compare its size to a mask.
-	// ~(minUniformBufferOffet - 1) is the inverse of minUniformBufferOffet
-	// Example with a 16bits alignment coded on 8 bits:
-	//   00010000 - 1  == 00001111
-	// ~(00010000 - 1) == 11110000 which is our mask.
-	// If we imagine our UboModel is 64 bits (01000000)
-	// and the minUniformBufferOffet 16 bits (00010000),
-	// (01000000) & ~(00010000 - 1) == 01000000 & 11110000 == 01000000
-	// Our alignment will need to be 64 bits.
-
-	// However this calculation is not perfect.
-
-	// Let's now imagine our UboModel is 66 bits : 01000010.
-	// The above calculation would give us a 64 bits alignment,
-	// whereas we would need a 80 bits (01010000 = 64 + 16) alignment.
-
-	// We need to add to the size minUniformBufferOffet - 1 to shield against this effect
-	ModelUniformAlignement =
-		( sizeof( MeshData ) + MinUniformBufferOffset - 1 ) 
-		& ~( MinUniformBufferOffset - 1 );
 
-	// We will now allocate memory for models.
-	ModelTransferSpace = (MeshData*)_aligned_malloc(
-		ModelUniformAlignement * MAX_OBJECTS, 
-		ModelUniformAlignement
-	);
-}
-
-stbi_uc* VulkanRenderer::load_texture_file( const std::string& file, int* width, int* height, vk::DeviceSize* image_size )
+stbi_uc* VulkanRenderer::load_texture_file( const std::string& file, int* width, int* height, vk::DeviceSize* image_size ) const
 {
 	int channels;
 
@@ -1946,5 +3053,30 @@ VulkanQueueFamilyIndices VulkanRenderer::get_queue_families( const vk::PhysicalD
 		if ( indices.is_valid() ) break;
 	}
 
+	//  a transfer-only family is usually backed by DMA engines, which copy
+	//  without taking time from the graphics queue; then try one without graphics
+	int transfer_score = 0;
+	for ( int i = 0; i < queue_families.size(); i++ )
+	{
+		const auto& queue_family = queue_families[i];
+		if ( queue_family.queueCount == 0 ) continue;
+		if ( queue_family.queueFlags & vk::QueueFlagBits::eGraphics ) continue;
+		//  compute families support transfers even when not reporting it
+		if ( !( queue_family.queueFlags & ( vk::QueueFlagBits::eTransfer | vk::QueueFlagBits::eCompute ) ) ) continue;
+
+		int score = ( queue_family.queueFlags & vk::QueueFlagBits::eCompute ) ? 1 : 2;
+		if ( score > transfer_score )
+		{
+			indices.TransferFamily = i;
+			transfer_score = score;
+		}
+	}
+
+	//  fallback on the graphics queue
+	if ( indices.TransferFamily < 0 )
+	{
+		indices.TransferFamily = indices.GraphicsFamily;
+	}
+
 	return indices;
 }
\ No newline at end of file
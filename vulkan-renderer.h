@@ -1,5 +1,7 @@
 #pragma once
 
+#include <deque>
+
 #include <vulkan/vulkan.hpp>
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
@@ -10,9 +12,22 @@
 #include <assimp/postprocess.h>
 
 #include "math-utils.hpp"
+#include "linear-arena.h"
+#include "job-system.h"
+#include "radix-sort.h"
+#include "frustum-culler.h"
 #include "vulkan-utils.hpp"
+#include "vulkan-memory-allocator.h"
+#include "vulkan-staging-ring.h"
+#include "vulkan-upload-context.h"
+#include "vulkan-geometry-buffer.h"
+#include "vulkan-uniform-ring.h"
+#include "vulkan-draw-buffer.h"
+#include "vulkan-depth-pyramid.h"
+#include "vulkan-gpu-culling.h"
 #include "vulkan-mesh.h"
 #include "vulkan-mesh-model.h"
+#include "mesh-cache.h"
 
 struct ViewProjection
 {
@@ -20,6 +35,35 @@ struct ViewProjection
 	glm::mat4 Projection;
 };
 
+//  what the last recorded frame cost, in commands & state changes
+struct VulkanFrameStats
+{
+	uint32_t DrawCount = 0;  //  indirect commands
+	uint32_t InstanceCount = 0;
+	uint32_t VisibleInstanceCount = 0;  //  left after culling
+	uint32_t TriangleCount = 0;  //  of visible instances at their level of detail, CPU culling only
+	uint32_t DrawCalls = 0;  //  (multi-)draw calls recorded
+	uint32_t PipelineBinds = 0;
+	uint32_t VertexBufferBinds = 0;
+	uint32_t IndexBufferBinds = 0;
+	uint32_t DescriptorSetBinds = 0;
+
+	bool IsDrawListCached = false;  //  frame's buffers reused as they were
+	bool IsRecordingCached = false;  //  secondary command buffers reused as they were
+
+	uint32_t get_bind_count() const { return PipelineBinds + VertexBufferBinds + IndexBufferBinds + DescriptorSetBinds; }
+};
+
+//  pixels of a texture file, decoded on a job thread ahead of its upload
+struct DecodedTexture
+{
+	stbi_uc* Pixels = nullptr;
+	int Width = 0;
+	int Height = 0;
+	vk::DeviceSize Size = 0;
+	uint32_t MipLevels = 1;  //  generated on the GPU from the first one
+};
+
 class VulkanRenderer
 {
 public:
@@ -36,8 +80,25 @@ public:
 		std::vector<uint32_t>* indices,
 		int texture_id
 	);
+	//  import a model, or load it from its mesh cache when up to date
 	VulkanMeshModel* create_mesh_model( const std::string& file );
 	void update_model( int id, glm::mat4 matrix );
+	//  draw a mesh once more at another place, in the same instanced draw
+	int add_mesh_instance( int id, glm::mat4 matrix );
+	void update_mesh_instance( int id, int instance_id, glm::mat4 matrix );
+
+	//  print device memory usage per heap & category, and the biggest resources
+	void print_memory_report();
+	const VulkanFrameStats& get_frame_stats() const { return FrameStats; }
+
+	//  screen error of levels of detail, in pixels: instances are drawn with the
+	//  coarsest level whose surface moved less than this once projected
+	void set_lod_threshold( float pixels ) { LODThreshold = pixels; SceneVersion++; }
+	float get_lod_threshold() const { return LODThreshold; }
+
+	//  vertex layout of models loaded from now on, Compact by default
+	void set_import_vertex_layout( VulkanVertexLayout layout ) { ImportVertexLayout = layout; }
+	VulkanVertexLayout get_import_vertex_layout() const { return ImportVertexLayout; }
 
 private:
 	GLFWwindow* Window;
@@ -49,11 +110,26 @@ private:
 	std::vector<VulkanSwapchainImage> SwapchainImages;
 	std::vector<vk::Framebuffer> SwapchainFrameBuffers;
 
-	vk::Pipeline GraphicsPipeline;
+	vk::Pipeline GraphicsPipelines[(size_t)VulkanVertexLayout::Count];  //  per vertex layout
 	vk::CommandPool GraphicsCommandPool;
-	std::vector<vk::CommandBuffer> CommandBuffers;
+	std::vector<vk::CommandBuffer> CommandBuffers;  //  [image * MAX_FRAME_DRAWS + frame]
+	std::vector<uint64_t> CommandBufferRecordingIDs;  //  secondaries each primary executes
+
+	//  draws are recorded by job threads into secondary command buffers,
+	//  from a pool per thread & frame in flight as pools are not thread safe
+	struct RecordingPool
+	{
+		vk::CommandPool Pool;
+		std::vector<vk::CommandBuffer> Buffers;
+		uint32_t UsedCount = 0;
+	};
+	std::vector<RecordingPool> RecordingPools;  //  [frame * thread count + thread]
+	JobSystem Jobs;
+	const uint32_t MIN_DRAWS_PER_RECORDING_JOB = 256;
+	const uint32_t MIN_DRAWS_PER_BUILD_JOB = 512;
 	vk::PipelineLayout PipelineLayout;
 	vk::RenderPass RenderPass;
+	vk::RenderPass SecondPhaseRenderPass;  //  loads what RenderPass drew, with occlusion culling
 
 	std::vector<vk::Semaphore> ImageAvailableSemaphores;
 	std::vector<vk::Semaphore> RenderFinishedSemaphores;
@@ -61,58 +137,162 @@ private:
 
 	vk::Queue GraphicsQueue;
 	vk::Queue PresentationQueue;
+	vk::Queue TransferQueue;
 
 	ViewProjection Matrices;
 	std::vector<VulkanMesh> Meshes;
 	std::vector<VulkanMeshModel> MeshModels;
 	vk::DescriptorPool ViewProjDescriptorPool;
 	vk::DescriptorSetLayout DescriptorSetLayout;
-	std::vector<vk::DescriptorSet> DescriptorSets;
-
-	std::vector<vk::Buffer> ViewProjUniformBuffers;
-	std::vector<vk::DeviceMemory> ViewProjUniformBuffersMemory;
+	std::vector<vk::DescriptorSet> UniformDescriptorSets;  //  per frame in flight
+
+	VulkanUniformRing UniformRing;
+	const vk::DeviceSize UNIFORM_RING_FRAME_SIZE = 256 * 1024;
+	uint32_t ViewProjOffset = 0;
+
+	//  indirect commands & instances data, rebuilt every frame
+	VulkanDrawBuffer DrawBuffer;
+	const uint32_t INITIAL_DRAW_CAPACITY = 1024;  //  grows as needed
+	uint32_t MaxDrawIndirectCount = 1;
+
+	//  culling & draw generation on the GPU when the device can draw a count of
+	//  commands read from a buffer, frustum culling on the CPU otherwise
+	VulkanGpuCulling GpuCulling;
+	bool UseGpuCulling = false;
+	PFN_vkCmdDrawIndexedIndirectCountKHR CmdDrawIndexedIndirectCount = nullptr;
+
+	//  levels of detail of meshes, selected per instance as they are culled
+	float LODThreshold = 1.0f;
+
+	//  occlusion culling against a pyramid of the depth buffer, on top of GPU culling
+	//  when the depth buffer can be sampled; draws then take two render passes
+	VulkanDepthPyramid DepthPyramid;
+	bool UseOcclusionCulling = false;
+
+	//  Draws are sorted by 64-bit keys, most significant state first, so that
+	//  draws sharing a pipeline & geometry buffers form one run recorded without
+	//  rebinding anything.
+	struct DrawRun
+	{
+		uint32_t PipelineID = 0;
+		uint32_t GeometryID = 0;
+		uint32_t FirstCommand = 0;
+		uint32_t CommandCount = 0;
+
+		bool operator==( const DrawRun& other ) const
+		{
+			return PipelineID == other.PipelineID && GeometryID == other.GeometryID
+				&& FirstCommand == other.FirstCommand && CommandCount == other.CommandCount;
+		}
+	};
+
+	//  Draw data & recording of a frame in flight. Transforms only change the
+	//  data written into buffers, so command buffers are recorded again only
+	//  when runs change, and the data is not even rewritten if nothing changed.
+	struct FrameDrawList
+	{
+		bool HasData = false;
+		uint64_t SceneSignature = 0;  //  of the scene written into the frame's buffers
+		glm::mat4 View;
+		uint32_t CommandCount = 0;
+		uint32_t ObjectCount = 0;  //  instances given to GPU culling
+		uint32_t InstanceSlotCount = 0;  //  room of instances of a phase
+		std::vector<DrawRun> Runs;
+		VulkanFrameStats Stats;
+
+		uint64_t RecordingID = 0;  //  0 when secondary command buffers must be recorded
+		uint32_t RecordedViewProjOffset = 0;
+		std::vector<vk::CommandBuffer> SecondaryBuffers;
+		std::vector<vk::CommandBuffer> SecondPhaseBuffers;  //  draws of SecondPhaseRenderPass
+	};
+	std::vector<FrameDrawList> FrameDrawLists;
+	uint64_t RecordingCount = 0;
+	uint64_t SceneVersion = 0;  //  increased by changes made by the renderer (new meshes, moves..)
+	VulkanFrameStats FrameStats;
 
 	/*std::vector<vk::Buffer> ModelUniformDynBuffers;
 	std::vector<vk::DeviceMemory> ModelUniformDynBuffersMemory;*/
 
-	vk::PushConstantRange PushConstantRange;
-
 	//  color
 	vk::Image ColorImage;
-	vk::DeviceMemory ColorImageMemory;
+	VulkanAllocation ColorImageAllocation;
 	vk::ImageView ColorImageView;
 
 	//  depth
 	vk::Image DepthBufferImage;
 	vk::ImageView DepthBufferImageView;
-	vk::DeviceMemory DepthBufferImageMemory;
+	VulkanAllocation DepthBufferImageAllocation;
 	vk::Format DepthBufferFormat;
 
 	//  textures
+	const vk::Format TEXTURE_FORMAT = vk::Format::eR8G8B8A8Unorm;
+	const vk::ImageUsageFlags TEXTURE_USAGE = vk::ImageUsageFlagBits::eTransferDst 
+		| vk::ImageUsageFlagBits::eSampled | vk::ImageUsageFlagBits::eTransferSrc;
 	std::vector<vk::Image> TextureImages;
 	std::vector<vk::ImageView> TextureImageViews;
-	std::vector<vk::DeviceMemory> TextureImageMemories;
+	std::vector<VulkanAllocation> TextureImageAllocations;
+	std::vector<vk::Extent2D> TextureExtents;
+	std::vector<uint32_t> TextureMipLevels;
 
 	//  sampler
 	vk::SampleCountFlagBits MSAASamples { vk::SampleCountFlagBits::e1 };
 	vk::Sampler TextureSampler;
 	vk::DescriptorPool SamplerDescriptorPool;
 	vk::DescriptorSetLayout SamplerDescriptorSetLayout;
-	std::vector<vk::DescriptorSet> SamplerDescriptorSets;
+	vk::DescriptorSet TextureDescriptorSet;  //  array of every texture
+	std::vector<uint32_t> TextureDescriptorIndices;  //  slot of each texture in the array
+	std::vector<uint32_t> FreeTextureDescriptorIndices;
+	uint32_t TextureDescriptorCount = 0;
+	uint32_t MaxTextures = 0;  //  MAX_TEXTURES, or less if the device limits it
 
-	const int MAX_OBJECTS = 20;
-	vk::DeviceSize MinUniformBufferOffset;
-	size_t ModelUniformAlignement;
-	MeshData* ModelTransferSpace;
+	const uint32_t MAX_TEXTURES = 4096;
 
 	const int MAX_FRAME_DRAWS = 2;  //  should be less than SwapchainImages count
 	int CurrentFrame = 0;
 
+	//  transient CPU data of a frame (draw lists, copies, descriptor writes..),
+	//  reset once its draw fence has been waited on
+	std::vector<LinearArena> FrameArenas;
+	const size_t FRAME_ARENA_BLOCK_SIZE = 256 * 1024;
+
 	struct
 	{
 		vk::PhysicalDevice Physical;
 		vk::Device Logical;
 	} MainDevices;
+	std::vector<const char*> EnabledDeviceExtensions;
+
+	VulkanMemoryAllocator MemoryAllocator;
+	VulkanStagingRing StagingRing;
+	const vk::DeviceSize STAGING_RING_SIZE = 64 * 1024 * 1024;
+	VulkanUploadContext UploadContext;
+	VulkanGeometryBuffer GeometryBuffer;
+	const vk::DeviceSize GEOMETRY_VERTEX_BUFFER_SIZE = 64 * 1024 * 1024;
+	const vk::DeviceSize GEOMETRY_INDEX_BUFFER_SIZE = 32 * 1024 * 1024;
+	uint64_t FrameNumber = 0;  //  frames submitted, freed geometry is retired with it
+	//  layout models are imported into, Full keeps float vertices with colors
+	VulkanVertexLayout ImportVertexLayout = VulkanVertexLayout::Compact;
+
+	//  defragmentation, a few moves per frame; old resources are released once
+	//  every frame which could still use them is done
+	struct TextureMove
+	{
+		int TextureID = 0;
+		VulkanDefragmentationMove Move;
+		vk::Image OldImage;
+		vk::ImageView OldImageView;
+		uint32_t OldDescriptorIndex = 0;
+	};
+	struct DefragmentationBatch
+	{
+		VulkanUploadTicket Ticket;
+		uint64_t Frame = 0;  //  first frame using the moved resources
+		std::vector<TextureMove> TextureMoves;
+	};
+	std::deque<DefragmentationBatch> DefragmentationBatches;
+	uint32_t PendingTextureMoveCount = 0;
+	const vk::DeviceSize DEFRAGMENTATION_BYTES_PER_FRAME = 8 * 1024 * 1024;
+	const int MAX_PENDING_TEXTURE_MOVES = 4;
 
 	void create_instance();
 	void create_logical_device();
@@ -129,12 +309,14 @@ private:
 	void create_frame_buffers();
 	void create_graphics_command_pool();
 	void create_graphics_command_buffers();
+	void create_recording_pools();
 	void create_synchronisation();
 	void create_descriptor_pool();
 	void create_descriptor_set_layout();
 	void create_descriptor_sets();
+	void update_instance_descriptor( uint32_t frame );
+	void create_frame_arenas();
 	void create_uniform_buffers();
-	void create_push_constant_range();
 	void create_color_buffer_image();
 	void create_depth_buffer_image();
 	vk::ShaderModule create_shader_module( const std::vector<char>& code );
@@ -148,14 +330,70 @@ private:
 		vk::ImageTiling tiling,
 		vk::ImageUsageFlags use_flags,
 		vk::MemoryPropertyFlags prop_flags,
-		vk::DeviceMemory* image_memory
+		VulkanAllocation* image_allocation,
+		VulkanMemoryCategory category,
+		const std::string& name
+	);
+	//  image without memory, to be bound by the caller
+	vk::Image create_image_handle( 
+		uint32_t width,
+		uint32_t height,
+		uint32_t mip_levels,
+		vk::SampleCountFlagBits samples,
+		vk::Format format,
+		vk::ImageTiling tiling,
+		vk::ImageUsageFlags use_flags
 	);
-	int create_texture_image( const std::string& file, uint32_t* mip_levels );
+	//  load pixels & compute the mip count, safe to call from job threads
+	DecodedTexture decode_texture( const std::string& file ) const;
+	//  decode every distinct texture of files on job threads, each one into the
+	//  entry of its first occurrence; read them once the counter is done
+	void submit_texture_decoding( const std::vector<std::string>& files, std::vector<DecodedTexture>* textures, JobCounter* counter );
+	//  create the image of a decoded texture and record its upload, frees its pixels
+	int create_texture_image( const std::string& file, DecodedTexture* texture );
 	int create_texture( const std::string& file );
+	int create_texture( const std::string& file, DecodedTexture* texture );
+	std::vector<int> create_textures( const std::vector<std::string>& files );
+	//  upload textures decoded by submit_texture_decoding, in a single batch
+	std::vector<int> create_textures( const std::vector<std::string>& files, std::vector<DecodedTexture>* textures );
+	//  upload decoded textures of the materials & meshes, vertices laid out as vertex_layout
+	VulkanMeshModel* create_mesh_model(
+		const std::vector<std::string>& materials,
+		std::vector<DecodedTexture>* textures,
+		const std::vector<MeshCacheMesh>& meshes,
+		VulkanVertexLayout vertex_layout
+	);
 	void create_texture_sampler();
-	int create_texture_descriptor( vk::ImageView image_view );
+	//  write a texture into a free slot of the texture array, returns the slot
+	uint32_t create_texture_descriptor( vk::ImageView image_view );
+
+	//  compact device memory & geometry buffers a little, called once per frame
+	void defragment_memory();
+	TextureMove move_texture( vk::CommandBuffer command_buffer, const VulkanDefragmentationMove& move );
+	//  release resources left behind by moves, force once the device is idle
+	void retire_defragmentation_moves( bool force );
 
+	//  record the primary command buffer of the image, unless still up to date
 	void record_commands( uint32_t image_idx );
+	void record_secondary_command_buffers( FrameDrawList& list );
+	vk::CommandBuffer& get_command_buffer( uint32_t image_idx ) { return CommandBuffers[image_idx * MAX_FRAME_DRAWS + CurrentFrame]; }
+	//  error of a level of detail allowed per unit of distance from the camera,
+	//  in world space, for LODThreshold pixels
+	float get_lod_error_scale() const;
+	//  sum of the versions of the renderer & of every mesh, changes with any of them
+	uint64_t get_scene_signature();
+	void invalidate_recordings();
+	//  sort the frame's draws by state & depth, then write their indirect
+	//  commands & instances; skipped if the frame's buffers are up to date
+	void build_draw_list();
+	//  record draws of a range of sorted commands, binding the state of their runs;
+	//  phase 1 draws what the second phase of occlusion culling uncovered
+	void record_draw_range( vk::CommandBuffer buffer, uint32_t phase, uint32_t first_command, uint32_t command_count, VulkanFrameStats* stats );
+	void record_indirect_draws( vk::CommandBuffer buffer, uint32_t first_command, uint32_t command_count, VulkanFrameStats* stats );
+	//  culling of the current frame, submitted before its draws
+	vk::CommandBuffer record_culling();
+	//  next free secondary command buffer of this frame, for a job thread
+	vk::CommandBuffer acquire_secondary_command_buffer( uint32_t thread_index );
 
 	bool check_instance_extensions_support( const std::vector<const char*>& extensions );
 	bool check_validation_layer_support();
@@ -163,12 +401,12 @@ private:
 	void retrieve_physical_device();
 	bool check_device_suitable( const vk::PhysicalDevice& device );
 	bool check_device_extension_support( const vk::PhysicalDevice& device );
+	bool is_device_extension_enabled( const char* name ) const;
 	
-	void update_uniform_buffers( uint32_t image_idx );
-
-	void allocate_dynamic_buffer_transfer_space();
+	void update_uniform_buffers();
+	LinearArena& get_frame_arena() { return FrameArenas[CurrentFrame]; }
 
-	stbi_uc* load_texture_file( const std::string& path, int* width, int* height, vk::DeviceSize* image_size );
+	stbi_uc* load_texture_file( const std::string& path, int* width, int* height, vk::DeviceSize* image_size ) const;
 
 	VulkanSwapchainDetails get_swapchain_details( const vk::PhysicalDevice& device );
 	vk::SurfaceFormatKHR get_best_surface_format( const std::vector<vk::SurfaceFormatKHR>& formats );
@@ -0,0 +1,215 @@
+#include "vulkan-staging-ring.h"
+
+#include "vulkan-utils.hpp"
+
+void VulkanStagingRing::init( VulkanMemoryAllocator* allocator, vk::DeviceSize size )
+{
+	Allocator = allocator;
+	Device = allocator->get_device();
+	Size = size;
+
+	create_buffer(
+		Allocator,
+		Size,
+		vk::BufferUsageFlagBits::eTransferSrc,
+		vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
+		&Buffer,
+		&Allocation,
+		VulkanMemoryCategory::Staging,
+		"Staging ring"
+	);
+}
+
+void VulkanStagingRing::release()
+{
+	wait_idle();
+
+	//  temporaries which were never submitted
+	for ( auto& temporary : PendingTemporaries )
+	{
+		Device.destroyBuffer( temporary.Buffer );
+		Allocator->free( temporary.Allocation );
+	}
+	PendingTemporaries.clear();
+
+	for ( auto& fence : FreeFences )
+	{
+		Device.destroyFence( fence );
+	}
+	FreeFences.clear();
+
+	Device.destroyBuffer( Buffer );
+	Allocator->free( Allocation );
+}
+
+VulkanStagingRegion VulkanStagingRing::allocate( vk::DeviceSize size, vk::DeviceSize alignment )
+{
+	VulkanStagingRegion region {};
+	region.Size = size;
+
+	//  too big for the ring, use a one-off buffer released with the next submission
+	if ( size > Size )
+	{
+		TemporaryBuffer temporary {};
+		create_buffer(
+			Allocator,
+			size,
+			vk::BufferUsageFlagBits::eTransferSrc,
+			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
+			&temporary.Buffer,
+			&temporary.Allocation,
+			VulkanMemoryCategory::Staging,
+			"Staging temporary"
+		);
+		PendingTemporaries.push_back( temporary );
+
+		region.Buffer = temporary.Buffer;
+		region.Offset = 0;
+		region.MappedData = temporary.Allocation.MappedData;
+		return region;
+	}
+
+	reclaim();
+
+	//  wait for the oldest submissions until there is enough space
+	vk::DeviceSize offset;
+	while ( !try_allocate( size, alignment, &offset ) )
+	{
+		if ( Submissions.empty() )
+		{
+			throw std::runtime_error( "Staging ring is full of unsubmitted uploads" );
+		}
+
+		Submission& submission = Submissions.front();
+		Device.waitForFences( submission.Fence, VK_TRUE, std::numeric_limits<uint64_t>::max() );
+		retire( submission );
+		Submissions.pop_front();
+	}
+
+	region.Buffer = Buffer;
+	region.Offset = offset;
+	region.MappedData = (char*)Allocation.MappedData + offset;
+	return region;
+}
+
+vk::Fence VulkanStagingRing::acquire_fence()
+{
+	Submission submission {};
+	submission.End = Head;
+	submission.Bytes = PendingBytes;
+	submission.Temporaries = std::move( PendingTemporaries );
+	PendingBytes = 0;
+	PendingTemporaries.clear();
+
+	//  recycle a fence of a finished submission
+	if ( !FreeFences.empty() )
+	{
+		submission.Fence = FreeFences.back();
+		FreeFences.pop_back();
+	}
+	else
+	{
+		submission.Fence = Device.createFence( vk::FenceCreateInfo {} );
+	}
+
+	Submissions.push_back( std::move( submission ) );
+	SubmissionCount++;
+	return Submissions.back().Fence;
+}
+
+bool VulkanStagingRing::is_complete( uint64_t submission )
+{
+	reclaim();
+	return submission <= RetiredCount;
+}
+
+void VulkanStagingRing::wait( uint64_t submission )
+{
+	while ( RetiredCount < submission && !Submissions.empty() )
+	{
+		Submission& front = Submissions.front();
+		Device.waitForFences( front.Fence, VK_TRUE, std::numeric_limits<uint64_t>::max() );
+		retire( front );
+		Submissions.pop_front();
+	}
+}
+
+void VulkanStagingRing::reclaim()
+{
+	//  submissions complete in order on a queue, stop at the first pending one
+	while ( !Submissions.empty() )
+	{
+		Submission& submission = Submissions.front();
+		if ( Device.getFenceStatus( submission.Fence ) != vk::Result::eSuccess ) break;
+
+		retire( submission );
+		Submissions.pop_front();
+	}
+}
+
+void VulkanStagingRing::wait_idle()
+{
+	wait( SubmissionCount );
+}
+
+bool VulkanStagingRing::try_allocate( vk::DeviceSize size, vk::DeviceSize alignment, vk::DeviceSize* offset )
+{
+	//  everything consumed, restart from the beginning
+	if ( UsedSize == 0 )
+	{
+		Head = 0;
+		Tail = 0;
+	}
+	else if ( Head == Tail )
+	{
+		//  ring is full
+		return false;
+	}
+
+	vk::DeviceSize aligned_head = ( Head + alignment - 1 ) / alignment * alignment;
+	vk::DeviceSize bytes;
+	if ( Head >= Tail )
+	{
+		//  free space is [Head, Size) then [0, Tail)
+		if ( aligned_head + size <= Size )
+		{
+			*offset = aligned_head;
+		}
+		//  wrap around, the end of the ring is wasted until consumed
+		else if ( size <= Tail )
+		{
+			*offset = 0;
+		}
+		else return false;
+	}
+	else
+	{
+		//  free space is [Head, Tail)
+		if ( aligned_head + size > Tail ) return false;
+		*offset = aligned_head;
+	}
+
+	//  account for padding and wasted space too
+	bytes = *offset >= Head ? *offset + size - Head : ( Size - Head ) + size;
+	Head = *offset + size;
+	UsedSize += bytes;
+	PendingBytes += bytes;
+
+	return true;
+}
+
+void VulkanStagingRing::retire( Submission& submission )
+{
+	UsedSize -= submission.Bytes;
+	Tail = submission.End;
+
+	for ( auto& temporary : submission.Temporaries )
+	{
+		Device.destroyBuffer( temporary.Buffer );
+		Allocator->free( temporary.Allocation );
+	}
+
+	Device.resetFences( submission.Fence );
+	FreeFences.push_back( submission.Fence );
+	RetiredCount++;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+
+#include <vulkan/vulkan.hpp>
+
+#include "vulkan-memory-allocator.h"
+
+struct VulkanStagingRegion
+{
+	vk::Buffer Buffer;
+	vk::DeviceSize Offset = 0;
+	vk::DeviceSize Size = 0;
+	void* MappedData = nullptr;
+};
+
+//  Persistently mapped host visible buffer which all uploads write into.
+//  Space is handed out in ring order and reclaimed once the fence of the
+//  submission which consumed it is signaled.
+class VulkanStagingRing
+{
+public:
+	void init( VulkanMemoryAllocator* allocator, vk::DeviceSize size );
+	void release();
+
+	//  reserve space for an upload, waits on older submissions if the ring is full;
+	//  uploads bigger than the whole ring fall back to a temporary buffer
+	VulkanStagingRegion allocate( vk::DeviceSize size, vk::DeviceSize alignment = 16 );
+
+	//  returns the fence the next queue submission must signal: space allocated
+	//  since the previous call is reclaimed once this fence is signaled
+	vk::Fence acquire_fence();
+
+	//  submissions are numbered from 1 in the order their fences were acquired
+	uint64_t get_submission_count() const { return SubmissionCount; }
+	bool is_complete( uint64_t submission );
+	void wait( uint64_t submission );
+
+	//  reclaim space of every finished submission, without waiting
+	void reclaim();
+	//  wait for every submission to finish
+	void wait_idle();
+
+	vk::DeviceSize get_size() const { return Size; }
+	vk::DeviceSize get_used_size() const { return UsedSize; }
+	vk::DeviceSize get_pending_size() const { return PendingBytes; }
+
+private:
+	struct TemporaryBuffer
+	{
+		vk::Buffer Buffer;
+		VulkanAllocation Allocation;
+	};
+
+	struct Submission
+	{
+		vk::Fence Fence;
+		vk::DeviceSize End = 0;  //  ring position after the submitted data
+		vk::DeviceSize Bytes = 0;  //  ring bytes owned, including padding
+		std::vector<TemporaryBuffer> Temporaries;
+	};
+
+	VulkanMemoryAllocator* Allocator = nullptr;
+	vk::Device Device;
+
+	vk::Buffer Buffer;
+	VulkanAllocation Allocation;
+	vk::DeviceSize Size = 0;
+
+	//  [Tail, Head) holds data not yet consumed by the GPU, wrapping around
+	vk::DeviceSize Head = 0;
+	vk::DeviceSize Tail = 0;
+	vk::DeviceSize UsedSize = 0;
+	vk::DeviceSize PendingBytes = 0;  //  bytes allocated since the last fence
+	std::vector<TemporaryBuffer> PendingTemporaries;
+
+	std::deque<Submission> Submissions;
+	std::vector<vk::Fence> FreeFences;
+	uint64_t SubmissionCount = 0;
+	uint64_t RetiredCount = 0;
+
+	bool try_allocate( vk::DeviceSize size, vk::DeviceSize alignment, vk::DeviceSize* offset );
+	void retire( Submission& submission );
+};
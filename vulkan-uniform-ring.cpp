@@ -0,0 +1,57 @@
+#include "vulkan-uniform-ring.h"
+
+#include <algorithm>
+
+#include "vulkan-utils.hpp"
+
+void VulkanUniformRing::init( VulkanMemoryAllocator* allocator, vk::DeviceSize frame_size, uint32_t frame_count )
+{
+	Allocator = allocator;
+
+	//  alignment is a power of two, so are the frame regions kept aligned
+	vk::PhysicalDeviceProperties properties = allocator->get_physical_device().getProperties();
+	Alignment = std::max<vk::DeviceSize>( properties.limits.minUniformBufferOffsetAlignment, 16 );
+	FrameSize = ( frame_size + Alignment - 1 ) & ~( Alignment - 1 );
+	FrameCount = frame_count;
+
+	create_buffer(
+		Allocator,
+		FrameSize * FrameCount,
+		vk::BufferUsageFlagBits::eUniformBuffer,
+		vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
+		&Buffer,
+		&Allocation,
+		VulkanMemoryCategory::Uniform,
+		"Uniform ring"
+	);
+
+	begin_frame( 0 );
+}
+
+void VulkanUniformRing::release()
+{
+	Allocator->get_device().destroyBuffer( Buffer );
+	Allocator->free( Allocation );
+}
+
+void VulkanUniformRing::begin_frame( uint32_t frame )
+{
+	FrameOffset = FrameSize * ( frame % FrameCount );
+	Head = FrameOffset;
+}
+
+VulkanUniformAllocation VulkanUniformRing::allocate( vk::DeviceSize size )
+{
+	vk::DeviceSize aligned_size = ( size + Alignment - 1 ) & ~( Alignment - 1 );
+	if ( Head + aligned_size > FrameOffset + FrameSize )
+	{
+		throw std::runtime_error( "Uniform ring is out of space for this frame" );
+	}
+
+	VulkanUniformAllocation allocation {};
+	allocation.Offset = (uint32_t)Head;
+	allocation.MappedData = (char*)Allocation.MappedData + Head;
+
+	Head += aligned_size;
+	return allocation;
+}
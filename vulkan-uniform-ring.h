@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstring>
+
+#include <vulkan/vulkan.hpp>
+
+#include "vulkan-memory-allocator.h"
+
+struct VulkanUniformAllocation
+{
+	uint32_t Offset = 0;  //  dynamic offset to bind the descriptor with
+	void* MappedData = nullptr;
+};
+
+//  Host visible uniform buffer mapped once at creation and split into one
+//  region per frame in flight. Each frame linearly sub-allocates its constants
+//  (camera, passes, objects) from its region, aligned on the device minimum
+//  offset alignment, and binds them with dynamic offsets.
+class VulkanUniformRing
+{
+public:
+	void init( VulkanMemoryAllocator* allocator, vk::DeviceSize frame_size, uint32_t frame_count );
+	void release();
+
+	//  start writing into the region of a frame, whose previous use must be done
+	void begin_frame( uint32_t frame );
+
+	VulkanUniformAllocation allocate( vk::DeviceSize size );
+	template <typename T>
+	uint32_t push( const T& data )
+	{
+		VulkanUniformAllocation allocation = allocate( sizeof( T ) );
+		memcpy( allocation.MappedData, &data, sizeof( T ) );
+		return allocation.Offset;
+	}
+
+	vk::Buffer get_buffer() const { return Buffer; }
+	vk::DeviceSize get_frame_size() const { return FrameSize; }
+	vk::DeviceSize get_used_size() const { return Head - FrameOffset; }
+
+private:
+	VulkanMemoryAllocator* Allocator = nullptr;
+
+	vk::Buffer Buffer;
+	VulkanAllocation Allocation;
+	vk::DeviceSize Alignment = 0;
+	vk::DeviceSize FrameSize = 0;
+	uint32_t FrameCount = 0;
+
+	vk::DeviceSize FrameOffset = 0;
+	vk::DeviceSize Head = 0;
+};
@@ -0,0 +1,310 @@
+#include "vulkan-upload-context.h"
+
+#include "vulkan-utils.hpp"
+
+//  every stage & access an uploaded resource may be used with afterwards
+static const vk::PipelineStageFlags UPLOAD_DST_STAGES = vk::PipelineStageFlagBits::eVertexInput
+	| vk::PipelineStageFlagBits::eVertexShader | vk::PipelineStageFlagBits::eFragmentShader
+	| vk::PipelineStageFlagBits::eTransfer;
+static const vk::AccessFlags UPLOAD_DST_ACCESS = vk::AccessFlagBits::eVertexAttributeRead
+	| vk::AccessFlagBits::eIndexRead | vk::AccessFlagBits::eUniformRead
+	| vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eTransferRead
+	| vk::AccessFlagBits::eTransferWrite;
+
+void VulkanUploadContext::init(
+	vk::PhysicalDevice physical_device,
+	vk::Device device,
+	VulkanStagingRing* staging_ring,
+	vk::Queue graphics_queue,
+	uint32_t graphics_family,
+	vk::Queue transfer_queue,
+	uint32_t transfer_family
+)
+{
+	PhysicalDevice = physical_device;
+	Device = device;
+	StagingRing = staging_ring;
+	GraphicsQueue = graphics_queue;
+	GraphicsFamily = graphics_family;
+	TransferQueue = transfer_queue;
+	TransferFamily = transfer_family;
+
+	//  command buffers are short-lived: recorded once and freed when done
+	vk::CommandPoolCreateInfo create_info {};
+	create_info.queueFamilyIndex = GraphicsFamily;
+	create_info.flags = vk::CommandPoolCreateFlagBits::eTransient;
+	GraphicsCommandPool = Device.createCommandPool( create_info );
+
+	if ( has_dedicated_transfer_queue() )
+	{
+		create_info.queueFamilyIndex = TransferFamily;
+		TransferCommandPool = Device.createCommandPool( create_info );
+	}
+	else
+	{
+		TransferCommandPool = GraphicsCommandPool;
+	}
+
+	printf( "Uploading on %s queue family %d\n", has_dedicated_transfer_queue() ? "transfer" : "graphics", TransferFamily );
+}
+
+void VulkanUploadContext::release()
+{
+	StagingRing->wait_idle();
+	free_completed_batches();
+
+	for ( auto& semaphore : FreeSemaphores )
+	{
+		Device.destroySemaphore( semaphore );
+	}
+	FreeSemaphores.clear();
+
+	if ( has_dedicated_transfer_queue() )
+	{
+		Device.destroyCommandPool( TransferCommandPool );
+	}
+	Device.destroyCommandPool( GraphicsCommandPool );
+}
+
+void VulkanUploadContext::begin()
+{
+	if ( IsRecording ) throw std::runtime_error( "Upload context is already recording" );
+
+	free_completed_batches();
+	begin_command_buffers();
+	IsRecording = true;
+}
+
+VulkanUploadTicket VulkanUploadContext::submit()
+{
+	if ( !IsRecording ) throw std::runtime_error( "Upload context is not recording" );
+
+	submit_command_buffers();
+	IsRecording = false;
+
+	VulkanUploadTicket ticket {};
+	ticket.Submission = StagingRing->get_submission_count();
+	return ticket;
+}
+
+bool VulkanUploadContext::is_complete( const VulkanUploadTicket& ticket )
+{
+	return StagingRing->is_complete( ticket.Submission );
+}
+
+void VulkanUploadContext::wait( const VulkanUploadTicket& ticket )
+{
+	StagingRing->wait( ticket.Submission );
+}
+
+void VulkanUploadContext::upload_buffer( const void* data, vk::DeviceSize size, vk::Buffer dst_buffer, vk::DeviceSize dst_offset )
+{
+	VulkanStagingRegion staging = stage( data, size );
+	record_copy_buffer( TransferCommandBuffer, staging.Buffer, staging.Offset, dst_buffer, dst_offset, size );
+
+	if ( !has_dedicated_transfer_queue() ) return;
+
+	//  release the range from the transfer family...
+	vk::BufferMemoryBarrier barrier {};
+	barrier.srcQueueFamilyIndex = TransferFamily;
+	barrier.dstQueueFamilyIndex = GraphicsFamily;
+	barrier.buffer = dst_buffer;
+	barrier.offset = dst_offset;
+	barrier.size = size;
+	barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+	barrier.dstAccessMask = {};
+	TransferCommandBuffer.pipelineBarrier(
+		vk::PipelineStageFlagBits::eTransfer,
+		vk::PipelineStageFlagBits::eBottomOfPipe,
+		{},
+		nullptr,
+		barrier,
+		nullptr
+	);
+
+	//  ...and acquire it on the graphics family, once the transfer submission signaled
+	barrier.srcAccessMask = {};
+	barrier.dstAccessMask = UPLOAD_DST_ACCESS;
+	GraphicsCommandBuffer.pipelineBarrier(
+		UPLOAD_DST_STAGES,  //  chains with the semaphore wait stages
+		UPLOAD_DST_STAGES,
+		{},
+		nullptr,
+		barrier,
+		nullptr
+	);
+}
+
+void VulkanUploadContext::upload_image( const void* data, vk::DeviceSize size, vk::Image image, uint32_t width, uint32_t height, uint32_t mip_levels )
+{
+	VulkanStagingRegion staging = stage( data, size );
+	record_transition_image_layout( TransferCommandBuffer, image, vk::ImageLayout::eUndefined, vk::ImageLayout::eTransferDstOptimal, mip_levels );
+	record_copy_image_buffer( TransferCommandBuffer, staging.Buffer, staging.Offset, image, width, height );
+
+	if ( !has_dedicated_transfer_queue() ) return;
+
+	//  hand every mip over to the graphics family, staying in transfer dst
+	//  layout so that mipmaps can be generated from there
+	vk::ImageMemoryBarrier barrier {};
+	barrier.oldLayout = vk::ImageLayout::eTransferDstOptimal;
+	barrier.newLayout = vk::ImageLayout::eTransferDstOptimal;
+	barrier.srcQueueFamilyIndex = TransferFamily;
+	barrier.dstQueueFamilyIndex = GraphicsFamily;
+	barrier.image = image;
+	barrier.subresourceRange.aspectMask = vk::ImageAspectFlagBits::eColor;
+	barrier.subresourceRange.baseMipLevel = 0;
+	barrier.subresourceRange.levelCount = mip_levels;
+	barrier.subresourceRange.baseArrayLayer = 0;
+	barrier.subresourceRange.layerCount = 1;
+	barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+	barrier.dstAccessMask = {};
+	TransferCommandBuffer.pipelineBarrier(
+		vk::PipelineStageFlagBits::eTransfer,
+		vk::PipelineStageFlagBits::eBottomOfPipe,
+		{},
+		nullptr,
+		nullptr,
+		barrier
+	);
+
+	barrier.srcAccessMask = {};
+	barrier.dstAccessMask = UPLOAD_DST_ACCESS;
+	GraphicsCommandBuffer.pipelineBarrier(
+		UPLOAD_DST_STAGES,  //  chains with the semaphore wait stages
+		UPLOAD_DST_STAGES,
+		{},
+		nullptr,
+		nullptr,
+		barrier
+	);
+}
+
+void VulkanUploadContext::transition_image_layout( vk::Image image, vk::ImageLayout old_layout, vk::ImageLayout new_layout, uint32_t mip_levels )
+{
+	record_transition_image_layout( GraphicsCommandBuffer, image, old_layout, new_layout, mip_levels );
+}
+
+void VulkanUploadContext::generate_mipmaps( vk::Image image, vk::Format format, int32_t width, int32_t height, uint32_t mip_levels )
+{
+	record_generate_mipmaps( PhysicalDevice, GraphicsCommandBuffer, image, format, width, height, mip_levels );
+}
+
+VulkanStagingRegion VulkanUploadContext::stage( const void* data, vk::DeviceSize size )
+{
+	if ( !IsRecording ) throw std::runtime_error( "Upload context is not recording" );
+
+	//  the ring can only make room by waiting on submitted uploads: submit
+	//  what is recorded so far when this upload may not fit next to it
+	//  (worst case wastes almost its own size when wrapping around)
+	vk::DeviceSize ring_size = StagingRing->get_size();
+	vk::DeviceSize pending_size = StagingRing->get_pending_size();
+	if ( pending_size > 0 && size <= ring_size && pending_size + size * 2 + 16 > ring_size )
+	{
+		flush();
+	}
+
+	VulkanStagingRegion region = StagingRing->allocate( size );
+	memcpy( region.MappedData, data, (size_t)size );
+	return region;
+}
+
+void VulkanUploadContext::begin_command_buffers()
+{
+	TransferCommandBuffer = create_command_buffer( Device, TransferCommandPool );
+	GraphicsCommandBuffer = has_dedicated_transfer_queue()
+		? create_command_buffer( Device, GraphicsCommandPool )
+		: TransferCommandBuffer;
+}
+
+void VulkanUploadContext::submit_command_buffers()
+{
+	//  make transfer writes visible to every later command on the graphics queue,
+	//  so that uploaded resources can be used without waiting on the ticket
+	vk::MemoryBarrier barrier {};
+	barrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+	barrier.dstAccessMask = UPLOAD_DST_ACCESS;
+	GraphicsCommandBuffer.pipelineBarrier(
+		vk::PipelineStageFlagBits::eTransfer,
+		UPLOAD_DST_STAGES,
+		{},
+		barrier,
+		nullptr,
+		nullptr
+	);
+
+	InFlightBatch batch {};
+	batch.TransferCommandBuffer = TransferCommandBuffer;
+
+	if ( has_dedicated_transfer_queue() )
+	{
+		batch.GraphicsCommandBuffer = GraphicsCommandBuffer;
+
+		if ( !FreeSemaphores.empty() )
+		{
+			batch.Semaphore = FreeSemaphores.back();
+			FreeSemaphores.pop_back();
+		}
+		else
+		{
+			batch.Semaphore = Device.createSemaphore( vk::SemaphoreCreateInfo {} );
+		}
+
+		//  copies on the transfer queue...
+		TransferCommandBuffer.end();
+
+		vk::SubmitInfo transfer_submit_info {};
+		transfer_submit_info.commandBufferCount = 1;
+		transfer_submit_info.pCommandBuffers = &TransferCommandBuffer;
+		transfer_submit_info.signalSemaphoreCount = 1;
+		transfer_submit_info.pSignalSemaphores = &batch.Semaphore;
+		TransferQueue.submit( transfer_submit_info, nullptr );
+	}
+
+	//  ...then acquires & mipmaps on the graphics queue; its fence lets the ring
+	//  reclaim the staging space, as it can only signal after the copies are done
+	GraphicsCommandBuffer.end();
+
+	vk::PipelineStageFlags wait_stage = UPLOAD_DST_STAGES;
+	vk::SubmitInfo submit_info {};
+	submit_info.commandBufferCount = 1;
+	submit_info.pCommandBuffers = &GraphicsCommandBuffer;
+	if ( batch.Semaphore )
+	{
+		submit_info.waitSemaphoreCount = 1;
+		submit_info.pWaitSemaphores = &batch.Semaphore;
+		submit_info.pWaitDstStageMask = &wait_stage;
+	}
+	GraphicsQueue.submit( submit_info, StagingRing->acquire_fence() );
+
+	batch.Submission = StagingRing->get_submission_count();
+	InFlightBatches.push_back( batch );
+
+	TransferCommandBuffer = nullptr;
+	GraphicsCommandBuffer = nullptr;
+}
+
+void VulkanUploadContext::flush()
+{
+	submit_command_buffers();
+	begin_command_buffers();
+}
+
+void VulkanUploadContext::free_completed_batches()
+{
+	while ( !InFlightBatches.empty() )
+	{
+		const InFlightBatch& batch = InFlightBatches.front();
+		if ( !StagingRing->is_complete( batch.Submission ) ) break;
+
+		Device.freeCommandBuffers( TransferCommandPool, batch.TransferCommandBuffer );
+		if ( batch.GraphicsCommandBuffer )
+		{
+			Device.freeCommandBuffers( GraphicsCommandPool, batch.GraphicsCommandBuffer );
+		}
+		if ( batch.Semaphore )
+		{
+			FreeSemaphores.push_back( batch.Semaphore );
+		}
+		InFlightBatches.pop_front();
+	}
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+
+#include <vulkan/vulkan.hpp>
+
+#include "vulkan-staging-ring.h"
+
+struct VulkanUploadTicket
+{
+	uint64_t Submission = 0;
+};
+
+//  Records many uploads (buffer copies, image copies, layout transitions,
+//  mipmaps generation) into one batch, submitted at once and tracked by a
+//  ticket instead of waiting for the queue to be idle.
+//
+//  When the device exposes a transfer queue family, copies run there and
+//  resources are handed over to the graphics family with ownership transfer
+//  barriers; the graphics queue then only records a short acquire submission
+//  (plus the blits of mipmaps generation, which need a graphics queue).
+class VulkanUploadContext
+{
+public:
+	void init(
+		vk::PhysicalDevice physical_device,
+		vk::Device device,
+		VulkanStagingRing* staging_ring,
+		vk::Queue graphics_queue,
+		uint32_t graphics_family,
+		vk::Queue transfer_queue,
+		uint32_t transfer_family
+	);
+	void release();
+
+	void begin();
+	VulkanUploadTicket submit();
+	bool is_recording() const { return IsRecording; }
+
+	bool is_complete( const VulkanUploadTicket& ticket );
+	void wait( const VulkanUploadTicket& ticket );
+
+	//  copy data through the staging ring into a buffer
+	void upload_buffer( const void* data, vk::DeviceSize size, vk::Buffer dst_buffer, vk::DeviceSize dst_offset = 0 );
+	//  transition every mip of an image to transfer dst layout and copy
+	//  pixels through the staging ring into its first mip
+	void upload_image( const void* data, vk::DeviceSize size, vk::Image image, uint32_t width, uint32_t height, uint32_t mip_levels );
+	//  graphics queue work, ordered after the copies of the batch
+	void transition_image_layout( vk::Image image, vk::ImageLayout old_layout, vk::ImageLayout new_layout, uint32_t mip_levels );
+	void generate_mipmaps( vk::Image image, vk::Format format, int32_t width, int32_t height, uint32_t mip_levels );
+
+	//  record GPU-side work between device resources (e.g. relocations) in the
+	//  current batch, on the graphics queue after the batch copies
+	vk::CommandBuffer get_graphics_command_buffer() const { return GraphicsCommandBuffer; }
+
+	bool has_dedicated_transfer_queue() const { return GraphicsFamily != TransferFamily; }
+
+private:
+	struct InFlightBatch
+	{
+		uint64_t Submission = 0;
+		vk::CommandBuffer TransferCommandBuffer;
+		vk::CommandBuffer GraphicsCommandBuffer;
+		vk::Semaphore Semaphore;
+	};
+
+	vk::PhysicalDevice PhysicalDevice;
+	vk::Device Device;
+	VulkanStagingRing* StagingRing = nullptr;
+
+	vk::Queue GraphicsQueue;
+	uint32_t GraphicsFamily = 0;
+	vk::CommandPool GraphicsCommandPool;
+
+	vk::Queue TransferQueue;
+	uint32_t TransferFamily = 0;
+	vk::CommandPool TransferCommandPool;
+
+	//  same command buffer for both without a dedicated transfer queue
+	vk::CommandBuffer TransferCommandBuffer;
+	vk::CommandBuffer GraphicsCommandBuffer;
+	bool IsRecording = false;
+
+	std::deque<InFlightBatch> InFlightBatches;
+	std::vector<vk::Semaphore> FreeSemaphores;
+
+	VulkanStagingRegion stage( const void* data, vk::DeviceSize size );
+	void begin_command_buffers();
+	void submit_command_buffers();
+	//  submit what has been recorded so far and continue in new command buffers
+	void flush();
+	void free_completed_batches();
+};
@@ -5,9 +5,19 @@
 #include <vulkan/vulkan.hpp>
 #include <glm/glm.hpp>
 
+#include "vulkan-memory-allocator.h"
+
 const std::vector<const char*> VulkanDeviceExtensions
 {
-	VK_KHR_SWAPCHAIN_EXTENSION_NAME
+	VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+	VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME,  //  bindless textures, core in Vulkan 1.2
+};
+
+//  enabled only when supported, check with VulkanRenderer::is_device_extension_enabled
+const std::vector<const char*> VulkanOptionalDeviceExtensions
+{
+	VK_EXT_MEMORY_BUDGET_EXTENSION_NAME,
+	VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME,  //  GPU culling, core in Vulkan 1.2
 };
 
 const bool VulkanEnableValidationLayers = false;
@@ -20,6 +30,7 @@ struct VulkanQueueFamilyIndices
 {
 	int GraphicsFamily = -1;
 	int PresentationFamily = -1;
+	int TransferFamily = -1;  //  dedicated transfer family if any, graphics family otherwise
 
 	bool is_valid() 
 	{ 
@@ -47,6 +58,14 @@ struct VulkanSwapchainImage
 	vk::ImageView ImageView;
 };
 
+//  vertex formats of meshes, each one drawn by its own pipeline variant
+enum class VulkanVertexLayout : uint32_t
+{
+	Full,  //  VulkanVertex
+	Compact,  //  VulkanCompactVertex, without colors
+	Count,
+};
+
 struct VulkanVertex
 {
 	glm::vec3 Position;
@@ -54,6 +73,19 @@ struct VulkanVertex
 	glm::vec2 UV;
 };
 
+//  under half the size of VulkanVertex: position quantized to the bounds of
+//  its mesh (w unused) and UV as half floats; shaders read no normal yet
+struct VulkanCompactVertex
+{
+	uint16_t Position[4];  //  unorm
+	uint16_t UV[2];
+};
+
+static uint32_t get_vertex_stride( VulkanVertexLayout layout )
+{
+	return layout == VulkanVertexLayout::Compact ? sizeof( VulkanCompactVertex ) : sizeof( VulkanVertex );
+}
+
 static std::vector<char> read_shader_file( const std::string& filename )
 {
 	//  open shader file
@@ -72,38 +104,15 @@ static std::vector<char> read_shader_file( const std::string& filename )
 	return buffer;
 }
 
-static uint32_t find_memory_type_index( vk::PhysicalDevice physical_device, uint32_t types, vk::MemoryPropertyFlags properties )
-{
-	// Get properties of physical device
-	vk::PhysicalDeviceMemoryProperties memoryProperties = physical_device.getMemoryProperties();
-
-	for ( uint32_t i = 0; i < memoryProperties.memoryTypeCount; ++i )
-	{
-		// We iterate through each bit, shifting of 1 (with i) each time.
-		// This way we go through each type to check it is allowed.
-		if ( ( types & ( 1 << i ) ) &&
-			// Desired property bit flags are part of memory type's property flags.
-			// By checking the equality, we check that all properties are available at the
-			// same time, and not only one property is common.
-			( memoryProperties.memoryTypes[i].propertyFlags & properties ) == properties )
-		{
-			// If this type is an allowed type and has the flags we want, then i
-			// is the current index of the memory type we want to use. Return it.
-			return i;
-		}
-	}
-
-	return 0;
-}
-
 static void create_buffer( 
-	vk::PhysicalDevice physical_device, 
-	vk::Device device, 
+	VulkanMemoryAllocator* allocator, 
 	vk::DeviceSize buffer_size, 
 	vk::BufferUsageFlags buffer_usage,
 	vk::MemoryPropertyFlags buffer_properties, 
 	vk::Buffer* buffer, 
-	vk::DeviceMemory* buffer_memory 
+	VulkanAllocation* buffer_allocation,
+	VulkanMemoryCategory category = VulkanMemoryCategory::Other,
+	const std::string& name = ""
 )
 {
 	// Buffer info
@@ -113,34 +122,12 @@ static void create_buffer(
 	buffer_info.usage = buffer_usage;
 	// Is vertex buffer sharable ? Here: no.
 	buffer_info.sharingMode = vk::SharingMode::eExclusive;
-	*buffer = device.createBuffer( buffer_info );
-
-	// Get buffer memory requirements
-	vk::MemoryRequirements memoryRequirements;
-	device.getBufferMemoryRequirements( *buffer, &memoryRequirements );
-
-	// Allocate memory to buffer
-	vk::MemoryAllocateInfo memory_alloc_info {};
-	memory_alloc_info.allocationSize = memoryRequirements.size;
-	memory_alloc_info.memoryTypeIndex = find_memory_type_index(
-		physical_device,
-		// Index of memory type on physical device that has required bit flags
-		memoryRequirements.memoryTypeBits,
-		buffer_properties
-	);
+	*buffer = allocator->get_device().createBuffer( buffer_info );
 
-	// Allocate memory to VkDeviceMemory
-	auto result = device.allocateMemory( &memory_alloc_info, nullptr, buffer_memory );
-	if ( result != vk::Result::eSuccess )
-	{
-		throw std::runtime_error( "Failed to allocate vertex buffer memory" );
-	}
-
-	// Allocate memory to given vertex buffer
-	device.bindBufferMemory( *buffer, *buffer_memory, 0 );
+	// Sub-allocate memory from a shared block and bind it to the buffer
+	*buffer_allocation = allocator->allocate_buffer_memory( *buffer, buffer_properties, category, name );
 }
 
-
 static vk::CommandBuffer create_command_buffer( vk::Device device, vk::CommandPool commandPool )
 {
 	// Command buffer to hold transfer commands
@@ -165,70 +152,33 @@ static vk::CommandBuffer create_command_buffer( vk::Device device, vk::CommandPo
 	return commandBuffer;
 }
 
-static void submit_command_buffer(
-	vk::Device device,
-	vk::CommandPool commandPool,
-	vk::Queue queue,
-	vk::CommandBuffer commandBuffer
-)
-{
-	// End record commands
-	commandBuffer.end();
-
-	// Queue submission info
-	vk::SubmitInfo submitInfo {};
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &commandBuffer;
-
-	// Submit transfer commands to transfer queue and wait until it finishes
-	queue.submit( 1, &submitInfo, nullptr );
-	queue.waitIdle();
-
-	// Free temporary command buffer
-	device.freeCommandBuffers( commandPool, 1, &commandBuffer );
-}
-
-static void copy_buffer( 
-	vk::Device device, 
-	vk::Queue transfer_queue,
-	vk::CommandPool transfer_command_pool, 
+static void record_copy_buffer( 
+	vk::CommandBuffer command_buffer, 
 	vk::Buffer src_buffer, 
+	vk::DeviceSize src_offset,
 	vk::Buffer dst_buffer, 
-	vk::DeviceSize bufferSize 
+	vk::DeviceSize dst_offset,
+	vk::DeviceSize bufferSize
 )
 {
-	// Command buffer to hold transfer commands
-	vk::CommandBuffer transferCommandBuffer = create_command_buffer( device, transfer_command_pool );
-
 	// Region of data to copy from and to
 	vk::BufferCopy bufferCopyRegion {};
-	bufferCopyRegion.srcOffset = 0;		// From the start of first buffer...
-	bufferCopyRegion.dstOffset = 0;		// ...copy to the start of second buffer
+	bufferCopyRegion.srcOffset = src_offset;		// From the staging offset of first buffer...
+	bufferCopyRegion.dstOffset = dst_offset;		// ...copy to the given offset of second buffer
 	bufferCopyRegion.size = bufferSize;
 
 	// Copy src buffer to dst buffer
-	transferCommandBuffer.copyBuffer( src_buffer, dst_buffer, bufferCopyRegion );
-
-	// Submit and free
-	submit_command_buffer( 
-		device, 
-		transfer_command_pool,
-		transfer_queue, 
-		transferCommandBuffer 
-	);
+	command_buffer.copyBuffer( src_buffer, dst_buffer, bufferCopyRegion );
 }
 
-static void copy_image_buffer( vk::Device device, vk::Queue transferQueue,
-	vk::CommandPool transferCommandPool, vk::Buffer srcBuffer, vk::Image dstImage,
-	uint32_t width, uint32_t height )
+static void record_copy_image_buffer( vk::CommandBuffer transferCommandBuffer,
+	vk::Buffer srcBuffer, vk::DeviceSize srcOffset,
+	vk::Image dstImage, uint32_t width, uint32_t height )
 {
-	// Create buffer
-	vk::CommandBuffer transferCommandBuffer = create_command_buffer( device, transferCommandPool );
-
 	vk::BufferImageCopy imageRegion {};
 	// All data of image is tightly packed
 	// -- Offset into data
-	imageRegion.bufferOffset = 0;
+	imageRegion.bufferOffset = srcOffset;
 	// -- Row length of data to calculate data spacing
 	imageRegion.bufferRowLength = 0;
 	// -- Image height of data to calculate data spacing
@@ -250,27 +200,16 @@ static void copy_image_buffer( vk::Device device, vk::Queue transferQueue,
 	// Copy buffer to image
 	transferCommandBuffer.copyBufferToImage( srcBuffer,
 		dstImage, vk::ImageLayout::eTransferDstOptimal, 1, &imageRegion );
-
-	submit_command_buffer( 
-		device, 
-		transferCommandPool,
-		transferQueue, 
-		transferCommandBuffer 
-	);
 }
 
-static void transition_image_layout( 
-	vk::Device device, 
-	vk::Queue queue, 
-	vk::CommandPool commandPool,
+static void record_transition_image_layout( 
+	vk::CommandBuffer commandBuffer,
 	vk::Image image, 
 	vk::ImageLayout oldLayout, 
 	vk::ImageLayout newLayout,
 	uint32_t mip_levels
 )
 {
-	vk::CommandBuffer commandBuffer = create_command_buffer( device, commandPool );
-
 	vk::ImageMemoryBarrier imageMemoryBarrier {};
 	imageMemoryBarrier.oldLayout = oldLayout;
 	imageMemoryBarrier.newLayout = newLayout;
@@ -332,15 +271,17 @@ static void transition_image_layout(
 		// Image memory barrier count and data
 		1, &imageMemoryBarrier
 	);
+}
 
-	submit_command_buffer( device, commandPool, queue, commandBuffer );
+static bool is_linear_blit_supported( vk::PhysicalDevice phys_device, vk::Format image_format )
+{
+	vk::FormatProperties format_properties = phys_device.getFormatProperties( image_format );
+	return (bool)( format_properties.optimalTilingFeatures & vk::FormatFeatureFlagBits::eSampledImageFilterLinear );
 }
 
-static void generate_mipmaps( 
+static void record_generate_mipmaps( 
 	vk::PhysicalDevice phys_device,
-	vk::Device device, 
-	vk::Queue queue, 
-	vk::CommandPool command_pool,
+	vk::CommandBuffer command_buffer,
 	vk::Image image, 
 	vk::Format image_format,
 	int32_t image_width, 
@@ -349,14 +290,11 @@ static void generate_mipmaps(
 )
 {
 	//  check image format supports linear blitting
-	vk::FormatProperties format_properties = phys_device.getFormatProperties( image_format );
-	if ( !( format_properties.optimalTilingFeatures & vk::FormatFeatureFlagBits::eSampledImageFilterLinear ) )
+	if ( mip_levels > 1 && !is_linear_blit_supported( phys_device, image_format ) )
 	{
 		throw std::runtime_error( "Texture image format does not support linear blitting" );
 	}
 
-	vk::CommandBuffer command_buffer = create_command_buffer( device, command_pool );
-
 	// The fields set below will remain the same for all barriers.
 	// On the contrary, subresourceRange.miplevel, oldLayout, newLayout, srcAccessMask,
 	// and dstAccessMask will be changed for each transition.
@@ -471,6 +409,4 @@ static void generate_mipmaps(
 		0, nullptr,
 		0, nullptr,
 		1, &barrier );
-
-	submit_command_buffer( device, command_pool, queue, command_buffer );
 }
\ No newline at end of file